@@ -0,0 +1,693 @@
+/**
+ * @file df_ctl.c
+ *
+ * df_ctl : command line client of the control interface of a dfuse mount
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "df_ioctl.h"
+#include "df_scan.h"
+
+/* bytes copied per ioctl, not to hold the mount's connection for too long */
+#define COPY_CHUNK_SIZE (64LL * 1024 * 1024)
+
+#define FREE(p) do { \
+	if (p) \
+		free(p); \
+	(p) = NULL; \
+} while (0) \
+
+static void char_array_free(char **array)
+{
+	FREE(*array);
+}
+
+/*
+ * reports the failure of an ioctl on a directory, which the mount refuses if
+ * it's kernel or libfuse doesn't support them
+ */
+static void dir_ioctl_error(const char *name)
+{
+	if (ENOTTY == errno)
+		fprintf(stderr, "%s: the mount doesn't support ioctls on "
+				"directories, it's kernel or libfuse is too "
+				"old\n", name);
+	else
+		perror(name);
+}
+
+static void usage(int status)
+{
+	fprintf(status ? stderr : stdout,
+		"usage: df_ctl COMMAND ARGS...\n"
+		"commands:\n"
+		"\tcp SRC DST\tcopy SRC to DST, both on the same dfuse mount,\n"
+		"\t\t\twithout the data leaving the device\n"
+		"\trm PATH...\tremove PATHs recursively\n"
+		"\tchmod MODE PATH...\n"
+		"\t\t\tset the octal MODE of PATHs, recursively\n"
+		"\tchown [UID][:GID] PATH...\n"
+		"\t\t\tset the owner and / or the group of PATHs,\n"
+		"\t\t\trecursively, ids are those of the device\n"
+		"\tmkdir PATH...\tcreate PATHs and their missing parents\n"
+		"\tpush LOCAL DST\tcopy the local file LOCAL to DST, on a dfuse\n"
+		"\t\t\tmount, sending only the blocks which differ\n"
+		"\tpull SRC DIR\tcopy SRC, on a dfuse mount, into the local\n"
+		"\t\t\tdirectory DIR, recursively, in a single stream\n"
+		"\timport SRC DIR\tcopy the local SRC into DIR, on a dfuse\n"
+		"\t\t\tmount, recursively, in a single stream\n"
+		"\tchanged [-t SECONDS | -r FILE] [-m MANIFEST] [-o OUTPUT] DIR\n"
+		"\t\t\tlist the entries under DIR modified after the epoch\n"
+		"\t\t\ttime SECONDS, or FILE's mtime (M), and with a\n"
+		"\t\t\tMANIFEST, those which differ from it (M), aren't\n"
+		"\t\t\tin it (A) or are missing (D), OUTPUT gets the\n"
+		"\t\t\tentries listed, usable as a MANIFEST\n"
+		"\tsum [-s] [-b BLOCK_SIZE] FILE...\n"
+		"\t\t\tprint the xxHash64, or SHA-256 with -s, of FILEs,\n"
+		"\t\t\tor of each of their blocks, computed by the device\n");
+
+	exit(status);
+}
+
+/*
+ * computes the path of path relatively to the root of the mount point it
+ * belongs to, i.e. the path the device knows it by, the last components of
+ * path may not exist yet
+ * @param root If not NULL, on output, root of the mount point, to be freed
+ * @return 0 on success, -1 on error, with errno set
+ */
+static int mount_path(const char *path, char *out, char **root, dev_t *dev)
+{
+	int ret;
+	struct stat st;
+	struct stat parent_st;
+	const char *rel;
+	const char *missing;
+	char __attribute__((cleanup(char_array_free))) *existing = NULL;
+	char __attribute__((cleanup(char_array_free))) *real = NULL;
+	char __attribute__((cleanup(char_array_free))) *top = NULL;
+	char *parent;
+	char *slash;
+
+	/* find the deepest ancestor which exists */
+	existing = strdup(path);
+	if (NULL == existing)
+		return -1;
+	for (;;) {
+		real = realpath('\0' == *existing ? "." : existing, NULL);
+		if (NULL != real)
+			break;
+		if (ENOENT != errno || '\0' == *existing)
+			return -1;
+		slash = strrchr(existing, '/');
+		if (NULL == slash)
+			*existing = '\0';
+		else
+			slash[slash == existing ? 1 : 0] = '\0';
+	}
+	missing = path + strlen(existing);
+	while ('/' == *missing)
+		missing++;
+	if (-1 == stat(real, &st))
+		return -1;
+	*dev = st.st_dev;
+
+	/* climb up to the last directory on the same device */
+	top = strdup(real);
+	if (NULL == top)
+		return -1;
+	while (0 != strcmp(top, "/")) {
+		parent = strdup(top);
+		if (NULL == parent)
+			return -1;
+		slash = strrchr(parent, '/');
+		slash[slash == parent ? 1 : 0] = '\0';
+		if (-1 == stat(parent, &parent_st) ||
+				parent_st.st_dev != st.st_dev) {
+			free(parent);
+			break;
+		}
+		free(top);
+		top = parent;
+	}
+
+	rel = real + (strcmp(top, "/") ? strlen(top) : 0);
+	ret = snprintf(out, DF_IOC_PATH_MAX, "%s%s%s", '\0' == *rel ? "" : rel,
+			'\0' == *rel || '\0' != *missing ? "/" : "", missing);
+	if (ret >= DF_IOC_PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (NULL != root) {
+		*root = top;
+		top = NULL;
+	}
+
+	return 0;
+}
+
+static int cmd_cp(int argc, char *argv[])
+{
+	int ret;
+	int fd;
+	dev_t src_dev;
+	struct stat src_st;
+	struct stat dst_st;
+	int64_t offset = 0;
+	struct df_ioc_copy_range arg;
+
+	if (2 != argc)
+		usage(EXIT_FAILURE);
+
+	memset(&arg, 0, sizeof(arg));
+	ret = mount_path(argv[0], arg.src, NULL, &src_dev);
+	if (-1 == ret || -1 == stat(argv[0], &src_st)) {
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* O_TRUNC would destroy the source before it is copied */
+	if (0 == stat(argv[1], &dst_st) && dst_st.st_dev == src_st.st_dev &&
+			dst_st.st_ino == src_st.st_ino) {
+		fprintf(stderr, "%s and %s are the same file\n", argv[0],
+				argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC,
+			src_st.st_mode & 07777);
+	if (-1 == fd) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (-1 == fstat(fd, &dst_st) || dst_st.st_dev != src_dev) {
+		fprintf(stderr, "%s and %s must be on the same dfuse mount\n",
+				argv[0], argv[1]);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	do {
+		arg.src_offset = offset;
+		arg.dst_offset = offset;
+		arg.length = COPY_CHUNK_SIZE;
+		ret = ioctl(fd, DF_IOC_COPY_RANGE, &arg);
+		if (-1 == ret) {
+			perror("ioctl DF_IOC_COPY_RANGE");
+			close(fd);
+			return EXIT_FAILURE;
+		}
+		offset += arg.copied;
+	} while (arg.copied == COPY_CHUNK_SIZE);
+
+	if (-1 == close(fd)) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int cmd_push(int argc, char *argv[])
+{
+	int fd;
+	int ret;
+	dev_t dev;
+	static struct df_ioc_push arg;
+	char __attribute__((cleanup(char_array_free))) *src = NULL;
+	char __attribute__((cleanup(char_array_free))) *root = NULL;
+
+	if (2 != argc)
+		usage(EXIT_FAILURE);
+
+	/* the host daemon doesn't run in our current directory */
+	src = realpath(argv[0], NULL);
+	if (NULL == src || strlen(src) >= DF_IOC_PATH_MAX) {
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+	strcpy(arg.src, src);
+	if (-1 == mount_path(argv[1], arg.dst, &root, &dev)) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	fd = open(root, O_RDONLY | O_DIRECTORY);
+	if (-1 == fd) {
+		perror(root);
+		return EXIT_FAILURE;
+	}
+	ret = ioctl(fd, DF_IOC_PUSH, &arg);
+	close(fd);
+	if (-1 == ret) {
+		dir_ioctl_error(argv[1]);
+		return EXIT_FAILURE;
+	}
+	printf("%s: %lld bytes, %lld sent, %lld found on the device\n",
+			argv[1], (long long)arg.size, (long long)arg.literal,
+			(long long)arg.matched);
+
+	return EXIT_SUCCESS;
+}
+
+static int cmd_pull(int argc, char *argv[])
+{
+	int fd;
+	int ret;
+	dev_t dev;
+	static struct df_ioc_pull arg;
+	char __attribute__((cleanup(char_array_free))) *dst = NULL;
+	char __attribute__((cleanup(char_array_free))) *root = NULL;
+
+	if (2 != argc)
+		usage(EXIT_FAILURE);
+
+	if (-1 == mount_path(argv[0], arg.src, &root, &dev)) {
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+	/* the host daemon doesn't run in our current directory */
+	dst = realpath(argv[1], NULL);
+	if (NULL == dst || strlen(dst) >= DF_IOC_PATH_MAX) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	strcpy(arg.dst, dst);
+
+	fd = open(root, O_RDONLY | O_DIRECTORY);
+	if (-1 == fd) {
+		perror(root);
+		return EXIT_FAILURE;
+	}
+	ret = ioctl(fd, DF_IOC_PULL, &arg);
+	close(fd);
+	if (-1 == ret) {
+		dir_ioctl_error(argv[0]);
+		return EXIT_FAILURE;
+	}
+	printf("%s: %lld entries, %lld bytes transferred, %lld errors\n",
+			argv[0], (long long)arg.entries, (long long)arg.bytes,
+			(long long)arg.errors);
+
+	return 0 == arg.errors ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int cmd_import(int argc, char *argv[])
+{
+	int fd;
+	int ret;
+	dev_t dev;
+	static struct df_ioc_import arg;
+	char __attribute__((cleanup(char_array_free))) *src = NULL;
+	char __attribute__((cleanup(char_array_free))) *root = NULL;
+
+	if (2 != argc)
+		usage(EXIT_FAILURE);
+
+	/* the host daemon doesn't run in our current directory */
+	src = realpath(argv[0], NULL);
+	if (NULL == src || strlen(src) >= DF_IOC_PATH_MAX) {
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+	strcpy(arg.src, src);
+	if (-1 == mount_path(argv[1], arg.dst, &root, &dev)) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	fd = open(root, O_RDONLY | O_DIRECTORY);
+	if (-1 == fd) {
+		perror(root);
+		return EXIT_FAILURE;
+	}
+	ret = ioctl(fd, DF_IOC_IMPORT, &arg);
+	close(fd);
+	fputs(arg.messages, stderr);
+	if (-1 == ret) {
+		dir_ioctl_error(argv[1]);
+		return EXIT_FAILURE;
+	}
+	printf("%s: %lld entries, %lld bytes transferred, %lld errors\n",
+			argv[1], (long long)arg.entries, (long long)arg.bytes,
+			(long long)arg.errors);
+
+	return 0 == arg.errors ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* applies a DF_IOC_TREE operation to each path */
+static int tree(int32_t op, uint32_t mode, int64_t uid, int64_t gid, int argc,
+		char *argv[])
+{
+	int i;
+	int fd;
+	int ret;
+	int status = EXIT_SUCCESS;
+	dev_t dev;
+	static struct df_ioc_tree arg;
+
+	if (0 == argc)
+		usage(EXIT_FAILURE);
+
+	for (i = 0; i < argc; i++) {
+		char __attribute__((cleanup(char_array_free))) *root = NULL;
+
+		memset(&arg, 0, sizeof(arg));
+		arg.op = op;
+		arg.mode = mode;
+		arg.uid = uid;
+		arg.gid = gid;
+		ret = mount_path(argv[i], arg.path, &root, &dev);
+		if (-1 == ret) {
+			perror(argv[i]);
+			status = EXIT_FAILURE;
+			continue;
+		}
+
+		fd = open(root, O_RDONLY | O_DIRECTORY);
+		if (-1 == fd) {
+			perror(root);
+			status = EXIT_FAILURE;
+			continue;
+		}
+		ret = ioctl(fd, DF_IOC_TREE, &arg);
+		close(fd);
+		if (-1 == ret) {
+			dir_ioctl_error(argv[i]);
+			status = EXIT_FAILURE;
+			continue;
+		}
+
+		fputs(arg.errors, stderr);
+		printf("%s: %lld entries processed, %lld errors\n", argv[i],
+				(long long)arg.done, (long long)arg.failed);
+		if (0 != arg.failed)
+			status = EXIT_FAILURE;
+	}
+
+	return status;
+}
+
+static int cmd_chmod(int argc, char *argv[])
+{
+	long mode;
+	char *end;
+
+	if (1 > argc)
+		usage(EXIT_FAILURE);
+	mode = strtol(argv[0], &end, 8);
+	if ('\0' == *argv[0] || '\0' != *end || 0 > mode || 07777 < mode) {
+		fprintf(stderr, "invalid mode %s\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	return tree(DF_IOC_TREE_CHMOD, mode, -1, -1, argc - 1, argv + 1);
+}
+
+/* parses an id, -1 if str is empty */
+static int parse_id(const char *str, size_t len, int64_t *id)
+{
+	char *end;
+
+	*id = -1;
+	if (0 == len)
+		return 0;
+	*id = strtoll(str, &end, 10);
+
+	return end == str + len && 0 <= *id ? 0 : -1;
+}
+
+static int cmd_chown(int argc, char *argv[])
+{
+	int64_t uid;
+	int64_t gid;
+	const char *colon;
+	size_t len;
+
+	if (1 > argc)
+		usage(EXIT_FAILURE);
+	colon = strchr(argv[0], ':');
+	len = NULL == colon ? strlen(argv[0]) : (size_t)(colon - argv[0]);
+	if (-1 == parse_id(argv[0], len, &uid) || (NULL != colon &&
+			-1 == parse_id(colon + 1, strlen(colon + 1), &gid))) {
+		fprintf(stderr, "invalid owner %s\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (NULL == colon)
+		gid = -1;
+
+	return tree(DF_IOC_TREE_CHOWN, 0, uid, gid, argc - 1, argv + 1);
+}
+
+static void print_digest(const uint8_t *digest, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		printf("%02x", digest[i]);
+}
+
+/* prints the digest of each block, or of the whole file if block_size is 0 */
+static int checksum(const char *path, int32_t algo, int64_t block_size)
+{
+	int fd;
+	int32_t i;
+	size_t digest_size = DF_IOC_HASH_SHA256 == algo ? 32 : 8;
+	int64_t offset = 0;
+	static struct df_ioc_checksum arg;
+
+	fd = open(path, O_RDONLY);
+	if (-1 == fd) {
+		perror(path);
+		return -1;
+	}
+
+	do {
+		memset(&arg, 0, sizeof(arg));
+		arg.offset = offset;
+		arg.length = -1;
+		arg.block_size = block_size;
+		arg.algo = algo;
+		if (-1 == ioctl(fd, DF_IOC_CHECKSUM, &arg)) {
+			perror(path);
+			close(fd);
+			return -1;
+		}
+
+		for (i = 0; i < arg.count; i++) {
+			if (0 != block_size)
+				printf("%lld ", (long long)offset);
+			print_digest(arg.digests + i * digest_size,
+					digest_size);
+			printf("  %s\n", path);
+			offset += block_size;
+		}
+	} while (0 != block_size && offset < arg.size && 0 != arg.count);
+	close(fd);
+
+	return 0;
+}
+
+/* prints the records of a chunk and appends them to out as a manifest */
+static int print_changes(const char *dir, const uint8_t *data, size_t size,
+		FILE *out)
+{
+	size_t len;
+	size_t offset = 0;
+	static struct df_scan_entry entry;
+	static char prev[PATH_MAX];
+	uint8_t record[DF_SCAN_RECORD_MAX];
+
+	entry.path[0] = '\0';
+	while (offset < size) {
+		if (0 > df_scan_decode(data, size, &offset, &entry)) {
+			fprintf(stderr, "%s: corrupted answer\n", dir);
+			return -1;
+		}
+		printf("%c %s/%s\n", DF_SCAN_NEW == entry.kind ? 'A' :
+				DF_SCAN_REMOVED == entry.kind ? 'D' : 'M',
+				dir, entry.path);
+		if (NULL == out || DF_SCAN_REMOVED == entry.kind)
+			continue;
+
+		/* records are chained by their paths across chunks */
+		entry.kind = DF_SCAN_ENTRY;
+		len = df_scan_encode(record, sizeof(record), prev, &entry);
+		fwrite(record, len, 1, out);
+		strcpy(prev, entry.path);
+	}
+
+	return 0;
+}
+
+static int cmd_changed(int argc, char *argv[])
+{
+	int fd;
+	int opt;
+	int ret = 0;
+	char *end;
+	double since;
+	struct stat st;
+	FILE *out = NULL;
+	static struct df_ioc_scan arg;
+	char __attribute__((cleanup(char_array_free))) *manifest = NULL;
+
+	optind = 0;
+	while (-1 != (opt = getopt(argc, argv, "+t:r:m:o:"))) {
+		switch (opt) {
+		case 't':
+			since = strtod(optarg, &end);
+			if ('\0' != *end || 0 > since) {
+				fprintf(stderr, "invalid time %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			arg.since_sec = since;
+			arg.since_nsec = (since - arg.since_sec) * 1e9;
+			break;
+
+		case 'r':
+			if (-1 == stat(optarg, &st)) {
+				perror(optarg);
+				return EXIT_FAILURE;
+			}
+			arg.since_sec = st.st_mtim.tv_sec;
+			arg.since_nsec = st.st_mtim.tv_nsec;
+			break;
+
+		case 'm':
+			/* the host daemon doesn't run in our current directory */
+			FREE(manifest);
+			manifest = realpath(optarg, NULL);
+			if (NULL == manifest ||
+					strlen(manifest) >= DF_IOC_PATH_MAX) {
+				perror(optarg);
+				return EXIT_FAILURE;
+			}
+			strcpy(arg.manifest, manifest);
+			break;
+
+		case 'o':
+			if (NULL != out)
+				fclose(out);
+			out = fopen(optarg, "w");
+			if (NULL == out) {
+				perror(optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+	if (optind != argc - 1)
+		usage(EXIT_FAILURE);
+
+	fd = open(argv[optind], O_RDONLY | O_DIRECTORY);
+	if (-1 == fd) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	arg.id = -1;
+	do {
+		ret = ioctl(fd, DF_IOC_SCAN, &arg);
+		if (-1 == ret) {
+			dir_ioctl_error(argv[optind]);
+			break;
+		}
+		ret = print_changes(argv[optind], arg.data, arg.size, out);
+	} while (0 == ret && -1 != arg.id);
+	close(fd);
+	if (NULL != out && 0 != fclose(out)) {
+		perror("fclose");
+		ret = -1;
+	}
+	if (0 != arg.errors)
+		fprintf(stderr, "%s: %lld entries couldn't be scanned\n",
+				argv[optind], (long long)arg.errors);
+
+	return 0 == ret && 0 == arg.errors ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int cmd_sum(int argc, char *argv[])
+{
+	int opt;
+	int status = EXIT_SUCCESS;
+	int32_t algo = DF_IOC_HASH_XXH64;
+	int64_t block_size = 0;
+	char *end;
+
+	optind = 0;
+	while (-1 != (opt = getopt(argc, argv, "+sb:"))) {
+		switch (opt) {
+		case 's':
+			algo = DF_IOC_HASH_SHA256;
+			break;
+
+		case 'b':
+			block_size = strtoll(optarg, &end, 0);
+			if ('\0' != *end || 0 >= block_size) {
+				fprintf(stderr, "invalid block size %s\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+	if (optind == argc)
+		usage(EXIT_FAILURE);
+
+	for (; optind < argc; optind++)
+		if (-1 == checksum(argv[optind], algo, block_size))
+			status = EXIT_FAILURE;
+
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	if (2 > argc)
+		usage(EXIT_FAILURE);
+
+	if (0 == strcmp(argv[1], "-h") || 0 == strcmp(argv[1], "--help"))
+		usage(EXIT_SUCCESS);
+	if (0 == strcmp(argv[1], "cp"))
+		return cmd_cp(argc - 2, argv + 2);
+	if (0 == strcmp(argv[1], "rm"))
+		return tree(DF_IOC_TREE_REMOVE, 0, -1, -1, argc - 2, argv + 2);
+	if (0 == strcmp(argv[1], "chmod"))
+		return cmd_chmod(argc - 2, argv + 2);
+	if (0 == strcmp(argv[1], "chown"))
+		return cmd_chown(argc - 2, argv + 2);
+	if (0 == strcmp(argv[1], "push"))
+		return cmd_push(argc - 2, argv + 2);
+	if (0 == strcmp(argv[1], "pull"))
+		return cmd_pull(argc - 2, argv + 2);
+	if (0 == strcmp(argv[1], "import"))
+		return cmd_import(argc - 2, argv + 2);
+	if (0 == strcmp(argv[1], "changed"))
+		return cmd_changed(argc - 1, argv + 1);
+	if (0 == strcmp(argv[1], "sum"))
+		return cmd_sum(argc - 1, argv + 1);
+	if (0 == strcmp(argv[1], "mkdir"))
+		return tree(DF_IOC_TREE_MKDIR, 0777, -1, -1, argc - 2,
+				argv + 2);
+
+	fprintf(stderr, "unknown command %s\n", argv[1]);
+	usage(EXIT_FAILURE);
+
+	return EXIT_FAILURE;
+}
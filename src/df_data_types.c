@@ -27,13 +27,22 @@ void marshall_fuse_file_info(struct fuse_file_info *ffi,
 		int64_t *marshalled_ffi)
 {
 	marshalled_ffi[0] = ffi->flags;
+#if FUSE_USE_VERSION >= 30
+	/* gone in libfuse 3, the device, built against libfuse 2, ignores them */
+	marshalled_ffi[1] = 0;
+#else
 	marshalled_ffi[1] = ffi->fh_old;
+#endif
 	marshalled_ffi[2] = (ffi->direct_io << 0) +
 		(ffi->keep_cache << 1) +
 		(ffi->flush << 2) +
 		(ffi->nonseekable << 3) +
 		(ffi->flock_release << 4);
+#if FUSE_USE_VERSION >= 30
+	marshalled_ffi[3] = 0;
+#else
 	marshalled_ffi[3] = ffi->padding;
+#endif
 	marshalled_ffi[4] = ffi->fh;
 	marshalled_ffi[5] = ffi->lock_owner;
 
@@ -52,13 +61,17 @@ void unmarshall_fuse_file_info(struct fuse_file_info *ffi,
 	marshalled_struct_from_be64(marshalled_ffi, MARSHALLED_FFI_FIELDS);
 
 	ffi->flags = marshalled_ffi[0];
+#if FUSE_USE_VERSION < 30
 	ffi->fh_old = marshalled_ffi[1];
+#endif
 	ffi->direct_io = (marshalled_ffi[2] & BIT0) != 0;
 	ffi->keep_cache = (marshalled_ffi[2] & BIT1) != 0;
 	ffi->flush = (marshalled_ffi[2] & BIT2) != 0;
 	ffi->nonseekable = (marshalled_ffi[2] & BIT3) != 0;
 	ffi->flock_release = (marshalled_ffi[2] & BIT4) != 0;
+#if FUSE_USE_VERSION < 30
 	ffi->padding = marshalled_ffi[3];
+#endif
 	ffi->fh = marshalled_ffi[4];
 	ffi->lock_owner = marshalled_ffi[5];
 }
@@ -0,0 +1,274 @@
+/**
+ * @file df_delta.c
+ *
+ * Computation of the difference between a local file and it's old version,
+ * stored on the device, for only the changed parts to be transferred
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "df_delta.h"
+#include "df_hash.h"
+
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE (128 * 1024)
+
+/* size of the strong part of the DF_HASH_RSYNC digests */
+#define STRONG_SIZE 8
+
+/* full block of the old file, indexed by it's rolling checksum */
+struct entry {
+	uint32_t weak;
+	uint32_t index;
+};
+
+struct delta {
+	const struct df_delta_ops *ops;
+	void *ctx;
+	/* pending copy, extended while the following ones are adjacent */
+	int64_t copy_offset;
+	int64_t copy_length;
+};
+
+static int flush_copy(struct delta *d)
+{
+	int ret;
+
+	if (0 == d->copy_length)
+		return 0;
+	ret = d->ops->copy(d->ctx, d->copy_offset, d->copy_length);
+	d->copy_length = 0;
+
+	return ret;
+}
+
+static int emit_copy(struct delta *d, int64_t offset, int64_t length)
+{
+	int ret;
+
+	if (0 != d->copy_length && d->copy_offset + d->copy_length == offset) {
+		d->copy_length += length;
+		return 0;
+	}
+	ret = flush_copy(d);
+	d->copy_offset = offset;
+	d->copy_length = length;
+
+	return ret;
+}
+
+static int emit_literal(struct delta *d, const uint8_t *data, size_t size)
+{
+	int ret;
+
+	if (0 == size)
+		return 0;
+	ret = flush_copy(d);
+	if (0 > ret)
+		return ret;
+
+	return d->ops->literal(d->ctx, data, size);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct entry *ea = a;
+	const struct entry *eb = b;
+
+	if (ea->weak != eb->weak)
+		return ea->weak < eb->weak ? -1 : 1;
+
+	return ea->index < eb->index ? -1 : ea->index > eb->index;
+}
+
+/* first entry whose rolling checksum is weak, or end if there is none */
+static const struct entry *lower_bound(const struct entry *entries,
+		const struct entry *end, uint32_t weak)
+{
+	const struct entry *middle;
+
+	while (entries < end) {
+		middle = entries + (end - entries) / 2;
+		if (middle->weak < weak)
+			entries = middle + 1;
+		else
+			end = middle;
+	}
+
+	return entries;
+}
+
+static uint32_t weak_of(const struct df_delta_sig *sig, int64_t index)
+{
+	uint32_t weak;
+
+	memcpy(&weak, sig->digests + index * DF_HASH_RSYNC_SIZE, sizeof(weak));
+
+	return be32toh(weak);
+}
+
+static void strong_of(const uint8_t *data, size_t size, uint8_t *strong)
+{
+	struct df_hash hash;
+
+	df_hash_init(&hash, DF_HASH_XXH64);
+	df_hash_update(&hash, data, size);
+	df_hash_final(&hash, strong);
+}
+
+/*
+ * index of the block of the old file equal to the new data at p, preferring
+ * the one following the previous match, for the copies to be merged, -1 if
+ * there is none
+ */
+static int64_t match(const struct df_delta_sig *sig,
+		const struct entry *entries, const struct entry *end,
+		uint32_t weak, const uint8_t *p, int64_t expected)
+{
+	int64_t found = -1;
+	int strong_computed = 0;
+	uint8_t strong[STRONG_SIZE];
+	const struct entry *e;
+
+	for (e = lower_bound(entries, end, weak); e < end && e->weak == weak;
+			e++) {
+		if (!strong_computed) {
+			strong_of(p, sig->block_size, strong);
+			strong_computed = 1;
+		}
+		if (0 != memcmp(sig->digests + e->index * DF_HASH_RSYNC_SIZE +
+					sizeof(uint32_t), strong, STRONG_SIZE))
+			continue;
+		if (e->index == expected)
+			return expected;
+		if (-1 == found)
+			found = e->index;
+	}
+
+	return found;
+}
+
+int64_t df_delta_block_size(int64_t size)
+{
+	int64_t block_size = MIN_BLOCK_SIZE;
+
+	/* ~sqrt(size), balancing the signature's size and the literals' */
+	while (block_size * block_size < size && block_size < MAX_BLOCK_SIZE)
+		block_size *= 2;
+
+	return block_size;
+}
+
+/* the tail of the old file is shorter than a block, it's matched apart */
+static int match_tail(const uint8_t *data, size_t size, size_t literal,
+		const struct df_delta_sig *sig, struct delta *d)
+{
+	int ret;
+	int64_t tail_size = sig->size % sig->block_size;
+	int64_t tail_index = sig->size / sig->block_size;
+	struct df_hash hash;
+	uint8_t digest[DF_HASH_RSYNC_SIZE];
+
+	if (0 == tail_size || tail_index >= sig->count ||
+			size - literal < (size_t)tail_size)
+		return 0;
+
+	df_hash_init(&hash, DF_HASH_RSYNC);
+	df_hash_update(&hash, data + size - tail_size, tail_size);
+	df_hash_final(&hash, digest);
+	if (0 != memcmp(digest, sig->digests + tail_index * DF_HASH_RSYNC_SIZE,
+				DF_HASH_RSYNC_SIZE))
+		return 0;
+
+	ret = emit_literal(d, data + literal, size - tail_size - literal);
+	if (0 > ret)
+		return ret;
+	ret = emit_copy(d, tail_index * sig->block_size, tail_size);
+
+	return 0 > ret ? ret : 1;
+}
+
+int df_delta_compute(const uint8_t *data, size_t size,
+		const struct df_delta_sig *sig, const struct df_delta_ops *ops,
+		void *ctx)
+{
+	int ret = 0;
+	int64_t i;
+	int64_t blocks;
+	int64_t index;
+	int64_t expected = 0;
+	size_t pos = 0;
+	size_t literal = 0;
+	size_t block_size;
+	struct df_rollsum sum;
+	struct entry *entries = NULL;
+	struct delta d = {
+		.ops = ops,
+		.ctx = ctx,
+	};
+
+	if (NULL == data || NULL == ops)
+		return -EINVAL;
+	if (NULL == sig || 0 >= sig->block_size)
+		goto out;
+
+	block_size = sig->block_size;
+	blocks = sig->size / sig->block_size;
+	if (blocks > sig->count)
+		blocks = sig->count;
+	if (0 != blocks) {
+		entries = malloc(blocks * sizeof(*entries));
+		if (NULL == entries)
+			return -errno;
+	}
+	for (i = 0; i < blocks; i++) {
+		entries[i].weak = weak_of(sig, i);
+		entries[i].index = i;
+	}
+	qsort(entries, blocks, sizeof(*entries), compare_entries);
+
+	if (0 != blocks && size >= block_size) {
+		df_rollsum_init(&sum);
+		df_rollsum_update(&sum, data, block_size);
+	}
+	while (0 != blocks && pos + block_size <= size) {
+		index = match(sig, entries, entries + blocks,
+				df_rollsum_digest(&sum), data + pos, expected);
+		if (-1 != index) {
+			ret = emit_literal(&d, data + literal, pos - literal);
+			if (0 > ret)
+				goto out;
+			ret = emit_copy(&d, index * block_size, block_size);
+			if (0 > ret)
+				goto out;
+			pos += block_size;
+			literal = pos;
+			expected = index + 1;
+			if (pos + block_size <= size) {
+				df_rollsum_init(&sum);
+				df_rollsum_update(&sum, data + pos, block_size);
+			}
+			continue;
+		}
+		if (pos + block_size == size)
+			break;
+		df_rollsum_rotate(&sum, data[pos], data[pos + block_size]);
+		pos++;
+	}
+
+	ret = match_tail(data, size, literal, sig, &d);
+	if (0 > ret)
+		goto out;
+	if (1 == ret)
+		literal = size;
+out:
+	if (0 <= ret)
+		ret = emit_literal(&d, data + literal, size - literal);
+	if (0 <= ret)
+		ret = flush_copy(&d);
+	free(entries);
+
+	return ret;
+}
@@ -0,0 +1,58 @@
+#ifndef DF_DELTA_H
+#define DF_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* kinds of the records of a delta, values are part of the protocol */
+enum df_delta_record {
+	DF_DELTA_END,     /**< end of a list of records */
+	DF_DELTA_COPY,    /**< copy of a range of the old file */
+	DF_DELTA_LITERAL, /**< new data */
+};
+
+/**
+ * @struct df_delta_sig
+ * @brief signature of the old version of a file, DF_HASH_RSYNC digests of
+ * it's consecutive blocks, the last one may be shorter than block_size
+ */
+struct df_delta_sig {
+	/** size of the old file */
+	int64_t size;
+	int64_t block_size;
+	int64_t count;
+	/** count DF_HASH_RSYNC_SIZE bytes digests */
+	uint8_t *digests;
+};
+
+/**
+ * @struct df_delta_ops
+ * @brief receivers of the records of a delta, in the order of the new file,
+ * returning 0 on success, or errno-compatible negative values to abort
+ */
+struct df_delta_ops {
+	int (*copy)(void *ctx, int64_t src_offset, int64_t length);
+	int (*literal)(void *ctx, const uint8_t *data, size_t size);
+};
+
+/* @return a block size suited to a file of size bytes */
+int64_t df_delta_block_size(int64_t size);
+
+/**
+ * computes the records to rebuild data from the old file described by sig,
+ * with the rsync algorithm : blocks of the old file are searched at each
+ * offset of data, by sliding a rolling checksum over it, confirmed with
+ * xxHash64, and whatever doesn't match is sent as literals. Adjacent copies
+ * are merged.
+ * @param data New content of the file
+ * @param size Size of data
+ * @param sig Signature of the old file, NULL if there's none
+ * @param ops Called for each record
+ * @param ctx Passed to the ops
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_delta_compute(const uint8_t *data, size_t size,
+		const struct df_delta_sig *sig, const struct df_delta_ops *ops,
+		void *ctx);
+
+#endif /* DF_DELTA_H */
@@ -47,16 +47,30 @@ struct sockaddr_un __sizecheck;
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <poll.h>
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
 #include "df_protocol.h"
 #include "df_data_types.h"
+#include "df_path_cache.h"
+#include "df_handles.h"
+#include "df_tree.h"
+#include "df_hash.h"
+#include "df_delta.h"
+#include "df_tar.h"
+#include "df_scan.h"
+#include "df_watch.h"
 
 #define DF_DEVICE_PORT 6666
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define FREE(p) do { \
 	if (p) {\
@@ -80,6 +94,45 @@ static int errno_reply(enum df_op op_code, int err,
 	return fill_header(ans_hdr, strlen(*ans_pld) + 1, op_code, err);
 }
 
+/* returned by the actions of the requests which aren't answered */
+#define DF_NO_ANSWER 1
+
+/* bytes copied or hashed between two checks of the request's cancellation */
+#define DF_CANCEL_CHUNK (8 * 1024 * 1024)
+
+/* socket of the host served, for the long actions to notice cancellations */
+static int host_sock = -1;
+
+/* @return non-zero if the host cancelled the request being served */
+static int cancelled(void)
+{
+	return -1 != host_sock && df_cancel_pending(host_sock);
+}
+
+/*
+ * directory which couldn't be watched while serving the request, reported to
+ * the host as a DF_NOTIFY_OVERFLOW once the answer is sent, for it to drop
+ * what it cached from the answer
+ */
+static char unwatched[PATH_MAX];
+
+/* watches path, which the host may cache what it learns about */
+static void watch_dir(const char *path)
+{
+	if (0 > df_watch_dir(path))
+		snprintf(unwatched, sizeof(unwatched), "%s", path);
+}
+
+/*
+ * watches the parent of path, the host caching the entry in it's listing, the
+ * entry, not the parent, is reported, for the host to drop the parent's listing
+ */
+static void watch_parent(const char *path)
+{
+	if (0 > df_watch_parent(path))
+		snprintf(unwatched, sizeof(unwatched), "%s", path);
+}
+
 static int action_getattr(struct df_packet_header *header, char *payload,
 		struct df_packet_header *ans_hdr, char **ans_pld)
 {
@@ -91,17 +144,25 @@ static int action_getattr(struct df_packet_header *header, char *payload,
 	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
 
 	struct stat out_stat;
+	struct df_path at;
 
 	/* retrieve the arguments */
 	ret = df_parse_payload(payload, &offset, header->payload_size,
-			DF_DATA_BUFFER, &in_path_len, &in_path,
+			DF_DATA_PATH, &in_path_len, &in_path,
 			DF_DATA_END);
 	if (0 > ret)
 		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
 	in_path[in_path_len - 1] = '\0';
 
+	/*
+	 * the host may cache the entry, or it's absence, which is watched
+	 * before it's stat'ed, not to miss a change made in between
+	 */
+	watch_parent(in_path);
+
 	/* perform the syscall */
-	ret = lstat(in_path, &out_stat);
+	ret = DF_PATH_AT(&at, in_path, fstatat(at.dirfd, at.name, &out_stat,
+				AT_SYMLINK_NOFOLLOW));
 	if (ret == -1)
 		return errno_reply(op_code, errno, ans_hdr, ans_pld);
 
@@ -110,6 +171,75 @@ static int action_getattr(struct df_packet_header *header, char *payload,
 			DF_DATA_END);
 }
 
+/*
+ * in_names are the names of entries of in_path, separated by '\0's, stat'ed
+ * relatively to one fd of the directory, which is watched, for the host to
+ * cache the results
+ */
+static int action_getattr_many(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int fd;
+	int err;
+	size_t offset = 0;
+	size_t size = 0;
+	size_t count = 0;
+	enum df_op op_code = DF_OP_GETATTR_MANY;
+	const char *name;
+	struct stat st;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_names_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_names = NULL;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_BUFFER, &in_names_len, &in_names,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
+	if (0 == in_names_len || '\0' != in_names[in_names_len - 1])
+		return errno_reply(op_code, EINVAL, ans_hdr, ans_pld);
+	for (name = in_names; name < in_names + in_names_len;
+			name += strlen(name) + 1)
+		if (++count > DF_GETATTR_MANY_MAX || NULL != strchr(name, '/'))
+			return errno_reply(op_code, EINVAL, ans_hdr, ans_pld);
+
+	/* perform the syscalls */
+	watch_dir(in_path);
+	fd = open(in_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (-1 == fd)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	for (name = in_names; name < in_names + in_names_len;
+			name += strlen(name) + 1) {
+		err = 0;
+		if (-1 == fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+			err = errno;
+			memset(&st, 0, sizeof(st));
+		}
+		ret = df_build_payload(ans_pld, &size,
+				DF_DATA_INT, (int64_t)err,
+				DF_DATA_STAT, &st,
+				DF_DATA_BLOCK_END);
+		if (0 > ret)
+			break;
+	}
+	close(fd);
+	if (0 <= ret)
+		ret = df_build_payload(ans_pld, &size,
+				DF_DATA_END);
+	if (0 > ret) {
+		FREE(*ans_pld);
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	}
+
+	return fill_header(ans_hdr, size, op_code, 0);
+}
+
 static int action_access(struct df_packet_header *header, char *payload,
 		struct df_packet_header *ans_hdr, char **ans_pld)
 {
@@ -120,305 +250,1746 @@ static int action_access(struct df_packet_header *header, char *payload,
 	int64_t in_path_len;
 	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
 	int64_t in_mask;
+	struct df_path at;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_mask,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	/* perform the syscall */
+	ret = DF_PATH_AT(&at, in_path, faccessat(at.dirfd, at.name, in_mask,
+				0));
+	if (ret == -1)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_END);
+}
+
+static int action_mknod(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_MKNOD;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_mode;
+	int64_t in_rdev;
+	struct df_path at;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_mode,
+			DF_DATA_INT, &in_rdev,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	/* perform the syscall */
+	ret = DF_PATH_AT(&at, in_path, mknodat(at.dirfd, at.name, in_mode,
+				in_rdev));
+	if (ret == -1)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_END);
+}
+
+/*
+ * when the host asks for it, the file is opened read-only and is smaller than
+ * in_inline bytes, it's content is returned too, with out_inlined set, even
+ * if it's empty
+ */
+static int action_open(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int fd;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_OPEN;
+	struct stat st;
+	ssize_t size = 0;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	struct fuse_file_info in_fi;
+	int64_t in_inline;
+	uint64_t handle;
+
+	int64_t out_inlined = 0;
+	char __attribute__((cleanup(char_array_free))) *out_buf = NULL;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_INT, &in_inline,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	if (in_inline > DF_INLINE_SIZE)
+		in_inline = DF_INLINE_SIZE;
+
+	/* perform the syscall */
+	ret = df_handle_open(in_path, in_fi.flags, DF_HANDLE_FILE, &handle);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_fi.fh = handle;
+
+	/* failing to read the content only costs the host the usual reads */
+	fd = df_handle_fd(handle);
+	if (0 < in_inline && O_RDONLY == (in_fi.flags & O_ACCMODE) &&
+			0 <= fd && 0 == fstat(fd, &st) &&
+			S_ISREG(st.st_mode) && st.st_size < in_inline) {
+		out_buf = malloc(in_inline);
+		if (NULL != out_buf)
+			size = pread(fd, out_buf, in_inline, 0);
+		/* unless the file grew meanwhile */
+		out_inlined = NULL != out_buf && 0 <= size && size < in_inline;
+		if (!out_inlined)
+			size = 0;
+	}
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_INT, out_inlined,
+			DF_DATA_BUFFER, (int64_t)size, out_buf,
+			DF_DATA_END);
+}
+
+static int action_read(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int fd;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_READ;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_size;
+	int64_t in_offset;
+	struct fuse_file_info in_fi;
+
+	char __attribute__((cleanup(char_array_free))) *out_buf = NULL;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_size,
+			DF_DATA_INT, &in_offset,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	/* perform the syscall */
+	fd = df_handle_fd(in_fi.fh);
+	if (0 > fd)
+		return errno_reply(op_code, -fd, ans_hdr, ans_pld);
+	out_buf = malloc(in_size);
+	if (NULL == out_buf)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	ret = pread(fd, out_buf, in_size, in_offset);
+	if (ret == -1)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_BUFFER, ret, out_buf,
+			DF_DATA_END);
+}
+
+static int action_readlink(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_GETATTR;
+
+	char __attribute__((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_path_len;
+	int64_t in_size;
+
+	char __attribute__((cleanup(char_array_free))) *out_buf = NULL;
+	size_t out_buf_len = 0;
+
+	struct df_path at;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_size,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
+
+	/* perform the syscall */
+	out_buf = malloc(in_size);
+	ret = DF_PATH_AT(&at, in_path, readlinkat(at.dirfd, at.name, out_buf,
+				in_size - 1));
+	if (ret == -1)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	out_buf_len = MIN(ret + 1, in_size);
+	out_buf[out_buf_len - 1] = '\0';
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_BUFFER, out_buf_len, out_buf,
+			DF_DATA_END);
+}
+
+/* layout of the records returned by the getdents64 syscall */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* size of the buffer passed to getdents64 */
+#define DF_GETDENTS_SIZE (32 * 1024)
+
+/*
+ * encodes the entries of the directory opened as fd, starting at it's current
+ * position, in the preallocated payload, until it is full or the end of the
+ * directory is reached. For each entry, d_off is the cookie to pass as the
+ * offset of the next readdir, to restart right after it
+ */
+static int encode_dirents(int fd, char *payload, size_t capacity, size_t *size,
+		int *eof)
+{
+	int ret;
+	long nread;
+	long pos;
+	struct linux_dirent64 *d;
+	char __attribute__ ((cleanup(char_array_free))) *dents = NULL;
+	size_t name_len;
+
+	dents = malloc(DF_GETDENTS_SIZE);
+	if (NULL == dents)
+		return -errno;
+
+	*eof = 0;
+	for (;;) {
+		nread = syscall(SYS_getdents64, fd, dents, DF_GETDENTS_SIZE);
+		if (-1 == nread)
+			return -errno;
+		if (0 == nread) {
+			*eof = 1;
+			return 0;
+		}
+
+		for (pos = 0; pos < nread; pos += d->d_reclen) {
+			d = (struct linux_dirent64 *)(dents + pos);
+			name_len = strlen(d->d_name) + 1;
+			ret = df_build_payload_fixed(payload, capacity, size,
+					DF_DATA_BUFFER, name_len, d->d_name,
+					DF_DATA_INT, (int64_t)d->d_ino,
+					DF_DATA_INT, (int64_t)d->d_type,
+					DF_DATA_INT, (int64_t)d->d_off,
+					DF_DATA_BLOCK_END);
+			/* full, the next call will restart from this entry */
+			if (-ENOSPC == ret)
+				return 0;
+			if (0 > ret)
+				return ret;
+		}
+	}
+}
+
+static int action_opendir(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_OPENDIR;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	struct fuse_file_info in_fi;
+	uint64_t handle;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
+
+	/* perform the syscall, the listing being watched before it's read */
+	watch_dir(in_path);
+	ret = df_handle_open(in_path, 0, DF_HANDLE_DIR, &handle);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_fi.fh = handle;
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_END);
+}
+
+/*
+ * answers with a chunk of at most DF_READDIR_CHUNK_SIZE bytes, built in one
+ * buffer allocated once, read from the directory opened by opendir. The host
+ * asks for the following chunks, passing the d_off of the last entry it
+ * consumed as the offset, which is seeked to, so that listing a directory page
+ * by page costs no more than listing it at once
+ */
+static int action_readdir(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int fd;
+	int eof;
+	size_t offset = 0;
+	size_t size = 0;
+	enum df_op op_code = DF_OP_READDIR;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_offset;
+	struct fuse_file_info in_fi;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_offset,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	/*
+	 * the fd's position may be past in_offset, after a partial chunk, or
+	 * lost, if it has been reopened
+	 */
+	fd = df_handle_fd(in_fi.fh);
+	if (0 > fd)
+		return errno_reply(op_code, -fd, ans_hdr, ans_pld);
+	if (-1 == lseek(fd, in_offset, SEEK_SET))
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+
+	/* build the answer */
+	*ans_pld = malloc(DF_READDIR_CHUNK_SIZE);
+	if (NULL == *ans_pld)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	ret = df_build_payload_fixed(*ans_pld, DF_READDIR_CHUNK_SIZE, &size,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_BLOCK_END);
+	if (0 <= ret)
+		ret = encode_dirents(fd, *ans_pld,
+				DF_READDIR_CHUNK_SIZE - DF_READDIR_TRAILER_SIZE,
+				&size, &eof);
+	if (0 > ret) {
+		FREE(*ans_pld);
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	}
+
+	/* terminate the payload, room has been kept for it */
+	ret = df_build_payload_fixed(*ans_pld, DF_READDIR_CHUNK_SIZE, &size,
+			DF_DATA_INT, (int64_t)eof,
+			DF_DATA_END);
+	if (0 > ret) {
+		FREE(*ans_pld);
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	}
+
+	return fill_header(ans_hdr, size, op_code, 0);
+}
+
+static int action_releasedir(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_RELEASEDIR;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	struct fuse_file_info in_fi;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	/* perform the syscall */
+	ret = df_handle_close(in_fi.fh);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_END);
+}
+
+static int action_release(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_RELEASE;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	struct fuse_file_info in_fi;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	/* perform the syscall */
+	ret = df_handle_close(in_fi.fh);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_END);
+}
+
+static int action_unlink(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_UNLINK;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	struct df_path at;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	/* perform the syscall */
+	ret = DF_PATH_AT(&at, in_path, unlinkat(at.dirfd, at.name, 0));
+	if (ret == -1)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_END);
+}
+
+/* truncate(2) relative to a directory fd, for DF_PATH_AT */
+static int truncateat(int dirfd, const char *name, off_t size)
+{
+	int fd;
+	int ret;
+	int err;
+
+	/* O_NONBLOCK, not to hang on a fifo */
+	fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+	if (-1 == fd)
+		return -1;
+	ret = ftruncate(fd, size);
+	err = errno;
+	close(fd);
+	errno = err;
+
+	return ret;
+}
+
+static int action_truncate(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_TRUNCATE;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_size;
+	struct df_path at;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_size,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	/* perform the syscall */
+	ret = DF_PATH_AT(&at, in_path, truncateat(at.dirfd, at.name,
+				in_size));
+	if (ret == -1)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_END);
+}
+
+static int action_write(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int fd;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_WRITE;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_size;
+	char __attribute__ ((cleanup(char_array_free))) *in_buf = NULL;
+	int64_t in_offset;
+	struct fuse_file_info in_fi;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_BUFFER, &in_size, &in_buf,
+			DF_DATA_INT, &in_offset,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	/* perform the syscall */
+	fd = df_handle_fd(in_fi.fh);
+	if (0 > fd)
+		return errno_reply(op_code, -fd, ans_hdr, ans_pld);
+	ret = pwrite(fd, in_buf, in_size, in_offset);
+	if (ret == -1)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_INT, (int64_t)ret,
+			DF_DATA_END);
+}
+
+/*
+ * the writes of a handle are applied in the order they are received, their
+ * errors are reported by the next DF_OP_COMMIT of the handle
+ */
+static int action_write_unstable(struct df_packet_header *header,
+		char *payload, struct df_packet_header __attribute__((unused))
+		*ans_hdr, char __attribute__((unused)) **ans_pld)
+{
+	int ret;
+	int fd;
+	size_t offset = 0;
+	size_t done;
+	ssize_t written;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_size;
+	char __attribute__ ((cleanup(char_array_free))) *in_buf = NULL;
+	int64_t in_offset;
+	struct fuse_file_info in_fi;
+
+	/* the host couldn't be told which write is lost */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_BUFFER, &in_size, &in_buf,
+			DF_DATA_INT, &in_offset,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	fd = df_handle_fd(in_fi.fh);
+	if (0 > fd) {
+		df_handle_set_error(in_fi.fh, fd);
+		return DF_NO_ANSWER;
+	}
+	for (done = 0; done < (size_t)in_size; done += written) {
+		written = pwrite(fd, in_buf + done, in_size - done,
+				in_offset + done);
+		if (0 >= written) {
+			df_handle_set_error(in_fi.fh, -1 == written ? -errno :
+					-EIO);
+			break;
+		}
+	}
+
+	return DF_NO_ANSWER;
+}
+
+static int action_commit(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int fd;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_COMMIT;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	struct fuse_file_info in_fi;
+	int64_t in_flags;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_INT, &in_flags,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	ret = df_handle_error(in_fi.fh);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	/* perform the syscall */
+	if (in_flags & (DF_COMMIT_FSYNC | DF_COMMIT_DATASYNC)) {
+		fd = df_handle_fd(in_fi.fh);
+		if (0 > fd)
+			return errno_reply(op_code, -fd, ans_hdr, ans_pld);
+		ret = in_flags & DF_COMMIT_FSYNC ? fsync(fd) : fdatasync(fd);
+		if (-1 == ret)
+			return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	}
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_END);
+}
+
+/*
+ * the unanswered requests in flight are bounded by what the device can afford
+ * to let wait in it's socket buffers, a fraction of the memory available
+ */
+static int action_window(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_WINDOW;
+	long pages;
+	int64_t bytes = DF_WINDOW_BYTES_MAX;
+
+	int64_t in_bytes;
+	int64_t in_msgs;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_INT, &in_bytes,
+			DF_DATA_INT, &in_msgs,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	if (0 >= in_bytes || 0 >= in_msgs)
+		return errno_reply(op_code, EINVAL, ans_hdr, ans_pld);
+
+	pages = sysconf(_SC_AVPHYS_PAGES);
+	if (0 < pages)
+		bytes = MIN(bytes, (int64_t)pages * getpagesize() / 16);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_INT, MIN(in_bytes, bytes),
+			DF_DATA_INT, MIN(in_msgs, (int64_t)DF_WINDOW_MSGS_MAX),
+			DF_DATA_END);
+}
+
+/* a cancellation arriving once it's request has been answered is ignored */
+static int action_cancel(struct df_packet_header __attribute__((unused))
+		*header, char __attribute__((unused)) *payload,
+		struct df_packet_header __attribute__((unused)) *ans_hdr,
+		char __attribute__((unused)) **ans_pld)
+{
+	return DF_NO_ANSWER;
+}
+
+/* size of the buffer used when the kernel can't copy by itself */
+#define DF_COPY_BUFFER_SIZE (128 * 1024)
+
+/* copies with a buffer, the last resort */
+static ssize_t copy_with_buffer(int in_fd, off_t *in_off, int out_fd,
+		off_t *out_off, size_t len)
+{
+	ssize_t ret;
+	char __attribute__((cleanup(char_array_free))) *buf = NULL;
+
+	buf = malloc(DF_COPY_BUFFER_SIZE);
+	if (NULL == buf)
+		return -1;
+
+	ret = pread(in_fd, buf, MIN(len, DF_COPY_BUFFER_SIZE), *in_off);
+	if (0 >= ret)
+		return ret;
+	ret = pwrite(out_fd, buf, ret, *out_off);
+	if (0 >= ret)
+		return ret;
+	*in_off += ret;
+	*out_off += ret;
+
+	return ret;
+}
+
+/*
+ * copies len bytes, or up to the end of the input if len is negative, using
+ * copy_file_range, then sendfile, if the former isn't supported, or works
+ * across file systems only for some kernels
+ */
+static ssize_t copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off,
+		int64_t len)
+{
+	ssize_t ret;
+	ssize_t copied = 0;
+	size_t chunk;
+	int use_cfr = 1;
+	int use_sendfile = 1;
+
+	while (0 > len || copied < len) {
+		if (cancelled()) {
+			errno = ECANCELED;
+			return -1;
+		}
+		chunk = 0 > len ? DF_CANCEL_CHUNK :
+				MIN(len - copied, DF_CANCEL_CHUNK);
+		if (use_cfr) {
+#ifdef __NR_copy_file_range
+			ret = syscall(__NR_copy_file_range, in_fd, &in_off,
+					out_fd, &out_off, chunk, 0);
+#else
+			ret = -1;
+			errno = ENOSYS;
+#endif
+			if (-1 == ret && (ENOSYS == errno ||
+					EXDEV == errno || EINVAL == errno ||
+					EOPNOTSUPP == errno)) {
+				use_cfr = 0;
+				continue;
+			}
+		} else if (use_sendfile) {
+			/* sendfile writes at the output's current position */
+			if (-1 == lseek(out_fd, out_off, SEEK_SET))
+				return -1;
+			ret = sendfile(out_fd, in_fd, &in_off,
+					MIN(chunk, 0x7ffff000));
+			if (-1 == ret && (EINVAL == errno || ENOSYS == errno)) {
+				use_sendfile = 0;
+				continue;
+			}
+			if (0 < ret)
+				out_off += ret;
+		} else {
+			ret = copy_with_buffer(in_fd, &in_off, out_fd, &out_off,
+					chunk);
+		}
+		if (-1 == ret)
+			return -1;
+		if (0 == ret)
+			break;
+		copied += ret;
+	}
+
+	return copied;
+}
+
+static int action_copy_range(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	ssize_t copied;
+	int in_fd;
+	int out_fd;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_COPY_RANGE;
+	struct stat in_stat;
+
+	int64_t in_src_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_src = NULL;
+	int64_t in_src_offset;
+	int64_t in_dst_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_dst = NULL;
+	int64_t in_dst_offset;
+	int64_t in_length;
+	struct df_path at;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_src_len, &in_src,
+			DF_DATA_INT, &in_src_offset,
+			DF_DATA_PATH, &in_dst_len, &in_dst,
+			DF_DATA_INT, &in_dst_offset,
+			DF_DATA_INT, &in_length,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_src[in_src_len - 1] = '\0';
+	in_dst[in_dst_len - 1] = '\0';
+
+	/* perform the syscalls */
+	in_fd = DF_PATH_AT(&at, in_src, openat(at.dirfd, at.name,
+				O_RDONLY | O_CLOEXEC));
+	if (-1 == in_fd)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	ret = fstat(in_fd, &in_stat);
+	if (-1 == ret) {
+		ret = errno;
+		close(in_fd);
+		return errno_reply(op_code, ret, ans_hdr, ans_pld);
+	}
+	out_fd = DF_PATH_AT(&at, in_dst, openat(at.dirfd, at.name,
+				O_WRONLY | O_CREAT | O_CLOEXEC,
+				in_stat.st_mode & 07777));
+	if (-1 == out_fd) {
+		ret = errno;
+		close(in_fd);
+		return errno_reply(op_code, ret, ans_hdr, ans_pld);
+	}
+	copied = copy_range(in_fd, in_src_offset, out_fd, in_dst_offset,
+			in_length);
+	ret = errno;
+	close(in_fd);
+	close(out_fd);
+	if (-1 == copied)
+		return errno_reply(op_code, ret, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_INT, (int64_t)copied,
+			DF_DATA_END);
+}
+
+static int action_tree(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_TREE;
+	struct df_tree_report report;
+
+	int64_t in_op;
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_mode;
+	int64_t in_uid;
+	int64_t in_gid;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_INT, &in_op,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_mode,
+			DF_DATA_INT, &in_uid,
+			DF_DATA_INT, &in_gid,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
+
+	/* perform the operation */
+	ret = df_tree_run(in_op, in_path, in_mode, in_uid, in_gid, cancelled,
+			&report);
+	if (0 > ret) {
+		FREE(report.errors);
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	}
+
+	ret = df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_INT, report.done,
+			DF_DATA_INT, report.failed,
+			DF_DATA_BUFFER, report.errors_size + 1,
+					report.errors ? report.errors : "",
+			DF_DATA_END);
+	FREE(report.errors);
+
+	return ret;
+}
+
+/* size of the reads of the files being hashed */
+#define DF_CHECKSUM_READ_SIZE (128 * 1024)
+
+/*
+ * hashes the blocks of [offset, end) of fd, into digests, which must be large
+ * enough for count digests
+ */
+static int hash_blocks(int fd, enum df_hash_algo algo, off_t offset, off_t end,
+		off_t block_size, int64_t count, uint8_t *digests)
+{
+	int64_t i;
+	ssize_t ret;
+	off_t block_end;
+	off_t checked = offset;
+	struct df_hash hash;
+	size_t digest_size = df_hash_digest_size(algo);
+	char __attribute__((cleanup(char_array_free))) *buf = NULL;
+
+	buf = malloc(DF_CHECKSUM_READ_SIZE);
+	if (NULL == buf)
+		return -errno;
+	posix_fadvise(fd, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+
+	for (i = 0; i < count; i++) {
+		block_end = MIN(offset + block_size, end);
+		df_hash_init(&hash, algo);
+		while (offset < block_end) {
+			if (offset - checked >= DF_CANCEL_CHUNK) {
+				checked = offset;
+				if (cancelled())
+					return -ECANCELED;
+			}
+			ret = pread(fd, buf, MIN(block_end - offset,
+						DF_CHECKSUM_READ_SIZE), offset);
+			if (-1 == ret)
+				return -errno;
+			/* the file has been truncated meanwhile */
+			if (0 == ret)
+				return -EIO;
+			df_hash_update(&hash, buf, ret);
+			offset += ret;
+		}
+		df_hash_final(&hash, digests + i * digest_size);
+	}
+
+	return 0;
+}
+
+static int action_checksum(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int fd;
+	int64_t count;
+	off_t end;
+	size_t digest_size;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_CHECKSUM;
+	struct stat st;
+	struct df_path at;
+	char __attribute__((cleanup(char_array_free))) *digests = NULL;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_offset;
+	int64_t in_length;
+	int64_t in_block_size;
+	int64_t in_algo;
+	int64_t in_max_blocks;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_offset,
+			DF_DATA_INT, &in_length,
+			DF_DATA_INT, &in_block_size,
+			DF_DATA_INT, &in_algo,
+			DF_DATA_INT, &in_max_blocks,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
+	digest_size = df_hash_digest_size(in_algo);
+	if (0 == digest_size || 0 > in_offset || 0 > in_block_size ||
+			0 >= in_max_blocks)
+		return errno_reply(op_code, EINVAL, ans_hdr, ans_pld);
+
+	/* perform the syscalls */
+	fd = DF_PATH_AT(&at, in_path, openat(at.dirfd, at.name,
+				O_RDONLY | O_CLOEXEC));
+	if (-1 == fd)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	if (-1 == fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+
+	/* the range is clamped to the file, block size 0 means one block */
+	end = 0 > in_length || in_length > st.st_size - in_offset ?
+			st.st_size : in_offset + in_length;
+	end = MAX(end, in_offset);
+	if (0 == in_block_size) {
+		count = 1;
+		in_block_size = end - in_offset;
+	} else {
+		count = (end - in_offset + in_block_size - 1) / in_block_size;
+		count = MIN(count, MIN(in_max_blocks, DF_CHECKSUM_MAX_BLOCKS));
+	}
+
+	digests = malloc(count * digest_size + 1);
+	if (NULL == digests) {
+		ret = -errno;
+		goto out;
+	}
+	ret = hash_blocks(fd, in_algo, in_offset, end, in_block_size, count,
+			(uint8_t *)digests);
+out:
+	close(fd);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_INT, (int64_t)st.st_size,
+			DF_DATA_BUFFER, count * digest_size, digests,
+			DF_DATA_END);
+}
+
+/*
+ * delta transfers rebuild the new version of a file in a temporary file, next
+ * to it, which replaces it atomically once complete
+ */
+static int action_delta_begin(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int fd;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_DELTA_BEGIN;
+	static unsigned counter;
+	char tmp[PATH_MAX];
+	char *slash;
+	uint64_t handle;
+	struct df_path at;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_mode;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_mode,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
+	slash = strrchr(in_path, '/');
+	if (NULL == slash || '\0' == slash[1])
+		return errno_reply(op_code, EINVAL, ans_hdr, ans_pld);
+
+	/* perform the syscalls */
+	ret = snprintf(tmp, sizeof(tmp), "%.*s.%s.dfuse-%d-%u",
+			(int)(slash + 1 - in_path), in_path, slash + 1,
+			getpid(), counter++);
+	if (ret >= (int)sizeof(tmp))
+		return errno_reply(op_code, ENAMETOOLONG, ans_hdr, ans_pld);
+	fd = DF_PATH_AT(&at, tmp, openat(at.dirfd, at.name,
+				O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+				(in_mode & 07777) | S_IRUSR | S_IWUSR));
+	if (-1 == fd)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	close(fd);
+	ret = df_handle_open(tmp, O_WRONLY, DF_HANDLE_FILE, &handle);
+	if (0 > ret) {
+		unlink(tmp);
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	}
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_INT, (int64_t)handle,
+			DF_DATA_END);
+}
+
+static int write_all(int fd, const char *buf, size_t size, off_t offset)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = pwrite(fd, buf, size, offset);
+		if (-1 == ret)
+			return -errno;
+		buf += ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+/* writes the records of a delta, see enum df_delta_record, at offset */
+static int apply_records(int fd, const char *path, char *payload,
+		size_t *offset, size_t size, int64_t *out_offset)
+{
+	int ret;
+	int old_fd = -1;
+	ssize_t copied;
+	int64_t kind;
+	int64_t src_offset;
+	int64_t length;
+	struct df_path at;
+
+	for (;;) {
+		ret = df_parse_payload(payload, offset, size,
+				DF_DATA_INT, &kind,
+				DF_DATA_BLOCK_END);
+		if (0 > ret)
+			break;
+
+		if (DF_DELTA_END == kind) {
+			ret = df_parse_payload(payload, offset, size,
+					DF_DATA_END);
+			break;
+		} else if (DF_DELTA_COPY == kind) {
+			ret = df_parse_payload(payload, offset, size,
+					DF_DATA_INT, &src_offset,
+					DF_DATA_INT, &length,
+					DF_DATA_BLOCK_END);
+			if (0 > ret)
+				break;
+			if (-1 == old_fd)
+				old_fd = DF_PATH_AT(&at, path, openat(at.dirfd,
+							at.name, O_RDONLY |
+							O_CLOEXEC));
+			if (-1 == old_fd) {
+				ret = -errno;
+				break;
+			}
+			copied = copy_range(old_fd, src_offset, fd,
+					*out_offset, length);
+			/* the old file has been truncated meanwhile */
+			if (copied != length) {
+				ret = -1 == copied ? -errno : -EIO;
+				break;
+			}
+		} else if (DF_DELTA_LITERAL == kind) {
+			/* the data is used in place, right from the payload */
+			ret = df_parse_buffer_prefix(payload, offset, size,
+					&length);
+			if (0 > ret)
+				break;
+			if ((size_t)length > size - *offset) {
+				ret = -EINVAL;
+				break;
+			}
+			ret = write_all(fd, payload + *offset, length,
+					*out_offset);
+			if (0 > ret)
+				break;
+			*offset += length;
+		} else {
+			ret = -EINVAL;
+			break;
+		}
+		*out_offset += length;
+	}
+
+	if (-1 != old_fd)
+		close(old_fd);
+
+	return ret;
+}
+
+static int action_delta_apply(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int fd;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_DELTA_APPLY;
+
+	int64_t in_handle;
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_offset;
+
+	/* retrieve the arguments, the records are parsed while applied */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_INT, &in_handle,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_offset,
+			DF_DATA_BLOCK_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
+
+	/* perform the syscalls */
+	fd = df_handle_fd(in_handle);
+	if (0 > fd)
+		return errno_reply(op_code, -fd, ans_hdr, ans_pld);
+	ret = apply_records(fd, in_path, payload, &offset,
+			header->payload_size, &in_offset);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_INT, in_offset,
+			DF_DATA_END);
+}
+
+/* the new file gets the mode and, if possible, the owner of the old one */
+static int replace_file(int fd, const char *tmp, const char *path,
+		int64_t size)
+{
+	int ret;
+	struct stat st;
+	struct df_path at;
+
+	if (-1 == ftruncate(fd, size))
+		return -errno;
+	ret = DF_PATH_AT(&at, path, fstatat(at.dirfd, at.name, &st, 0));
+	if (0 == ret) {
+		if (-1 == fchmod(fd, st.st_mode & 07777))
+			return -errno;
+		/* the owner can be kept only if we are root */
+		if (-1 == fchown(fd, st.st_uid, st.st_gid) && EPERM != errno)
+			return -errno;
+	}
+	if (-1 == fsync(fd))
+		return -errno;
+	if (-1 == rename(tmp, path))
+		return -errno;
+
+	return 0;
+}
+
+static int action_delta_commit(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int fd;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_DELTA_COMMIT;
+	char __attribute__ ((cleanup(char_array_free))) *tmp = NULL;
+
+	int64_t in_handle;
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_size;
+	int64_t in_commit;
+
+	/* retrieve the arguments */
+	ret = df_parse_payload(payload, &offset, header->payload_size,
+			DF_DATA_INT, &in_handle,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_size,
+			DF_DATA_INT, &in_commit,
+			DF_DATA_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
+	if (NULL == df_handle_path(in_handle))
+		return errno_reply(op_code, EBADF, ans_hdr, ans_pld);
+	tmp = strdup(df_handle_path(in_handle));
+	if (NULL == tmp)
+		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+
+	/* perform the syscalls, the temporary file is removed on failure */
+	ret = 0;
+	if (in_commit) {
+		fd = df_handle_fd(in_handle);
+		ret = 0 > fd ? fd : replace_file(fd, tmp, in_path, in_size);
+	}
+	df_handle_close(in_handle);
+	if (!in_commit || 0 > ret)
+		unlink(tmp);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+
+	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_END);
+}
+
+/*
+ * bookkeeping of a table of the operations spanning several requests, which
+ * outlive the connections. An id is the index of a slot and it's generation,
+ * for an id to be refused once it's operation has been ended or dropped. A
+ * new operation takes a free slot, or the one of the operation idle for the
+ * longest time, if it's been idle for DF_SLOT_IDLE seconds, for the operations
+ * abandoned by a client not to exhaust the table
+ */
+#define DF_SLOTS_MAX 8
+#define DF_SLOT_IDLE 60
+
+struct slots {
+	int busy[DF_SLOTS_MAX];
+	uint32_t generation[DF_SLOTS_MAX];
+	/* date of the last use of the slot, in seconds */
+	time_t used[DF_SLOTS_MAX];
+};
+
+static time_t now_sec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec;
+}
+
+/*
+ * @return index of the slot of a new operation, whose previous operation, if
+ * any, has to be closed by the caller, -EMFILE if all are busy and in use
+ */
+static int slot_reserve(struct slots *slots)
+{
+	int i;
+	int oldest = -1;
+
+	for (i = 0; i < DF_SLOTS_MAX; i++) {
+		if (!slots->busy[i])
+			return i;
+		if (-1 == oldest || slots->used[i] < slots->used[oldest])
+			oldest = i;
+	}
+	if (now_sec() - slots->used[oldest] < DF_SLOT_IDLE)
+		return -EMFILE;
+	slots->busy[oldest] = 0;
+
+	return oldest;
+}
+
+/* marks a reserved slot as busy, once it's operation is started */
+static int64_t slot_fill(struct slots *slots, int slot)
+{
+	slots->busy[slot] = 1;
+	slots->generation[slot]++;
+	slots->used[slot] = now_sec();
+
+	return (int64_t)slots->generation[slot] << 8 | slot;
+}
+
+/* @return index of the slot of the operation id, -1 if it's stale */
+static int slot_find(struct slots *slots, int64_t id)
+{
+	int slot = id & 0xFF;
+
+	if (0 > id || slot >= DF_SLOTS_MAX || !slots->busy[slot] ||
+			slots->generation[slot] != (uint64_t)id >> 8)
+		return -1;
+	slots->used[slot] = now_sec();
+
+	return slot;
+}
+
+static void slot_release(struct slots *slots, int slot)
+{
+	slots->busy[slot] = 0;
+}
+
+/*
+ * exports stream a tree as a tar archive, in as many DF_OP_EXPORT_READ
+ * requests as needed
+ */
+static struct df_tar_writer *exports[DF_SLOTS_MAX];
+static struct slots export_slots;
+
+static void exports_cleanup(void)
+{
+	unsigned i;
+
+	for (i = 0; i < DF_SLOTS_MAX; i++)
+		df_tar_writer_close(exports + i);
+}
+
+static struct df_tar_writer *export_get(int64_t id)
+{
+	int slot = slot_find(&export_slots, id);
+
+	return 0 > slot ? NULL : exports[slot];
+}
+
+static int action_export_begin(struct df_packet_header *header, char *payload,
+		struct df_packet_header *ans_hdr, char **ans_pld)
+{
+	int ret;
+	int slot;
+	size_t offset = 0;
+	enum df_op op_code = DF_OP_EXPORT_BEGIN;
+
+	int64_t in_path_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
 
 	/* retrieve the arguments */
 	ret = df_parse_payload(payload, &offset, header->payload_size,
-			DF_DATA_BUFFER, &in_path_len, &in_path,
-			DF_DATA_INT, &in_mask,
+			DF_DATA_PATH, &in_path_len, &in_path,
 			DF_DATA_END);
 	if (0 > ret)
 		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
 
-	/* perform the syscall */
-	ret = access(in_path, in_mask);
-	if (ret == -1)
-		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	/* perform the syscalls */
+	slot = slot_reserve(&export_slots);
+	if (0 > slot)
+		return errno_reply(op_code, -slot, ans_hdr, ans_pld);
+	df_tar_writer_close(exports + slot);
+	ret = df_tar_writer_open(exports + slot, in_path);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
 
 	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_INT, slot_fill(&export_slots, slot),
 			DF_DATA_END);
 }
 
-static int action_mknod(struct df_packet_header *header, char *payload,
+static int action_export_read(struct df_packet_header *header, char *payload,
 		struct df_packet_header *ans_hdr, char **ans_pld)
 {
 	int ret;
+	ssize_t size;
 	size_t offset = 0;
-	enum df_op op_code = DF_OP_MKNOD;
+	struct df_tar_writer *writer;
+	enum df_op op_code = DF_OP_EXPORT_READ;
+	char __attribute__ ((cleanup(char_array_free))) *buf = NULL;
 
-	int64_t in_path_len;
-	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
-	int64_t in_mode;
-	int64_t in_rdev;
+	int64_t in_id;
+	int64_t in_size;
 
 	/* retrieve the arguments */
 	ret = df_parse_payload(payload, &offset, header->payload_size,
-			DF_DATA_BUFFER, &in_path_len, &in_path,
-			DF_DATA_INT, &in_mode,
-			DF_DATA_INT, &in_rdev,
+			DF_DATA_INT, &in_id,
+			DF_DATA_INT, &in_size,
 			DF_DATA_END);
 	if (0 > ret)
 		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
-
-	/* perform the syscall */
-	ret = mknod(in_path, in_mode, in_rdev);
-	if (ret == -1)
+	writer = export_get(in_id);
+	if (NULL == writer)
+		return errno_reply(op_code, EBADF, ans_hdr, ans_pld);
+	if (0 >= in_size || in_size > DF_EXPORT_CHUNK_SIZE)
+		in_size = DF_EXPORT_CHUNK_SIZE;
+
+	/* perform the syscalls */
+	buf = malloc(in_size);
+	if (NULL == buf)
 		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	size = df_tar_writer_read(writer, buf, in_size);
+	if (0 > size)
+		return errno_reply(op_code, -size, ans_hdr, ans_pld);
 
 	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_BUFFER, (int64_t)size, buf,
+			DF_DATA_INT, (int64_t)(size < in_size),
+			DF_DATA_INT, df_tar_writer_errors(writer),
 			DF_DATA_END);
 }
 
-static int action_open(struct df_packet_header *header, char *payload,
+static int action_export_end(struct df_packet_header *header, char *payload,
 		struct df_packet_header *ans_hdr, char **ans_pld)
 {
 	int ret;
+	int slot;
 	size_t offset = 0;
-	enum df_op op_code = DF_OP_OPEN;
+	enum df_op op_code = DF_OP_EXPORT_END;
 
-	int64_t in_path_len;
-	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
-	struct fuse_file_info in_fi;
+	int64_t in_id;
 
 	/* retrieve the arguments */
 	ret = df_parse_payload(payload, &offset, header->payload_size,
-			DF_DATA_BUFFER, &in_path_len, &in_path,
-			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_INT, &in_id,
 			DF_DATA_END);
 	if (0 > ret)
 		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	slot = slot_find(&export_slots, in_id);
+	if (0 > slot)
+		return errno_reply(op_code, EBADF, ans_hdr, ans_pld);
 
-	/* perform the syscall */
-	ret = open(in_path, in_fi.flags);
-	if (ret == -1)
-		return errno_reply(op_code, errno, ans_hdr, ans_pld);
-	in_fi.fh = ret;
+	/* perform the syscalls */
+	df_tar_writer_close(exports + slot);
+	slot_release(&export_slots, slot);
 
 	return df_request_build(ans_hdr, ans_pld, op_code,
-			DF_DATA_FUSE_FILE_INFO, &in_fi,
 			DF_DATA_END);
 }
 
-static int action_read(struct df_packet_header *header, char *payload,
+/*
+ * imports extract a tar archive sent by chunks of DF_OP_IMPORT_WRITE
+ */
+static struct df_tar_reader *imports[DF_SLOTS_MAX];
+static struct slots import_slots;
+
+static void imports_cleanup(void)
+{
+	unsigned i;
+
+	for (i = 0; i < DF_SLOTS_MAX; i++)
+		df_tar_reader_close(imports + i);
+}
+
+static struct df_tar_reader *import_get(int64_t id)
+{
+	int slot = slot_find(&import_slots, id);
+
+	return 0 > slot ? NULL : imports[slot];
+}
+
+static int action_import_begin(struct df_packet_header *header, char *payload,
 		struct df_packet_header *ans_hdr, char **ans_pld)
 {
 	int ret;
+	int slot;
 	size_t offset = 0;
-	enum df_op op_code = DF_OP_READ;
+	enum df_op op_code = DF_OP_IMPORT_BEGIN;
 
 	int64_t in_path_len;
 	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
-	int64_t in_size;
-	int64_t in_offset;
-	struct fuse_file_info in_fi;
-
-	char __attribute__((cleanup(char_array_free))) *out_buf;
 
 	/* retrieve the arguments */
 	ret = df_parse_payload(payload, &offset, header->payload_size,
-			DF_DATA_BUFFER, &in_path_len, &in_path,
-			DF_DATA_INT, &in_size,
-			DF_DATA_INT, &in_offset,
-			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_PATH, &in_path_len, &in_path,
 			DF_DATA_END);
 	if (0 > ret)
 		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
 
-	/* perform the syscall */
-	out_buf = malloc(in_size);
-	if (NULL == out_buf)
-		return errno_reply(op_code, errno, ans_hdr, ans_pld);
-	ret = pread(in_fi.fh, out_buf, in_size, in_offset);
-	if (ret == -1)
-		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	/* perform the syscalls */
+	slot = slot_reserve(&import_slots);
+	if (0 > slot)
+		return errno_reply(op_code, -slot, ans_hdr, ans_pld);
+	df_tar_reader_close(imports + slot);
+	ret = df_tar_reader_open(imports + slot, in_path);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
 
 	return df_request_build(ans_hdr, ans_pld, op_code,
-			DF_DATA_BUFFER, ret, out_buf,
+			DF_DATA_INT, slot_fill(&import_slots, slot),
 			DF_DATA_END);
 }
 
-static int action_readlink(struct df_packet_header *header, char *payload,
+static int action_import_write(struct df_packet_header *header, char *payload,
 		struct df_packet_header *ans_hdr, char **ans_pld)
 {
 	int ret;
 	size_t offset = 0;
-	enum df_op op_code = DF_OP_GETATTR;
+	struct df_tar_reader *reader;
+	enum df_op op_code = DF_OP_IMPORT_WRITE;
 
-	char __attribute__((cleanup(char_array_free))) *in_path = NULL;
-	int64_t in_path_len;
+	int64_t in_id;
 	int64_t in_size;
 
-	char __attribute__((cleanup(char_array_free))) *out_buf = NULL;
-	size_t out_buf_len = 0;
-
-	/* retrieve the arguments */
+	/* retrieve the arguments, the data is extracted right from the payload */
 	ret = df_parse_payload(payload, &offset, header->payload_size,
-			DF_DATA_BUFFER, &in_path_len, &in_path,
-			DF_DATA_INT, &in_size,
-			DF_DATA_END);
+			DF_DATA_INT, &in_id,
+			DF_DATA_BLOCK_END);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	ret = df_parse_buffer_prefix(payload, &offset, header->payload_size,
+			&in_size);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	if ((size_t)in_size > header->payload_size - offset)
+		return errno_reply(op_code, EINVAL, ans_hdr, ans_pld);
+	reader = import_get(in_id);
+	if (NULL == reader)
+		return errno_reply(op_code, EBADF, ans_hdr, ans_pld);
+
+	/* perform the syscalls */
+	ret = df_tar_reader_feed(reader, payload + offset, in_size);
 	if (0 > ret)
 		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
-	in_path[in_path_len - 1] = '\0';
-
-	/* perform the syscall */
-	out_buf = malloc(in_size);
-	ret = readlink(in_path, out_buf, in_size - 1);
-	if (ret == -1)
-		return errno_reply(op_code, errno, ans_hdr, ans_pld);
-	out_buf_len = MIN(ret + 1, in_size);
-	out_buf[out_buf_len - 1] = '\0';
 
 	return df_request_build(ans_hdr, ans_pld, op_code,
-			DF_DATA_BUFFER, out_buf_len, out_buf,
 			DF_DATA_END);
 }
 
-static int action_readdir(struct df_packet_header *header, char *payload,
+static int action_import_end(struct df_packet_header *header, char *payload,
 		struct df_packet_header *ans_hdr, char **ans_pld)
 {
 	int ret;
-	DIR *dp;
-	struct dirent *de;
+	int slot;
 	size_t offset = 0;
-	size_t size = 0;
-	enum df_op op_code = DF_OP_READDIR;
-
-	int64_t in_path_len;
-	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
-	int64_t in_offset;
-	struct fuse_file_info in_fi;
+	int64_t entries;
+	int64_t errors;
+	const char *messages;
+	struct df_tar_reader *reader;
+	enum df_op op_code = DF_OP_IMPORT_END;
 
-	struct stat in_stat;
+	int64_t in_id;
 
 	/* retrieve the arguments */
 	ret = df_parse_payload(payload, &offset, header->payload_size,
-			DF_DATA_BUFFER, &in_path_len, &in_path,
-			DF_DATA_INT, &in_offset,
-			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_INT, &in_id,
 			DF_DATA_END);
 	if (0 > ret)
 		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
-	in_path[in_path_len - 1] = '\0';
+	slot = slot_find(&import_slots, in_id);
+	if (0 > slot)
+		return errno_reply(op_code, EBADF, ans_hdr, ans_pld);
+	reader = imports[slot];
+
+	/* perform the syscalls */
+	df_tar_reader_finish(reader);
+	df_tar_reader_stats(reader, &entries, &errors);
+	messages = df_tar_reader_messages(reader);
+	ret = df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_INT, entries,
+			DF_DATA_INT, errors,
+			DF_DATA_BUFFER, (int64_t)strlen(messages) + 1, messages,
+			DF_DATA_END);
+	df_tar_reader_close(imports + slot);
+	slot_release(&import_slots, slot);
 
-	dp = opendir(in_path);
-	if (dp == NULL)
-		return errno_reply(op_code, -errno, ans_hdr, ans_pld);
+	return ret;
+}
 
-	/* build the answer */
-	ret = df_build_payload(ans_pld, &size,
-			DF_DATA_FUSE_FILE_INFO, &in_fi,
-			DF_DATA_BLOCK_END);
-	if (0 > ret)
-		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+/*
+ * scans report the changed entries of a tree in as many DF_OP_SCAN_READ
+ * requests as needed
+ */
+static struct df_scan *scans[DF_SLOTS_MAX];
+static struct slots scan_slots;
 
-	while ((de = readdir(dp)) != NULL) {
-		memset(&in_stat, 0, sizeof(in_stat));
-		in_stat.st_ino = de->d_ino;
-		in_stat.st_mode = de->d_type << 12;
-		ret = df_build_payload(ans_pld, &size,
-				DF_DATA_BUFFER, strlen(de->d_name) + 1,
-				de->d_name,
-				DF_DATA_STAT, &in_stat,
-				DF_DATA_BLOCK_END);
-		if (0 > ret)
-			return errno_reply(op_code, -ret, ans_hdr, ans_pld);
-	}
-	closedir(dp);
+static void scans_cleanup(void)
+{
+	unsigned i;
 
-	/* terminate the payload */
-	ret = df_build_payload(ans_pld, &size,
-			DF_DATA_END);
-	if (0 > ret)
-		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	for (i = 0; i < DF_SLOTS_MAX; i++)
+		df_scan_close(scans + i);
+}
 
-	return fill_header(ans_hdr, size, op_code, 0);
+static struct df_scan *scan_get(int64_t id)
+{
+	int slot = slot_find(&scan_slots, id);
+
+	return 0 > slot ? NULL : scans[slot];
 }
 
-static int action_release(struct df_packet_header *header, char *payload,
+/* watches the directories walked by a scan, see enum df_scan_flags */
+static int scan_watch(const char *root, const char *path,
+		void __attribute__((unused)) *ctx)
+{
+	char dir[PATH_MAX];
+
+	if (sizeof(dir) <= (size_t)snprintf(dir, sizeof(dir), "%s/%s",
+				0 == strcmp(root, "/") ? "" : root, path))
+		return -ENAMETOOLONG;
+
+	return df_watch_dir(dir);
+}
+
+static int action_scan_begin(struct df_packet_header *header, char *payload,
 		struct df_packet_header *ans_hdr, char **ans_pld)
 {
 	int ret;
+	int slot;
 	size_t offset = 0;
-	enum df_op op_code = DF_OP_RELEASE;
+	struct timespec since;
+	struct timespec now;
+	enum df_op op_code = DF_OP_SCAN_BEGIN;
 
 	int64_t in_path_len;
 	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
-	struct fuse_file_info in_fi;
+	int64_t in_since_sec;
+	int64_t in_since_nsec;
+	int64_t in_manifest_len;
+	char __attribute__ ((cleanup(char_array_free))) *in_manifest = NULL;
+	int64_t in_flags;
 
 	/* retrieve the arguments */
 	ret = df_parse_payload(payload, &offset, header->payload_size,
-			DF_DATA_BUFFER, &in_path_len, &in_path,
-			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_PATH, &in_path_len, &in_path,
+			DF_DATA_INT, &in_since_sec,
+			DF_DATA_INT, &in_since_nsec,
+			DF_DATA_BUFFER, &in_manifest_len, &in_manifest,
+			DF_DATA_INT, &in_flags,
 			DF_DATA_END);
 	if (0 > ret)
 		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
-
-	/* perform the syscall */
-	ret = close(in_fi.fh);
-	if (ret == -1)
-		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	in_path[in_path_len - 1] = '\0';
+	since.tv_sec = in_since_sec;
+	since.tv_nsec = in_since_nsec;
+
+	/* perform the syscalls */
+	/*
+	 * since for a later scan, the clock of the files' times being coarser,
+	 * the changes made from now on can't be dated before
+	 */
+	clock_gettime(CLOCK_REALTIME, &now);
+	now.tv_sec--;
+	slot = slot_reserve(&scan_slots);
+	if (0 > slot)
+		return errno_reply(op_code, -slot, ans_hdr, ans_pld);
+	df_scan_close(scans + slot);
+	/* the root is watched before it's opened, not to miss a change */
+	if (in_flags & DF_SCAN_WATCH) {
+		ret = df_watch_dir(in_path);
+		if (0 > ret)
+			return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	}
+	ret = df_scan_open(scans + slot, in_path, &since,
+			0 == in_manifest_len ? NULL : (uint8_t *)in_manifest,
+			in_manifest_len, in_flags);
+	if (0 > ret)
+		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	if (in_flags & DF_SCAN_WATCH)
+		df_scan_set_dir_cb(scans[slot], scan_watch, NULL);
 
 	return df_request_build(ans_hdr, ans_pld, op_code,
-			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_INT, slot_fill(&scan_slots, slot),
+			DF_DATA_INT, (int64_t)now.tv_sec,
+			DF_DATA_INT, (int64_t)now.tv_nsec,
 			DF_DATA_END);
 }
 
-static int action_unlink(struct df_packet_header *header, char *payload,
+static int action_scan_read(struct df_packet_header *header, char *payload,
 		struct df_packet_header *ans_hdr, char **ans_pld)
 {
 	int ret;
+	ssize_t size;
 	size_t offset = 0;
-	enum df_op op_code = DF_OP_UNLINK;
+	struct df_scan *scan;
+	enum df_op op_code = DF_OP_SCAN_READ;
+	char __attribute__ ((cleanup(char_array_free))) *buf = NULL;
 
-	int64_t in_path_len;
-	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
+	int64_t in_id;
+	int64_t in_size;
 
 	/* retrieve the arguments */
 	ret = df_parse_payload(payload, &offset, header->payload_size,
-			DF_DATA_BUFFER, &in_path_len, &in_path,
+			DF_DATA_INT, &in_id,
+			DF_DATA_INT, &in_size,
 			DF_DATA_END);
 	if (0 > ret)
 		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
-
-	/* perform the syscall */
-	ret = unlink(in_path);
-	if (ret == -1)
+	scan = scan_get(in_id);
+	if (NULL == scan)
+		return errno_reply(op_code, EBADF, ans_hdr, ans_pld);
+	if (in_size > DF_SCAN_CHUNK_SIZE)
+		in_size = DF_SCAN_CHUNK_SIZE;
+	if (in_size < DF_SCAN_RECORD_MAX)
+		return errno_reply(op_code, EINVAL, ans_hdr, ans_pld);
+
+	/* perform the syscalls */
+	buf = malloc(in_size);
+	if (NULL == buf)
 		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	size = df_scan_read(scan, (uint8_t *)buf, in_size);
+	if (0 > size)
+		return errno_reply(op_code, -size, ans_hdr, ans_pld);
 
 	return df_request_build(ans_hdr, ans_pld, op_code,
+			DF_DATA_BUFFER, (int64_t)size, buf,
+			DF_DATA_INT, (int64_t)(0 == size),
+			DF_DATA_INT, df_scan_errors(scan),
 			DF_DATA_END);
 }
 
-static int action_write(struct df_packet_header *header, char *payload,
+static int action_scan_end(struct df_packet_header *header, char *payload,
 		struct df_packet_header *ans_hdr, char **ans_pld)
 {
 	int ret;
+	int slot;
 	size_t offset = 0;
-	enum df_op op_code = DF_OP_WRITE;
+	enum df_op op_code = DF_OP_SCAN_END;
 
-	int64_t in_path_len;
-	char __attribute__ ((cleanup(char_array_free))) *in_path = NULL;
-	int64_t in_size;
-	char __attribute__ ((cleanup(char_array_free))) *in_buf = NULL;
-	int64_t in_offset;
-	struct fuse_file_info in_fi;
+	int64_t in_id;
 
 	/* retrieve the arguments */
 	ret = df_parse_payload(payload, &offset, header->payload_size,
-			DF_DATA_BUFFER, &in_path_len, &in_path,
-			DF_DATA_BUFFER, &in_size, &in_buf,
-			DF_DATA_INT, &in_offset,
-			DF_DATA_FUSE_FILE_INFO, &in_fi,
+			DF_DATA_INT, &in_id,
 			DF_DATA_END);
 	if (0 > ret)
 		return errno_reply(op_code, -ret, ans_hdr, ans_pld);
+	slot = slot_find(&scan_slots, in_id);
+	if (0 > slot)
+		return errno_reply(op_code, EBADF, ans_hdr, ans_pld);
 
-	/* perform the syscall */
-	ret = pwrite(in_fi.fh, in_buf, in_size, in_offset);
-	if (ret == -1)
-		return errno_reply(op_code, errno, ans_hdr, ans_pld);
+	/* perform the syscalls */
+	df_scan_close(scans + slot);
+	slot_release(&scan_slots, slot);
 
 	return df_request_build(ans_hdr, ans_pld, op_code,
-			DF_DATA_INT, (int64_t)ret,
 			DF_DATA_END);
 }
 
@@ -437,6 +2008,8 @@ static action_t dispatch_table[] = {
 
 	[DF_OP_GETATTR] = action_getattr,
 	[DF_OP_READDIR] = action_readdir,
+	[DF_OP_OPENDIR] = action_opendir,
+	[DF_OP_RELEASEDIR] = action_releasedir,
 	[DF_OP_READLINK] = action_readlink,
 	[DF_OP_OPEN] = action_open,
 	[DF_OP_READ] = action_read,
@@ -447,7 +2020,7 @@ static action_t dispatch_table[] = {
 	[DF_OP_UNLINK] = action_unlink,
 	[DF_OP_RMDIR] = action_enosys,
 
-	[DF_OP_TRUNCATE] = action_enosys,
+	[DF_OP_TRUNCATE] = action_truncate,
 	[DF_OP_RENAME] = action_enosys,
 	[DF_OP_CHMOD] = action_enosys,
 	[DF_OP_CHOWN] = action_enosys,
@@ -464,6 +2037,28 @@ static action_t dispatch_table[] = {
 	[DF_OP_LISTXATTR] = action_enosys,
 	[DF_OP_REMOVEXATTR] = action_enosys,
 
+	[DF_OP_COPY_RANGE] = action_copy_range,
+	[DF_OP_TREE] = action_tree,
+	[DF_OP_CHECKSUM] = action_checksum,
+	[DF_OP_DELTA_BEGIN] = action_delta_begin,
+	[DF_OP_DELTA_APPLY] = action_delta_apply,
+	[DF_OP_DELTA_COMMIT] = action_delta_commit,
+	[DF_OP_EXPORT_BEGIN] = action_export_begin,
+	[DF_OP_EXPORT_READ] = action_export_read,
+	[DF_OP_EXPORT_END] = action_export_end,
+	[DF_OP_IMPORT_BEGIN] = action_import_begin,
+	[DF_OP_IMPORT_WRITE] = action_import_write,
+	[DF_OP_IMPORT_END] = action_import_end,
+	[DF_OP_SCAN_BEGIN] = action_scan_begin,
+	[DF_OP_SCAN_READ] = action_scan_read,
+	[DF_OP_SCAN_END] = action_scan_end,
+	[DF_OP_NOTIFY] = action_enosys,
+	[DF_OP_GETATTR_MANY] = action_getattr_many,
+	[DF_OP_WRITE_UNSTABLE] = action_write_unstable,
+	[DF_OP_COMMIT] = action_commit,
+	[DF_OP_WINDOW] = action_window,
+	[DF_OP_CANCEL] = action_cancel,
+
 	[DF_OP_QUIT] = action_enosys,
 };
 
@@ -485,15 +2080,69 @@ static int dispatch(struct df_packet_header *header, char *payload,
 	return action(header, payload, ans_hdr, ans_pld);
 }
 
+/* sends a DF_OP_NOTIFY message, ctx points to the socket */
+static void notify(const char *path, uint32_t flags, void *ctx)
+{
+	int sock = *(int *)ctx;
+	struct df_packet_header header;
+	char __attribute__ ((cleanup(char_array_free))) *payload = NULL;
+
+	if (0 > df_request_build(&header, &payload, DF_OP_NOTIFY,
+			DF_DATA_BUFFER, strlen(path) + 1, path,
+			DF_DATA_INT, (int64_t)flags,
+			DF_DATA_END))
+		return;
+	/* a write error will be seen by the next read */
+	df_write_message(sock, &header, payload);
+}
+
+/*
+ * receiver of the changes in the directories watched, the directory fds cached
+ * being checked again once one may have been renamed or removed, before the
+ * change is sent to the host
+ */
+static void on_change(const char *path, uint32_t flags, void *ctx)
+{
+	if (flags & DF_NOTIFY_OVERFLOW)
+		df_path_invalidate("/");
+	else if (flags & DF_NOTIFY_REMOVE)
+		df_path_cache_changed();
+	notify(path, flags, ctx);
+}
+
+/*
+ * serves the requests, notifications of the changes in the directories
+ * watched being sent between the answers
+ */
 static int event_loop(int sock)
 {
 	int ret;
+	struct pollfd fds[] = {
+		{ .fd = sock, .events = POLLIN, },
+		{ .fd = df_watch_fd(), .events = POLLIN, },
+	};
 	struct df_packet_header header;
 	char __attribute__ ((cleanup(char_array_free))) *payload = NULL;
 	struct df_packet_header ans_hdr;
 	char __attribute__ ((cleanup(char_array_free))) *ans_pld = NULL;
 
+	host_sock = sock;
+	memset(&header, 0, sizeof(header));
 	do {
+		ret = poll(fds, -1 == fds[1].fd ? 1 : 2, -1);
+		if (-1 == ret) {
+			if (EINTR == errno)
+				continue;
+			return -errno;
+		}
+		if (-1 != fds[1].fd && (fds[1].revents & POLLIN)) {
+			ret = df_watch_read(on_change, &sock);
+			if (0 > ret)
+				return ret;
+		}
+		if (!fds[0].revents)
+			continue;
+
 		memset(&header, 0, sizeof(header));
 		ret = df_read_message(sock, &header, &payload);
 		if (0 > ret)
@@ -504,16 +2153,76 @@ static int event_loop(int sock)
 		FREE(payload);
 		if (0 > ret)
 			return ret;
+		if (DF_NO_ANSWER == ret)
+			continue;
 
 		ret = df_write_message(sock, &ans_hdr, ans_pld);
 		FREE(ans_pld);
 		if (0 > ret)
 			return ret;
+		if ('\0' != unwatched[0]) {
+			notify(unwatched, DF_NOTIFY_OVERFLOW, &sock);
+			unwatched[0] = '\0';
+		}
 	} while (header.op_code != DF_OP_QUIT);
 
 	return 0;
 }
 
+/* accepts a host connection and serves it's requests until it quits */
+static int serve_host(int srv_sock)
+{
+	int ret;
+	int sock;
+	uint32_t device_version = 0;
+#ifdef USE_UNIX_SOCKET
+	struct sockaddr_un cli_addr;
+#else
+	struct sockaddr_in cli_addr;
+#endif
+	socklen_t addr_len = sizeof(cli_addr);
+
+	printf("Waiting for host\n");
+
+	memset(&cli_addr, 0, addr_len);
+#ifdef HAVE_ACCEPT4
+	sock = accept4(srv_sock, (struct sockaddr *)&cli_addr, &addr_len,
+			SOCK_CLOEXEC);
+#else
+	sock = accept(srv_sock, (struct sockaddr *)&cli_addr, &addr_len);
+	/* TODO add setting of the cloexec flag separately */
+#endif
+	if (-1 == sock) {
+		perror("accept");
+		return -errno;
+	}
+
+	printf("host %d is connected\n", sock);
+
+	ret = df_send_handshake(sock, DF_PROTOCOL_VERSION);
+	if (0 > ret)
+		goto out;
+
+	ret = df_read_handshake(sock, &device_version);
+	if (0 > ret)
+		goto out;
+
+	if (device_version != DF_PROTOCOL_VERSION) {
+		printf("protocol version mismatch, host : %u, device : %u\n",
+				DF_PROTOCOL_VERSION, device_version);
+		ret = -EPROTO;
+		goto out;
+	}
+
+	printf("Server listening for requests\n");
+
+	ret = event_loop(sock);
+out:
+	close(sock);
+
+	return ret;
+}
+
 static int usage(int status, const char *path)
 {
 	printf("usage : %s [local]\n", path);
@@ -526,19 +2235,15 @@ static int usage(int status, const char *path)
 int main(int argc, char *argv[])
 {
 	int ret;
-	uint32_t device_version = 0;
 #ifdef USE_UNIX_SOCKET
 	struct sockaddr_un addr;
-	struct sockaddr_un cli_addr;
 	int domain = AF_UNIX;
 #else
 	struct sockaddr_in addr;
-	struct sockaddr_in cli_addr;
 	int domain = AF_INET;
 #endif
 	socklen_t addr_len = sizeof(addr);
 	int srv_sock = -1;
-	int sock = -1;
 	int optval = 1;
 	int local = 0;
 
@@ -597,42 +2302,24 @@ int main(int argc, char *argv[])
 
 	/* TODO launch the client */
 
-	printf("Waiting for host\n");
-
-	memset(&cli_addr, 0, addr_len);
-#ifdef HAVE_ACCEPT4
-	sock = accept4(srv_sock, (struct sockaddr *)&cli_addr, &addr_len,
-			SOCK_CLOEXEC);
-#else
-	sock = accept(srv_sock, (struct sockaddr *)&cli_addr, &addr_len);
-	/* TODO add setting of the cloexec flag separately */
-#endif
-	if (-1 == sock) {
-		perror("accept");
-		return EXIT_FAILURE;
-	}
-
-	printf("host %d is connected\n", sock);
-
-	ret = df_send_handshake(sock, DF_PROTOCOL_VERSION);
-	if (0 > ret)
-		return EXIT_FAILURE;
-
-	ret = df_read_handshake(sock, &device_version);
-	if (0 > ret)
-		return EXIT_FAILURE;
-
-	if (device_version != DF_PROTOCOL_VERSION) {
-		printf("protocol version mismatch, host : %u, device : %u\n",
-				DF_PROTOCOL_VERSION, device_version);
-		return EXIT_FAILURE;
-	}
+	/* a host vanishing mustn't kill us */
+	signal(SIGPIPE, SIG_IGN);
 
-	printf("Server listening for requests\n");
+	/* without inotify, the host is told not to cache, see watch_dir */
+	if (0 > df_watch_init())
+		perror("inotify_init1");
 
-	ret = event_loop(sock);
+	/* the handles stay valid if the host reconnects after losing us */
+	do {
+		ret = serve_host(srv_sock);
+	} while (-EPIPE == ret);
+	df_handles_cleanup();
+	exports_cleanup();
+	imports_cleanup();
+	scans_cleanup();
+	df_watch_cleanup();
+	df_path_cache_cleanup();
 
-	close(sock);
 	close(srv_sock);
 
 	return ret;
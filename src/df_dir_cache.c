@@ -0,0 +1,760 @@
+/**
+ * @file df_dir_cache.c
+ *
+ * Names of the entries of directories listed entirely, each directory's names
+ * being indexed by an open addressing hash table, with linear probing, the
+ * directories themselves being indexed by a chained hash table
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "df_protocol.h"
+#include "df_dir_cache.h"
+#include "df_index.h"
+
+#define FREE(p) do { \
+	if (p) \
+		free(p); \
+	(p) = NULL; \
+} while (0) \
+
+/* entry of the table of names of a directory, free if name is NULL */
+struct name_slot {
+	char *name;
+	uint64_t hash;
+	/* attributes, NULL if unknown */
+	struct stat *st;
+};
+
+/* next_offset of the listings received from a snapshot */
+#define SNAPSHOT_OFFSET -1
+
+/* number of chains of the saved of the directories, a power of 2 */
+#define DIR_BUCKETS (2 * DF_DIR_CACHE_DIRS)
+
+struct cached_dir {
+	/** NULL if the slot is free */
+	char *path;
+	uint64_t hash;
+	/** version of the listing, valid if has_mtime is non-zero */
+	struct timespec mtime;
+	int has_mtime;
+	/** date of the snapshot, for those received in one */
+	struct timespec since;
+	/** non-zero once all the names are in the table */
+	int complete;
+	/** non-zero while a listing is received, up to next_offset */
+	int filling;
+	int64_t next_offset;
+	struct name_slot *slots;
+	/** number of slots minus one, the number of slots being a power of 2 */
+	size_t mask;
+	size_t count;
+	/** for the least recently used directory to be evicted */
+	unsigned long last_use;
+	/** saved + 1 of the next directory of the chain, 0 for none */
+	unsigned next;
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_dir dirs[DF_DIR_CACHE_DIRS];
+/* saved + 1 of the first directory of each chain, 0 for none */
+static unsigned buckets[DIR_BUCKETS];
+static size_t total_names;
+static unsigned long use_counter;
+/* listings saved by a previous mount, NULL if none */
+static struct df_index *saved;
+
+/* FNV-1a */
+static uint64_t hash_string(const char *s, size_t len)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	while (len--) {
+		hash ^= (uint8_t)*s++;
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+static void drop_names(struct cached_dir *d)
+{
+	size_t i;
+
+	if (NULL != d->slots)
+		for (i = 0; i <= d->mask; i++) {
+			free(d->slots[i].name);
+			free(d->slots[i].st);
+		}
+	free(d->slots);
+	d->slots = NULL;
+	total_names -= d->count;
+	d->count = 0;
+	d->mask = 0;
+	d->complete = 0;
+	d->filling = 0;
+}
+
+static void drop_dir(struct cached_dir *d)
+{
+	unsigned *link;
+
+	if (NULL == d->path)
+		return;
+
+	/* unchains it */
+	for (link = buckets + (d->hash & (DIR_BUCKETS - 1));
+			dirs + *link - 1 != d;
+			link = &dirs[*link - 1].next)
+		;
+	*link = d->next;
+
+	drop_names(d);
+	free(d->path);
+	memset(d, 0, sizeof(*d));
+}
+
+static struct cached_dir *find_dir(const char *path, size_t len)
+{
+	unsigned i;
+	struct cached_dir *d;
+	uint64_t hash = hash_string(path, len);
+
+	for (i = buckets[hash & (DIR_BUCKETS - 1)]; 0 != i; i = d->next) {
+		d = dirs + i - 1;
+		if (hash == d->hash && 0 == strncmp(d->path, path, len) &&
+				'\0' == d->path[len]) {
+			d->last_use = ++use_counter;
+			return d;
+		}
+	}
+
+	return NULL;
+}
+
+/* @return non-zero if a is a better candidate for eviction than b */
+static int evicts_before(const struct cached_dir *a, const struct cached_dir *b)
+{
+	if (NULL == a->path || NULL == b->path)
+		return NULL == a->path && NULL != b->path;
+	/* directories only known by their mtime are the cheapest to lose */
+	if ((0 == a->count) != (0 == b->count))
+		return 0 == a->count;
+
+	return a->last_use < b->last_use;
+}
+
+/* finds path's entry, or creates it, evicting the least valuable one */
+static struct cached_dir *get_dir(const char *path)
+{
+	unsigned i;
+	struct cached_dir *d;
+	struct cached_dir *lru = dirs;
+
+	d = find_dir(path, strlen(path));
+	if (NULL != d)
+		return d;
+
+	for (i = 1; i < DF_DIR_CACHE_DIRS; i++)
+		if (evicts_before(dirs + i, lru))
+			lru = dirs + i;
+	drop_dir(lru);
+	lru->path = strdup(path);
+	if (NULL == lru->path)
+		return NULL;
+	lru->hash = hash_string(path, strlen(path));
+	lru->last_use = ++use_counter;
+	lru->next = buckets[lru->hash & (DIR_BUCKETS - 1)];
+	buckets[lru->hash & (DIR_BUCKETS - 1)] = lru - dirs + 1;
+
+	return lru;
+}
+
+/* @return slot of name, or the free slot where it would be inserted */
+static struct name_slot *find_name(struct cached_dir *d, const char *name,
+		size_t len, uint64_t hash)
+{
+	size_t i;
+	struct name_slot *slot;
+
+	for (i = hash & d->mask; ; i = (i + 1) & d->mask) {
+		slot = d->slots + i;
+		if (NULL == slot->name || (hash == slot->hash &&
+				0 == strncmp(slot->name, name, len) &&
+				'\0' == slot->name[len]))
+			return slot;
+	}
+}
+
+/* doubles the table, keeping it at most half full */
+static int grow(struct cached_dir *d)
+{
+	size_t i;
+	size_t old_mask = d->mask;
+	struct name_slot *old = d->slots;
+	struct name_slot *slot;
+
+	d->mask = NULL == old ? 255 : 2 * old_mask + 1;
+	d->slots = calloc(d->mask + 1, sizeof(*d->slots));
+	if (NULL == d->slots) {
+		d->slots = old;
+		d->mask = old_mask;
+		return -errno;
+	}
+	if (NULL == old)
+		return 0;
+
+	for (i = 0; i <= old_mask; i++) {
+		if (NULL == old[i].name)
+			continue;
+		slot = find_name(d, old[i].name, strlen(old[i].name),
+				old[i].hash);
+		*slot = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+/* evicts least recently used directories until count names more fit */
+static int make_room(struct cached_dir *keep, size_t count)
+{
+	unsigned i;
+	struct cached_dir *lru;
+
+	while (total_names + count > DF_DIR_CACHE_NAMES_MAX) {
+		lru = NULL;
+		for (i = 0; i < DF_DIR_CACHE_DIRS; i++)
+			if (dirs + i != keep && 0 != dirs[i].count &&
+					(NULL == lru ||
+					 dirs[i].last_use < lru->last_use))
+				lru = dirs + i;
+		if (NULL == lru)
+			return -ENOSPC;
+		drop_names(lru);
+	}
+
+	return 0;
+}
+
+static int add_name(struct cached_dir *d, const char *name,
+		const struct stat *st)
+{
+	int ret;
+	size_t len = strlen(name);
+	uint64_t hash = hash_string(name, len);
+	struct name_slot *slot;
+
+	if (2 * (d->count + 1) > d->mask + 1) {
+		ret = grow(d);
+		if (0 > ret)
+			return ret;
+	}
+	slot = find_name(d, name, len, hash);
+	/* a snapshot updates the attributes of the entries merged */
+	if (NULL != slot->name && NULL != st && NULL != slot->st)
+		*slot->st = *st;
+	if (NULL != slot->name)
+		return 0;
+	if (NULL != st) {
+		slot->st = malloc(sizeof(*slot->st));
+		if (NULL == slot->st)
+			return -errno;
+		*slot->st = *st;
+	}
+	slot->name = strdup(name);
+	if (NULL == slot->name) {
+		FREE(slot->st);
+		return -errno;
+	}
+	slot->hash = hash;
+	d->count++;
+	total_names++;
+
+	return 0;
+}
+
+void df_dir_cache_set_attr(const char *path, const struct stat *st)
+{
+	struct cached_dir *d;
+
+	if (!S_ISDIR(st->st_mode))
+		return;
+
+	pthread_mutex_lock(&mutex);
+	d = get_dir(path);
+	if (NULL != d) {
+		if (d->has_mtime && (d->mtime.tv_sec != st->st_mtim.tv_sec ||
+				d->mtime.tv_nsec != st->st_mtim.tv_nsec))
+			drop_names(d);
+		d->mtime = st->st_mtim;
+		d->has_mtime = 1;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void df_dir_cache_fill(const char *path, int64_t start,
+		const struct df_dirent *entries, size_t count, int eof)
+{
+	size_t i;
+	struct cached_dir *d;
+
+	pthread_mutex_lock(&mutex);
+	d = find_dir(path, strlen(path));
+	/* without a version, the listing couldn't be checked */
+	if (NULL == d || !d->has_mtime || d->complete)
+		goto out;
+
+	if (0 == start) {
+		drop_names(d);
+		d->filling = 1;
+		d->next_offset = 0;
+	}
+	/* a chunk is missing, e.g. the listing was restarted elsewhere */
+	if (!d->filling || start != d->next_offset) {
+		drop_names(d);
+		goto out;
+	}
+
+	if (0 > make_room(d, count))
+		goto drop;
+	for (i = 0; i < count; i++)
+		if (0 > add_name(d, entries[i].name, NULL))
+			goto drop;
+	if (0 != count)
+		d->next_offset = entries[count - 1].off;
+	if (eof) {
+		d->filling = 0;
+		d->complete = 1;
+	}
+	goto out;
+
+drop:
+	drop_names(d);
+out:
+	pthread_mutex_unlock(&mutex);
+}
+
+void df_dir_cache_stat(const struct df_scan_entry *entry, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = entry->ino;
+	st->st_mode = entry->mode;
+	st->st_nlink = entry->nlink;
+	st->st_uid = entry->uid;
+	st->st_gid = entry->gid;
+	st->st_rdev = entry->rdev;
+	st->st_size = entry->size;
+	st->st_blksize = entry->blksize;
+	st->st_blocks = entry->blocks;
+	st->st_atime = entry->atime.tv_sec;
+	st->st_mtime = entry->mtime.tv_sec;
+	st->st_ctime = entry->ctime.tv_sec;
+}
+
+/* inverse of df_dir_cache_stat */
+static void entry_of(const struct stat *st, struct df_scan_entry *entry)
+{
+	entry->kind = DF_SCAN_ATTRS;
+	entry->ino = st->st_ino;
+	entry->mode = st->st_mode;
+	entry->nlink = st->st_nlink;
+	entry->uid = st->st_uid;
+	entry->gid = st->st_gid;
+	entry->rdev = st->st_rdev;
+	entry->size = st->st_size;
+	entry->blksize = st->st_blksize;
+	entry->blocks = st->st_blocks;
+	entry->atime = st->st_atim;
+	entry->mtime = st->st_mtim;
+	entry->ctime = st->st_ctim;
+}
+
+void df_dir_cache_begin(const char *path, const struct stat *st,
+		const struct timespec *since)
+{
+	struct cached_dir *d;
+
+	pthread_mutex_lock(&mutex);
+	d = get_dir(path);
+	if (NULL != d) {
+		drop_names(d);
+		d->mtime = st->st_mtim;
+		d->has_mtime = 1;
+		d->since = *since;
+		d->filling = 1;
+		d->next_offset = SNAPSHOT_OFFSET;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/* @return the directory path, if it's receiving a snapshot, mutex held */
+static struct cached_dir *find_snapshot_dir(const char *path)
+{
+	struct cached_dir *d = find_dir(path, strlen(path));
+
+	if (NULL == d || !d->filling || SNAPSHOT_OFFSET != d->next_offset)
+		return NULL;
+
+	return d;
+}
+
+void df_dir_cache_add(const char *path, const char *name,
+		const struct stat *st)
+{
+	struct cached_dir *d;
+
+	pthread_mutex_lock(&mutex);
+	d = find_snapshot_dir(path);
+	if (NULL != d && (0 > make_room(d, 1) || 0 > add_name(d, name, st)))
+		drop_names(d);
+	pthread_mutex_unlock(&mutex);
+}
+
+void df_dir_cache_end(const char *path, int complete)
+{
+	struct cached_dir *d;
+
+	pthread_mutex_lock(&mutex);
+	d = find_snapshot_dir(path);
+	if (NULL != d && !complete)
+		drop_names(d);
+	else if (NULL != d) {
+		d->filling = 0;
+		d->complete = 1;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+int df_dir_cache_load(const char *file)
+{
+	int ret;
+
+	pthread_mutex_lock(&mutex);
+	df_index_close(&saved);
+	ret = df_index_open(&saved, file);
+	pthread_mutex_unlock(&mutex);
+
+	return ret;
+}
+
+int df_dir_cache_indexed_since(const char *path, struct timespec *since)
+{
+	int ret = -ENOENT;
+	size_t size;
+	const uint8_t *records;
+
+	pthread_mutex_lock(&mutex);
+	if (NULL != saved)
+		ret = df_index_find(saved, path, &records, &size, since);
+	pthread_mutex_unlock(&mutex);
+
+	return ret;
+}
+
+int df_dir_cache_merge(const char *path)
+{
+	int ret = -ENOENT;
+	size_t size = 0;
+	size_t offset = 0;
+	struct stat st;
+	struct timespec since;
+	struct cached_dir *d;
+	const uint8_t *records;
+	struct df_scan_entry entry = { .kind = DF_SCAN_ENTRY };
+
+	pthread_mutex_lock(&mutex);
+	d = find_snapshot_dir(path);
+	if (NULL == d)
+		goto out;
+	if (NULL != saved)
+		ret = df_index_find(saved, path, &records, &size, &since);
+	while (0 == ret && offset < size) {
+		ret = df_scan_decode(records, size, &offset, &entry);
+		if (0 == ret)
+			ret = make_room(d, 1);
+		if (0 == ret && DF_SCAN_ATTRS == entry.kind)
+			df_dir_cache_stat(&entry, &st);
+		if (0 == ret)
+			ret = add_name(d, entry.path, DF_SCAN_ATTRS ==
+					entry.kind ? &st : NULL);
+	}
+	if (0 > ret)
+		drop_names(d);
+out:
+	pthread_mutex_unlock(&mutex);
+
+	return ret;
+}
+
+/* encodes the listing of d, in *buf, of *capacity bytes, mutex held */
+static ssize_t encode_dir(struct cached_dir *d, uint8_t **buf,
+		size_t *capacity)
+{
+	size_t i;
+	size_t len;
+	size_t size = 0;
+	uint8_t *tmp;
+	const char *prev = "";
+	struct name_slot *slot;
+	struct df_scan_entry entry;
+
+	for (i = 0; NULL != d->slots && i <= d->mask; i++) {
+		slot = d->slots + i;
+		if (NULL == slot->name)
+			continue;
+		if (*capacity - size < DF_SCAN_RECORD_MAX) {
+			tmp = realloc(*buf, 2 * *capacity + DF_SCAN_RECORD_MAX);
+			if (NULL == tmp)
+				return -errno;
+			*buf = tmp;
+			*capacity = 2 * *capacity + DF_SCAN_RECORD_MAX;
+		}
+
+		memset(&entry, 0, sizeof(entry));
+		/* names whose attributes were dropped are kept alone */
+		if (NULL != slot->st)
+			entry_of(slot->st, &entry);
+		else
+			entry.kind = DF_SCAN_ENTRY;
+		if (strlen(slot->name) >= sizeof(entry.path))
+			return -ENAMETOOLONG;
+		strcpy(entry.path, slot->name);
+		len = df_scan_encode(*buf + size, *capacity - size, prev,
+				&entry);
+		prev = slot->name;
+		size += len;
+	}
+
+	return size;
+}
+
+int df_dir_cache_save(const char *file)
+{
+	int ret;
+	unsigned i;
+	ssize_t size;
+	struct cached_dir *d;
+	uint8_t *buf = NULL;
+	size_t capacity = 0;
+	struct df_index_writer *writer;
+
+	ret = df_index_writer_open(&writer, file);
+	if (0 > ret)
+		return ret;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; 0 == ret && i < DF_DIR_CACHE_DIRS; i++) {
+		d = dirs + i;
+		if (NULL == d->path || !d->complete ||
+				SNAPSHOT_OFFSET != d->next_offset)
+			continue;
+		size = encode_dir(d, &buf, &capacity);
+		ret = 0 > size ? (int)size : df_index_writer_add(writer,
+				d->path, &d->since, buf, size);
+	}
+	pthread_mutex_unlock(&mutex);
+	free(buf);
+
+	if (0 > ret) {
+		df_index_writer_close(&writer, 0);
+		return ret;
+	}
+
+	return df_index_writer_close(&writer, 1);
+}
+
+/*
+ * finds the slot of the entry whose path is the first len bytes of path, in
+ * the listing of it's parent, complete or not, mutex held
+ * @param parent On output, the parent, NULL if it isn't cached
+ * @return NULL if the parent isn't cached or if it's listing is empty
+ */
+static struct name_slot *find_entry(const char *path, size_t len,
+		struct cached_dir **parent)
+{
+	size_t dir_len;
+	const char *name;
+
+	*parent = NULL;
+	for (name = path + len; name != path && '/' != name[-1]; name--)
+		;
+	if (name == path || name == path + len)
+		return NULL;
+	/* the parent of /name is / */
+	dir_len = name - 1 == path ? 1 : (size_t)(name - 1 - path);
+
+	*parent = find_dir(path, dir_len);
+	if (NULL == *parent || NULL == (*parent)->slots)
+		return NULL;
+
+	return find_name(*parent, name, path + len - name,
+			hash_string(name, path + len - name));
+}
+
+enum df_dir_cache_result df_dir_cache_lookup(const char *path)
+{
+	struct cached_dir *d;
+	struct name_slot *slot;
+	enum df_dir_cache_result ret = DF_DIR_CACHE_UNKNOWN;
+
+	pthread_mutex_lock(&mutex);
+	slot = find_entry(path, strlen(path), &d);
+	if (NULL != d && d->complete)
+		ret = NULL != slot && NULL != slot->name ?
+				DF_DIR_CACHE_PRESENT : DF_DIR_CACHE_ABSENT;
+	pthread_mutex_unlock(&mutex);
+
+	return ret;
+}
+
+int df_dir_cache_get_attr(const char *path, struct stat *st)
+{
+	int ret = -ENODATA;
+	struct cached_dir *d;
+	struct name_slot *slot;
+
+	pthread_mutex_lock(&mutex);
+	slot = find_entry(path, strlen(path), &d);
+	if (NULL != d && d->complete) {
+		if (NULL == slot || NULL == slot->name) {
+			ret = -ENOENT;
+		} else if (NULL != slot->st) {
+			*st = *slot->st;
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return ret;
+}
+
+void df_dir_cache_put_attr(const char *path, const struct stat *st)
+{
+	struct cached_dir *d;
+	struct name_slot *slot;
+
+	pthread_mutex_lock(&mutex);
+	slot = find_entry(path, strlen(path), &d);
+	if (NULL == d || !d->complete || NULL == slot || NULL == slot->name)
+		goto out;
+	if (NULL == slot->st)
+		slot->st = malloc(sizeof(*slot->st));
+	if (NULL != slot->st)
+		*slot->st = *st;
+out:
+	pthread_mutex_unlock(&mutex);
+}
+
+int df_dir_cache_unknown_attrs(const char *path, char **names, size_t *size)
+{
+	int ret = -ENODATA;
+	size_t i;
+	size_t len;
+	char *p;
+	struct cached_dir *d;
+	struct name_slot *slot;
+
+	*names = NULL;
+	*size = 0;
+	pthread_mutex_lock(&mutex);
+	d = find_dir(path, strlen(path));
+	if (NULL == d || !d->complete)
+		goto out;
+
+	ret = 0;
+	for (i = 0; 0 != d->count && i <= d->mask; i++) {
+		slot = d->slots + i;
+		if (NULL == slot->name || NULL != slot->st ||
+				0 == strcmp(slot->name, ".") ||
+				0 == strcmp(slot->name, ".."))
+			continue;
+		len = strlen(slot->name) + 1;
+		p = realloc(*names, *size + len);
+		if (NULL == p) {
+			ret = -errno;
+			FREE(*names);
+			*size = 0;
+			goto out;
+		}
+		*names = p;
+		memcpy(*names + *size, slot->name, len);
+		*size += len;
+		ret++;
+	}
+out:
+	pthread_mutex_unlock(&mutex);
+
+	return ret;
+}
+
+/* drops the attributes of the first len bytes of path, mutex held */
+static void drop_attr(const char *path, size_t len)
+{
+	struct cached_dir *d;
+	struct name_slot *slot;
+
+	slot = find_entry(path, len, &d);
+	if (NULL != slot && NULL != slot->name)
+		FREE(slot->st);
+}
+
+/* @return non-zero if path is prefix or is under it */
+static int is_under(const char *path, const char *prefix)
+{
+	size_t len = strlen(prefix);
+
+	if (0 == strcmp(prefix, "/"))
+		return 1;
+
+	return 0 == strncmp(path, prefix, len) &&
+			('\0' == path[len] || '/' == path[len]);
+}
+
+void df_dir_cache_invalidate(const char *path, int64_t flags)
+{
+	unsigned i;
+	size_t len;
+	const char *slash;
+	struct cached_dir *d;
+
+	pthread_mutex_lock(&mutex);
+	drop_attr(path, strlen(path));
+	/*
+	 * the parent's listing, the entry appeared or disappeared, and it's
+	 * attributes, it's mtime having changed
+	 */
+	slash = strrchr(path, '/');
+	if (NULL != slash &&
+			(flags & (DF_NOTIFY_CREATE | DF_NOTIFY_REMOVE |
+				  DF_NOTIFY_OVERFLOW))) {
+		len = slash == path ? 1 : (size_t)(slash - path);
+		d = find_dir(path, len);
+		if (NULL != d)
+			drop_dir(d);
+		drop_attr(path, len);
+	}
+	/* the directory itself, and those under it */
+	if (flags & (DF_NOTIFY_REMOVE | DF_NOTIFY_OVERFLOW))
+		for (i = 0; i < DF_DIR_CACHE_DIRS; i++)
+			if (NULL != dirs[i].path &&
+					is_under(dirs[i].path, path))
+				drop_dir(dirs + i);
+	pthread_mutex_unlock(&mutex);
+}
+
+void df_dir_cache_cleanup(void)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < DF_DIR_CACHE_DIRS; i++)
+		drop_dir(dirs + i);
+	df_index_close(&saved);
+	pthread_mutex_unlock(&mutex);
+}
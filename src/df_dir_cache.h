@@ -0,0 +1,144 @@
+#ifndef DF_DIR_CACHE_H
+#define DF_DIR_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "df_scan.h"
+
+/*
+ * host side cache of the names of the entries of the directories listed
+ * entirely, for the lookups of missing entries not to cost a round trip.
+ * Directories are versioned by their mtime, a listing is used only if it's
+ * mtime is the one seen by the last getattr of the directory, and dropped on
+ * the device's notifications of changes.
+ * Listings received in a snapshot carry the attributes of the entries too,
+ * the device watching the directories they come from, the attributes of the
+ * entries of other listings can be added afterwards. They can be saved in an
+ * index, for the next snapshots to transfer only what changed meanwhile.
+ */
+
+/* maximum number of directories cached */
+#define DF_DIR_CACHE_DIRS 4096
+
+/* maximum number of names cached, in all the directories */
+#define DF_DIR_CACHE_NAMES_MAX (1 << 20)
+
+/* directory entry, as received in a readdir chunk */
+struct df_dirent {
+	char *name;
+	int64_t ino;
+	int64_t type;
+	/* offset of the next entry */
+	int64_t off;
+};
+
+enum df_dir_cache_result {
+	DF_DIR_CACHE_UNKNOWN, /**< the parent directory isn't cached */
+	DF_DIR_CACHE_ABSENT,  /**< the entry doesn't exist */
+	DF_DIR_CACHE_PRESENT, /**< the entry exists */
+};
+
+/**
+ * records the attributes of path, obtained from the device, a directory's
+ * listing is dropped if it's mtime changed
+ */
+void df_dir_cache_set_attr(const char *path, const struct stat *st);
+
+/**
+ * adds a chunk of a listing to the cache, the directory becoming complete
+ * once the chunks from offset 0 to the last one have been received in order
+ * @param start Offset the chunk was requested at
+ * @param eof Non-zero if the chunk is the last one
+ */
+void df_dir_cache_fill(const char *path, int64_t start,
+		const struct df_dirent *entries, size_t count, int eof);
+
+/**
+ * converts the attributes of a DF_SCAN_ATTRS record, the same way
+ * DF_DATA_STAT does, times having no nanoseconds
+ */
+void df_dir_cache_stat(const struct df_scan_entry *entry, struct stat *st);
+
+/**
+ * starts receiving the listing of a directory from a snapshot, replacing the
+ * one cached, if any
+ * @param st Attributes of the directory, at the time it was listed
+ * @param since Date of the snapshot, from the device's clock
+ */
+void df_dir_cache_begin(const char *path, const struct stat *st,
+		const struct timespec *since);
+
+/* adds an entry of a listing started with df_dir_cache_begin */
+void df_dir_cache_add(const char *path, const char *name,
+		const struct stat *st);
+
+/**
+ * ends a listing started with df_dir_cache_begin, which is used from then on,
+ * unless it was invalidated or evicted meanwhile
+ * @param complete Zero if some entries were missing, the listing being dropped
+ */
+void df_dir_cache_end(const char *path, int complete);
+
+/**
+ * maps an index saved by df_dir_cache_save, from which listings can then be
+ * merged
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_dir_cache_load(const char *file);
+
+/**
+ * @param since On output, date of the snapshot path's listing comes from
+ * @return 0 on success, -ENOENT if path's listing isn't in the index loaded
+ */
+int df_dir_cache_indexed_since(const char *path, struct timespec *since);
+
+/**
+ * adds the entries of path's listing in the index loaded to the listing
+ * started with df_dir_cache_begin, which is dropped if it isn't indexed
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_dir_cache_merge(const char *path);
+
+/**
+ * saves the listings received in snapshots, to file, which is replaced only
+ * on success
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_dir_cache_save(const char *file);
+
+/* @return whether path exists, according to the listing of it's parent */
+enum df_dir_cache_result df_dir_cache_lookup(const char *path);
+
+/**
+ * @return 0 if the attributes of path are cached, in which case they are
+ * stored in st, -ENOENT if it doesn't exist according to the listing of it's
+ * parent, -ENODATA otherwise
+ */
+int df_dir_cache_get_attr(const char *path, struct stat *st);
+
+/**
+ * records the attributes of an entry of a complete listing, obtained from the
+ * device, which watches it's parent directory
+ */
+void df_dir_cache_put_attr(const char *path, const struct stat *st);
+
+/**
+ * lists the entries of path's listing whose attributes aren't cached
+ * @param names On output, the names, each followed by a '\0', to be freed
+ * @param size On output, the size of names
+ * @return number of names, -ENODATA if path's listing isn't complete,
+ * errno-compatible negative value on error
+ */
+int df_dir_cache_unknown_attrs(const char *path, char **names, size_t *size);
+
+/**
+ * drops what is known about path and it's parent, flags being a combination
+ * of enum df_notify_flags, DF_NOTIFY_CHANGE dropping only path's attributes
+ */
+void df_dir_cache_invalidate(const char *path, int64_t flags);
+
+void df_dir_cache_cleanup(void);
+
+#endif /* DF_DIR_CACHE_H */
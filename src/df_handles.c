@@ -0,0 +1,326 @@
+/**
+ * @file df_handles.c
+ *
+ * Table of the files and directories opened by the host. The handles passed
+ * to the host are virtual : only the most recently used ones have an fd open,
+ * the others are reopened on demand, so that the host can keep open more files
+ * than the device's RLIMIT_NOFILE allows. A reopened fd must refer to the file
+ * first opened, and the fds of the files unlinked, which couldn't be reopened,
+ * are never evicted
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "df_handles.h"
+#include "df_path_cache.h"
+
+/* fds left to the rest of the daemon : sockets, path cache, pipes... */
+#define RESERVED_FDS (DF_PATH_CACHE_SIZE + 32)
+#define MIN_FDS 8
+#define MAX_FDS 4096
+
+/* flags which mustn't be replayed when a file is reopened */
+#define CREATION_FLAGS (O_CREAT | O_EXCL | O_TRUNC)
+
+struct handle {
+	char *path;
+	int flags;
+	enum df_handle_kind kind;
+	/* -1 if the fd has been evicted */
+	int fd;
+	/* identity of the file, checked when it's reopened */
+	dev_t dev;
+	ino_t ino;
+	/* non-zero if the file is unlinked, it's fd being out of the LRU list */
+	int pinned;
+	/* first error of the operations not answered, 0 if none */
+	int error;
+	/* incremented each time the slot is reused, to detect stale handles */
+	uint32_t generation;
+	/* index of the next free slot, when the slot is free */
+	size_t next_free;
+	/* neighbours in the LRU list of handles with an open fd */
+	struct handle *lru_prev;
+	struct handle *lru_next;
+};
+
+static struct handle **table;
+static size_t table_size;
+/* first free slot, table_size if there is none */
+static size_t first_free;
+
+/* sentinel of the circular LRU list, lru.lru_next is the least recently used */
+static struct handle lru = {
+	.lru_prev = &lru,
+	.lru_next = &lru,
+};
+
+static unsigned open_fds;
+static unsigned max_fds;
+
+static unsigned compute_max_fds(void)
+{
+	struct rlimit rl;
+
+	if (-1 == getrlimit(RLIMIT_NOFILE, &rl) ||
+			RLIM_INFINITY == rl.rlim_cur ||
+			rl.rlim_cur > MAX_FDS + RESERVED_FDS)
+		return MAX_FDS;
+	if (rl.rlim_cur < MIN_FDS + RESERVED_FDS)
+		return MIN_FDS;
+
+	return rl.rlim_cur - RESERVED_FDS;
+}
+
+static void lru_unlink(struct handle *h)
+{
+	h->lru_prev->lru_next = h->lru_next;
+	h->lru_next->lru_prev = h->lru_prev;
+}
+
+static void lru_push(struct handle *h)
+{
+	h->lru_prev = lru.lru_prev;
+	h->lru_next = &lru;
+	lru.lru_prev->lru_next = h;
+	lru.lru_prev = h;
+}
+
+static void close_fd(struct handle *h)
+{
+	if (-1 == h->fd)
+		return;
+
+	if (!h->pinned)
+		lru_unlink(h);
+	h->pinned = 0;
+	close(h->fd);
+	h->fd = -1;
+	open_fds--;
+}
+
+/*
+ * closes the fd least recently used, the files found unlinked meanwhile being
+ * pinned instead, returns 0 if there was none
+ */
+static int evict_one(void)
+{
+	struct stat st;
+	struct handle *h;
+
+	while (lru.lru_next != &lru) {
+		h = lru.lru_next;
+		if (0 == fstat(h->fd, &st) && 0 == st.st_nlink) {
+			lru_unlink(h);
+			h->pinned = 1;
+			continue;
+		}
+		close_fd(h);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * opens the fd of h, recording the identity of the file the first time, and
+ * failing with -ESTALE if a reopened one isn't the same file anymore
+ */
+static int open_fd(struct handle *h, int flags, int reopen)
+{
+	int fd;
+	struct stat st;
+	struct df_path at;
+
+	if (0 == max_fds)
+		max_fds = compute_max_fds();
+	while (open_fds >= max_fds && evict_one())
+		;
+
+	if (DF_HANDLE_DIR == h->kind)
+		flags = O_RDONLY | O_DIRECTORY;
+	fd = DF_PATH_AT(&at, h->path, openat(at.dirfd, at.name,
+				flags | O_CLOEXEC));
+	/* some fds we don't account for may be open */
+	while (-1 == fd && (EMFILE == errno || ENFILE == errno) && evict_one())
+		fd = DF_PATH_AT(&at, h->path, openat(at.dirfd, at.name,
+					flags | O_CLOEXEC));
+	if (-1 == fd)
+		return reopen && ENOENT == errno ? -ESTALE : -errno;
+	if (-1 == fstat(fd, &st)) {
+		close(fd);
+		return -errno;
+	}
+	if (!reopen) {
+		h->dev = st.st_dev;
+		h->ino = st.st_ino;
+	} else if (h->dev != st.st_dev || h->ino != st.st_ino) {
+		close(fd);
+		return -ESTALE;
+	}
+
+	h->fd = fd;
+	lru_push(h);
+	open_fds++;
+
+	return fd;
+}
+
+/* slots are allocated once, for the LRU list links to stay valid */
+static int grow_table(void)
+{
+	size_t i;
+	size_t new_size = table_size ? 2 * table_size : 64;
+	struct handle **new_table;
+
+	new_table = realloc(table, new_size * sizeof(*table));
+	if (NULL == new_table)
+		return -errno;
+	table = new_table;
+
+	for (i = table_size; i < new_size; i++) {
+		table[i] = calloc(1, sizeof(**table));
+		if (NULL == table[i])
+			break;
+		table[i]->fd = -1;
+		table[i]->next_free = i + 1;
+	}
+	if (i == table_size)
+		return -ENOMEM;
+	first_free = table_size;
+	table_size = i;
+
+	return 0;
+}
+
+static struct handle *lookup(uint64_t handle)
+{
+	size_t index = (handle & 0xFFFFFFFF) - 1;
+	struct handle *h;
+
+	if (index >= table_size)
+		return NULL;
+	h = table[index];
+	if (NULL == h->path || h->generation != handle >> 32)
+		return NULL;
+
+	return h;
+}
+
+int df_handle_open(const char *path, int flags, enum df_handle_kind kind,
+		uint64_t *handle)
+{
+	int ret;
+	size_t index;
+	struct handle *h;
+
+	if (first_free == table_size) {
+		ret = grow_table();
+		if (0 > ret)
+			return ret;
+	}
+	index = first_free;
+	h = table[index];
+
+	h->path = strdup(path);
+	if (NULL == h->path)
+		return -errno;
+	h->flags = flags & ~CREATION_FLAGS;
+	h->kind = kind;
+	h->error = 0;
+	ret = open_fd(h, flags, 0);
+	if (0 > ret) {
+		free(h->path);
+		h->path = NULL;
+		return ret;
+	}
+
+	first_free = h->next_free;
+	*handle = ((uint64_t)h->generation << 32) | (index + 1);
+
+	return 0;
+}
+
+int df_handle_fd(uint64_t handle)
+{
+	struct handle *h = lookup(handle);
+
+	if (NULL == h)
+		return -EBADF;
+
+	if (-1 == h->fd)
+		return open_fd(h, h->flags, 1);
+	if (h->pinned)
+		return h->fd;
+
+	lru_unlink(h);
+	lru_push(h);
+
+	return h->fd;
+}
+
+const char *df_handle_path(uint64_t handle)
+{
+	struct handle *h = lookup(handle);
+
+	return NULL == h ? NULL : h->path;
+}
+
+void df_handle_set_error(uint64_t handle, int err)
+{
+	struct handle *h = lookup(handle);
+
+	if (NULL != h && 0 == h->error)
+		h->error = err;
+}
+
+int df_handle_error(uint64_t handle)
+{
+	int err;
+	struct handle *h = lookup(handle);
+
+	if (NULL == h)
+		return -EBADF;
+
+	err = h->error;
+	h->error = 0;
+
+	return err;
+}
+
+int df_handle_close(uint64_t handle)
+{
+	struct handle *h = lookup(handle);
+
+	if (NULL == h)
+		return -EBADF;
+
+	close_fd(h);
+	free(h->path);
+	h->path = NULL;
+	h->generation++;
+	h->next_free = first_free;
+	first_free = (handle & 0xFFFFFFFF) - 1;
+
+	return 0;
+}
+
+void df_handles_cleanup(void)
+{
+	size_t i;
+
+	for (i = 0; i < table_size; i++) {
+		close_fd(table[i]);
+		free(table[i]->path);
+		free(table[i]);
+	}
+	free(table);
+	table = NULL;
+	table_size = 0;
+	first_free = 0;
+}
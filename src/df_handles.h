@@ -0,0 +1,57 @@
+#ifndef DF_HANDLES_H
+#define DF_HANDLES_H
+
+#include <stdint.h>
+
+/* kinds of objects a handle can refer to */
+enum df_handle_kind {
+	DF_HANDLE_FILE,
+	DF_HANDLE_DIR,
+};
+
+/**
+ * opens path and registers it in the handle table, the handle returned stays
+ * valid until df_handle_close, even if it's fd has been closed in between to
+ * make room for others, in which case, it is reopened on demand
+ * @param path Absolute path of the file or the directory
+ * @param flags Open flags, only used for files
+ * @param kind Kind of object path is
+ * @param handle On output, handle to pass to the host
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_handle_open(const char *path, int flags, enum df_handle_kind kind,
+		uint64_t *handle);
+
+/**
+ * returns the fd corresponding to a handle, reopening it if it has been
+ * evicted, for directories, the position of a reopened fd is lost
+ * @return fd, valid until the next call to a df_handle_* function, or
+ * errno-compatible negative value, -EBADF for unknown or stale handles,
+ * -ESTALE if the file was removed or replaced since it's fd was evicted
+ */
+int df_handle_fd(uint64_t handle);
+
+/* @return path the handle has been opened with, NULL if it's unknown */
+const char *df_handle_path(uint64_t handle);
+
+/**
+ * records the error of an operation on a handle the host doesn't wait for,
+ * only the first one is kept, until df_handle_error is called
+ * @param err errno-compatible negative value
+ */
+void df_handle_set_error(uint64_t handle, int err);
+
+/**
+ * @return first error recorded with df_handle_set_error since the last call,
+ * which is then forgotten, 0 if there was none, -EBADF for unknown or stale
+ * handles
+ */
+int df_handle_error(uint64_t handle);
+
+/* closes the fd of the handle, if open, and unregisters it */
+int df_handle_close(uint64_t handle);
+
+/* closes and unregisters all the handles */
+void df_handles_cleanup(void);
+
+#endif /* DF_HANDLES_H */
@@ -0,0 +1,385 @@
+/**
+ * @file df_hash.c
+ *
+ * Hash functions used to compare files without transferring them : xxHash64
+ * for speed, SHA-256 when collisions must be ruled out
+ */
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "df_hash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t rotr32(uint32_t x, int r)
+{
+	return (x >> r) | (x << (32 - r));
+}
+
+static inline uint64_t read_le64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return le64toh(v);
+}
+
+static inline uint32_t read_le32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return le32toh(v);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t h, uint64_t acc)
+{
+	h ^= xxh64_round(0, acc);
+
+	return h * PRIME64_1 + PRIME64_4;
+}
+
+static void xxh64_init(struct df_xxh64 *x)
+{
+	memset(x, 0, sizeof(*x));
+	x->acc[0] = PRIME64_1 + PRIME64_2;
+	x->acc[1] = PRIME64_2;
+	x->acc[2] = 0;
+	x->acc[3] = -PRIME64_1;
+}
+
+/*
+ * the four accumulators are independent, which lets the CPU process the four
+ * lanes of each 32 bytes stripe in parallel
+ */
+static const uint8_t *xxh64_stripes(struct df_xxh64 *x, const uint8_t *p,
+		const uint8_t *end)
+{
+	uint64_t a0 = x->acc[0];
+	uint64_t a1 = x->acc[1];
+	uint64_t a2 = x->acc[2];
+	uint64_t a3 = x->acc[3];
+
+	for (; p + 32 <= end; p += 32) {
+		a0 = xxh64_round(a0, read_le64(p));
+		a1 = xxh64_round(a1, read_le64(p + 8));
+		a2 = xxh64_round(a2, read_le64(p + 16));
+		a3 = xxh64_round(a3, read_le64(p + 24));
+	}
+	x->acc[0] = a0;
+	x->acc[1] = a1;
+	x->acc[2] = a2;
+	x->acc[3] = a3;
+
+	return p;
+}
+
+static void xxh64_update(struct df_xxh64 *x, const uint8_t *p, size_t size)
+{
+	size_t fill;
+	const uint8_t *end = p + size;
+
+	x->total += size;
+	if (0 != x->buf_size) {
+		fill = 32 - x->buf_size < size ? 32 - x->buf_size : size;
+		memcpy(x->buf + x->buf_size, p, fill);
+		x->buf_size += fill;
+		p += fill;
+		if (32 != x->buf_size)
+			return;
+		xxh64_stripes(x, x->buf, x->buf + 32);
+		x->buf_size = 0;
+	}
+
+	p = xxh64_stripes(x, p, end);
+	x->buf_size = end - p;
+	memcpy(x->buf, p, x->buf_size);
+}
+
+static uint64_t xxh64_final(struct df_xxh64 *x)
+{
+	uint64_t h;
+	const uint8_t *p = x->buf;
+	const uint8_t *end = x->buf + x->buf_size;
+
+	if (32 <= x->total) {
+		h = rotl64(x->acc[0], 1) + rotl64(x->acc[1], 7) +
+				rotl64(x->acc[2], 12) + rotl64(x->acc[3], 18);
+		h = xxh64_merge(h, x->acc[0]);
+		h = xxh64_merge(h, x->acc[1]);
+		h = xxh64_merge(h, x->acc[2]);
+		h = xxh64_merge(h, x->acc[3]);
+	} else {
+		h = PRIME64_5;
+	}
+	h += x->total;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh64_round(0, read_le64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= read_le32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_init(struct df_sha256 *s)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memset(s, 0, sizeof(*s));
+	memcpy(s->state, iv, sizeof(iv));
+}
+
+static void sha256_block(uint32_t *state, const uint8_t *block)
+{
+	int i;
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t s0, s1, t1, t2;
+
+	for (i = 0; i < 16; i++) {
+		memcpy(w + i, block + 4 * i, sizeof(*w));
+		w[i] = be32toh(w[i]);
+	}
+	for (; i < 64; i++) {
+		s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^
+				(w[i - 15] >> 3);
+		s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^
+				(w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+	for (i = 0; i < 64; i++) {
+		s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+		t1 = h + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+		t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+static void sha256_update(struct df_sha256 *s, const uint8_t *p, size_t size)
+{
+	size_t fill;
+
+	s->total += size;
+	if (0 != s->buf_size) {
+		fill = 64 - s->buf_size < size ? 64 - s->buf_size : size;
+		memcpy(s->buf + s->buf_size, p, fill);
+		s->buf_size += fill;
+		p += fill;
+		size -= fill;
+		if (64 != s->buf_size)
+			return;
+		sha256_block(s->state, s->buf);
+		s->buf_size = 0;
+	}
+
+	for (; size >= 64; p += 64, size -= 64)
+		sha256_block(s->state, p);
+	memcpy(s->buf, p, size);
+	s->buf_size = size;
+}
+
+static void sha256_final(struct df_sha256 *s, uint8_t *digest)
+{
+	int i;
+	uint32_t word;
+	uint64_t bits = htobe64(s->total * 8);
+
+	s->buf[s->buf_size++] = 0x80;
+	if (s->buf_size > 56) {
+		memset(s->buf + s->buf_size, 0, 64 - s->buf_size);
+		sha256_block(s->state, s->buf);
+		s->buf_size = 0;
+	}
+	memset(s->buf + s->buf_size, 0, 56 - s->buf_size);
+	memcpy(s->buf + 56, &bits, sizeof(bits));
+	sha256_block(s->state, s->buf);
+
+	for (i = 0; i < 8; i++) {
+		word = htobe32(s->state[i]);
+		memcpy(digest + 4 * i, &word, sizeof(word));
+	}
+}
+
+void df_rollsum_init(struct df_rollsum *sum)
+{
+	memset(sum, 0, sizeof(*sum));
+}
+
+void df_rollsum_update(struct df_rollsum *sum, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	uint32_t a = sum->a;
+	uint32_t b = sum->b;
+
+	sum->len += size;
+	while (size--) {
+		a += *p++;
+		b += a;
+	}
+	sum->a = a;
+	sum->b = b;
+}
+
+size_t df_hash_digest_size(enum df_hash_algo algo)
+{
+	switch (algo) {
+	case DF_HASH_XXH64:
+		return 8;
+
+	case DF_HASH_SHA256:
+		return 32;
+
+	case DF_HASH_RSYNC:
+		return DF_HASH_RSYNC_SIZE;
+
+	default:
+		return 0;
+	}
+}
+
+int df_hash_init(struct df_hash *hash, enum df_hash_algo algo)
+{
+	hash->algo = algo;
+	switch (algo) {
+	case DF_HASH_XXH64:
+		xxh64_init(&hash->xxh64);
+		return 0;
+
+	case DF_HASH_SHA256:
+		sha256_init(&hash->sha256);
+		return 0;
+
+	case DF_HASH_RSYNC:
+		df_rollsum_init(&hash->rsync.weak);
+		xxh64_init(&hash->rsync.strong);
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+void df_hash_update(struct df_hash *hash, const void *data, size_t size)
+{
+	switch (hash->algo) {
+	case DF_HASH_XXH64:
+		xxh64_update(&hash->xxh64, data, size);
+		break;
+
+	case DF_HASH_SHA256:
+		sha256_update(&hash->sha256, data, size);
+		break;
+
+	case DF_HASH_RSYNC:
+		df_rollsum_update(&hash->rsync.weak, data, size);
+		xxh64_update(&hash->rsync.strong, data, size);
+		break;
+	}
+}
+
+void df_hash_final(struct df_hash *hash, uint8_t *digest)
+{
+	uint64_t h;
+	uint32_t weak;
+
+	switch (hash->algo) {
+	case DF_HASH_XXH64:
+		h = htobe64(xxh64_final(&hash->xxh64));
+		memcpy(digest, &h, sizeof(h));
+		break;
+
+	case DF_HASH_SHA256:
+		sha256_final(&hash->sha256, digest);
+		break;
+
+	case DF_HASH_RSYNC:
+		weak = htobe32(df_rollsum_digest(&hash->rsync.weak));
+		h = htobe64(xxh64_final(&hash->rsync.strong));
+		memcpy(digest, &weak, sizeof(weak));
+		memcpy(digest + sizeof(weak), &h, sizeof(h));
+		break;
+	}
+}
@@ -0,0 +1,99 @@
+#ifndef DF_HASH_H
+#define DF_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* hash algorithms, values are part of the protocol */
+enum df_hash_algo {
+	DF_HASH_XXH64,  /**< xxHash, 64 bits, seed 0, fast, non-cryptographic */
+	DF_HASH_SHA256, /**< SHA-256 */
+	/** rsync-like block signature : a rolling checksum, then xxHash64 */
+	DF_HASH_RSYNC,
+};
+
+/* size of the DF_HASH_RSYNC digests, the rolling checksum comes first */
+#define DF_HASH_RSYNC_SIZE 12
+
+/* size of the largest digest, that of SHA-256 */
+#define DF_HASH_MAX_DIGEST_SIZE 32
+
+/**
+ * @struct df_rollsum
+ * @brief weak checksum of a window of data, which can be slid one byte at a
+ * time, a being the sum of the bytes, b the sum of the bytes weighted by their
+ * distance to the end of the window
+ */
+struct df_rollsum {
+	uint32_t a;
+	uint32_t b;
+	uint32_t len;
+};
+
+void df_rollsum_init(struct df_rollsum *sum);
+
+void df_rollsum_update(struct df_rollsum *sum, const void *data, size_t size);
+
+/* slides the window of one byte, out leaving it and in entering it */
+static inline void df_rollsum_rotate(struct df_rollsum *sum, uint8_t out,
+		uint8_t in)
+{
+	sum->a += in - out;
+	sum->b += sum->a - sum->len * out;
+}
+
+static inline uint32_t df_rollsum_digest(const struct df_rollsum *sum)
+{
+	return (sum->a & 0xFFFF) | (sum->b << 16);
+}
+
+struct df_xxh64 {
+	uint64_t acc[4];
+	uint64_t total;
+	uint8_t buf[32];
+	size_t buf_size;
+};
+
+struct df_sha256 {
+	uint32_t state[8];
+	uint64_t total;
+	uint8_t buf[64];
+	size_t buf_size;
+};
+
+/**
+ * @struct df_hash
+ * @brief state of a hash computation
+ */
+struct df_hash {
+	enum df_hash_algo algo;
+	union {
+		struct df_xxh64 xxh64;
+		struct df_sha256 sha256;
+		struct {
+			struct df_rollsum weak;
+			struct df_xxh64 strong;
+		} rsync;
+	};
+};
+
+/* @return size of the digests of algo, 0 if it's unknown */
+size_t df_hash_digest_size(enum df_hash_algo algo);
+
+/**
+ * starts a hash computation
+ * @return 0 on success, -EINVAL if algo is unknown
+ */
+int df_hash_init(struct df_hash *hash, enum df_hash_algo algo);
+
+void df_hash_update(struct df_hash *hash, const void *data, size_t size);
+
+/**
+ * ends a hash computation
+ * @param digest Filled with df_hash_digest_size() bytes, in the canonical
+ * representation of the algorithm, i.e. big endian for xxHash and the
+ * rolling checksum
+ */
+void df_hash_final(struct df_hash *hash, uint8_t *digest);
+
+#endif /* DF_HASH_H */
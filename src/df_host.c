@@ -9,6 +9,7 @@
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #ifdef USE_UNIX_SOCKET
 #include <sys/un.h>
@@ -21,26 +22,79 @@ struct sockaddr_un __sizecheck;
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <limits.h>
+#include <time.h>
 
 #include <fdevent.h>
 #include <adb.h>
 #include <adb_client.h>
 #include <file_sync_service.h>
 
+/* defined to 31 by make FUSE=fuse3, for the libfuse 3 build */
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 26
+#endif
 
 #include <fuse.h>
 
 #include "adb_bridge.h"
 #include "df_protocol.h"
 #include "df_data_types.h"
+#include "df_ioctl.h"
+#include "df_hash.h"
+#include "df_delta.h"
+#include "df_tar.h"
+#include "df_dir_cache.h"
+#include "df_scan.h"
 
 #define DF_HOST_PORT 6666
 
+/* mount options */
+struct df_options {
+	/** colon separated absolute paths of directories to snapshot */
+	char *warm;
+	/** file where the snapshots are saved, between two mounts */
+	char *index;
+	/** non-zero to send the writes without waiting for their result */
+	int unstable;
+#if FUSE_USE_VERSION >= 30
+	/** non-zero to let the kernel cache the writes, flushing them later */
+	int writeback;
+	/** maximum size of the read and write requests, in pages */
+	unsigned max_pages;
+#endif
+};
+
+static struct df_options options;
+
+static const struct fuse_opt df_opts[] = {
+	{ "warm=%s", offsetof(struct df_options, warm), 0 },
+	{ "index=%s", offsetof(struct df_options, index), 0 },
+	{ "unstable", offsetof(struct df_options, unstable), 1 },
+#if FUSE_USE_VERSION >= 30
+	{ "writeback", offsetof(struct df_options, writeback), 1 },
+	{ "max_pages=%u", offsetof(struct df_options, max_pages), 0 },
+#endif
+	FUSE_OPT_END
+};
+
+#if FUSE_USE_VERSION >= 30
+/* default of max_pages, for requests of 1MiB with 4KiB pages */
+#define DF_MAX_PAGES 256
+#endif
+
 /**
  * @var sock
  * @brief socket opened on the device, via which file system request will pass
@@ -53,18 +107,214 @@ static int sock = -1;
 	(p) = NULL; \
 } while (0) \
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
 static void char_array_free(char **array)
 {
 	FREE(*array);
 }
 
+/* priority classes of the transactions on sock */
+enum sock_class {
+	SOCK_INTERACTIVE, /**< metadata, someone is waiting for */
+	SOCK_BULK, /**< data transfers */
+};
+
+/*
+ * consecutive transactions granted to the interactive class while bulk ones
+ * are waiting, for the latter not to starve
+ */
+#define SOCK_INTERACTIVE_BURST 16
+
+/**
+ * @var sock_sched
+ * @brief serializes the request / answer transactions on sock, fuse calls us
+ * from multiple threads, an interactive transaction waits for the one in
+ * progress only, not for the bulk ones queued
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int busy;
+	unsigned waiting[2];
+	unsigned burst;
+} sock_sched = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int sock_turn(enum sock_class class)
+{
+	if (sock_sched.busy)
+		return 0;
+	if (SOCK_BULK == class)
+		return 0 == sock_sched.waiting[SOCK_INTERACTIVE] ||
+				sock_sched.burst >= SOCK_INTERACTIVE_BURST;
+
+	return 0 == sock_sched.waiting[SOCK_BULK] ||
+			sock_sched.burst < SOCK_INTERACTIVE_BURST;
+}
+
+/*
+ * the pointer returned is only meant to be passed to sock_unlock, as the
+ * cleanup of a variable
+ */
+static pthread_mutex_t *sock_lock_class(enum sock_class class)
+{
+	pthread_mutex_lock(&sock_sched.mutex);
+	sock_sched.waiting[class]++;
+	while (!sock_turn(class))
+		pthread_cond_wait(&sock_sched.cond, &sock_sched.mutex);
+	sock_sched.waiting[class]--;
+	sock_sched.busy = 1;
+	sock_sched.burst = SOCK_BULK == class ? 0 : sock_sched.burst + 1;
+	pthread_mutex_unlock(&sock_sched.mutex);
+
+	return &sock_sched.mutex;
+}
+
+static pthread_mutex_t *sock_lock(void)
+{
+	return sock_lock_class(SOCK_INTERACTIVE);
+}
+
+static pthread_mutex_t *sock_lock_bulk(void)
+{
+	return sock_lock_class(SOCK_BULK);
+}
+
+/*
+ * takes the socket once no transaction is in progress nor waiting, those
+ * reading the notifications preceding their answer anyway, for the poller not
+ * to delay them nor to count as contention
+ */
+static pthread_mutex_t *sock_lock_idle(void)
+{
+	pthread_mutex_lock(&sock_sched.mutex);
+	while (sock_sched.busy || 0 != sock_sched.waiting[SOCK_INTERACTIVE] ||
+			0 != sock_sched.waiting[SOCK_BULK])
+		pthread_cond_wait(&sock_sched.cond, &sock_sched.mutex);
+	sock_sched.busy = 1;
+	pthread_mutex_unlock(&sock_sched.mutex);
+
+	return &sock_sched.mutex;
+}
+
+static void sock_unlock(pthread_mutex_t **mutex)
+{
+	if (NULL == *mutex)
+		return;
+
+	pthread_mutex_lock(*mutex);
+	sock_sched.busy = 0;
+	pthread_cond_broadcast(&sock_sched.cond);
+	pthread_mutex_unlock(*mutex);
+}
+
+/* @return non-zero if interactive transactions are waiting for the socket */
+static int sock_contended(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&sock_sched.mutex);
+	ret = 0 != sock_sched.waiting[SOCK_INTERACTIVE];
+	pthread_mutex_unlock(&sock_sched.mutex);
+
+	return ret;
+}
+
+/*
+ * non-zero in the threads we start, which don't serve fuse requests, their
+ * fuse context having no request, which fuse_interrupted dereferences
+ */
+static __thread int background;
+
+/* @return non-zero if the fuse request the calling thread serves is aborted */
+static int request_interrupted(void)
+{
+	return !background && fuse_interrupted();
+}
+
+/* size requested for the pipes used to splice read data to fuse */
+#define DF_PIPE_SIZE (1 << 20)
+
+/**
+ * @var pipe_key
+ * @brief per-thread pipe, used to splice the data read from the device up to
+ * /dev/fuse, without copying it in user space
+ */
+static pthread_key_t pipe_key;
+
+struct df_pipe {
+	int fds[2];
+	size_t capacity;
+};
+
+static void df_pipe_destroy(void *data)
+{
+	struct df_pipe *p = data;
+
+	close(p->fds[0]);
+	close(p->fds[1]);
+	free(p);
+}
+
+/* returns the calling thread's pipe, empty, or NULL if none is available */
+static struct df_pipe *df_pipe_get(void)
+{
+	int ret;
+	int pending = 0;
+	struct df_pipe *p;
+
+	p = pthread_getspecific(pipe_key);
+	if (NULL != p) {
+		/* fuse didn't consume the last read, don't serve stale data */
+		ret = ioctl(p->fds[0], FIONREAD, &pending);
+		if (0 == ret && 0 == pending)
+			return p;
+		df_pipe_destroy(p);
+		pthread_setspecific(pipe_key, NULL);
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (NULL == p)
+		return NULL;
+	ret = pipe2(p->fds, O_CLOEXEC);
+	if (-1 == ret) {
+		free(p);
+		return NULL;
+	}
+	fcntl(p->fds[1], F_SETPIPE_SZ, DF_PIPE_SIZE);
+	ret = fcntl(p->fds[1], F_GETPIPE_SZ);
+	p->capacity = 0 > ret ? 0 : ret;
+	pthread_setspecific(pipe_key, p);
+
+	return p;
+}
+
 static int df_access(const char *in_path, int in_mask)
 {
 	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
 	enum df_op op_code = DF_OP_ACCESS;
 
+	switch (df_dir_cache_lookup(in_path)) {
+	case DF_DIR_CACHE_ABSENT:
+		return -ENOENT;
+
+	case DF_DIR_CACHE_PRESENT:
+		if (F_OK == in_mask)
+			return 0;
+		break;
+
+	default:
+		break;
+	}
+
+	lock = sock_lock();
 	ret = df_remote_call(sock, op_code,
-			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
+			DF_DATA_PATH, in_path,
 			DF_DATA_INT, (int64_t)in_mask,
 			DF_DATA_END);
 	if (0 > ret)
@@ -74,231 +324,2610 @@ static int df_access(const char *in_path, int in_mask)
 			DF_DATA_END);
 }
 
-static int df_getattr(const char *in_path, struct stat *out_stbuf)
+/*
+ * getattr prefetching : tools like ls -l stat all the entries of a directory
+ * one after the other, once threshold getattrs of the same directory missed
+ * the cache in a row, within PREFETCH_WINDOW_MS, the attributes of all it's
+ * entries are fetched at once, see prefetch_dir, the following getattrs being
+ * served by the directory cache. The threshold is
+ * raised when the entries prefetched are mostly left unused, and lowered when
+ * they are, for random accesses not to pay for the snapshots
+ */
+#define PREFETCH_THRESHOLD_MIN 2
+#define PREFETCH_THRESHOLD_MAX 256
+#define PREFETCH_WINDOW_MS 1000
+
+static struct {
+	pthread_mutex_t mutex;
+	/** directory of the last misses, their number, and the first's date */
+	char dir[PATH_MAX];
+	unsigned misses;
+	struct timespec first;
+	unsigned threshold;
+	/**
+	 * last directory prefetched, it's number of entries, negative if it
+	 * failed, and the number of hits since
+	 */
+	char prefetched[PATH_MAX];
+	int entries;
+	int hits;
+} prefetch = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.threshold = 4,
+};
+
+/* @return the length of path's parent directory, "/" for the root's entries */
+static size_t parent_len(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	return NULL == slash || slash == path ? 1 : (size_t)(slash - path);
+}
+
+/* counts a getattr served by the cache, for the threshold's adaptation */
+static void prefetch_hit(const char *path)
+{
+	size_t len = parent_len(path);
+
+	pthread_mutex_lock(&prefetch.mutex);
+	if (0 == strncmp(prefetch.prefetched, path, len) &&
+			'\0' == prefetch.prefetched[len])
+		prefetch.hits++;
+	pthread_mutex_unlock(&prefetch.mutex);
+}
+
+/*
+ * counts a getattr which missed the cache
+ * @param dir On output, if it's time to prefetch, the directory to prefetch
+ * @return non-zero if dir has to be prefetched
+ */
+static int prefetch_miss(const char *path, char dir[PATH_MAX])
+{
+	int ret = 0;
+	struct timespec now;
+	size_t len = parent_len(path);
+	long elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&prefetch.mutex);
+	elapsed = (now.tv_sec - prefetch.first.tv_sec) * 1000 +
+			(now.tv_nsec - prefetch.first.tv_nsec) / 1000000;
+	if (0 != strncmp(prefetch.dir, path, len) ||
+			'\0' != prefetch.dir[len] ||
+			elapsed > PREFETCH_WINDOW_MS) {
+		snprintf(prefetch.dir, sizeof(prefetch.dir), "%.*s", (int)len,
+				path);
+		prefetch.misses = 0;
+		prefetch.first = now;
+	}
+	if (++prefetch.misses < prefetch.threshold)
+		goto out;
+
+	/* the previous prefetch is judged by the use of it's entries */
+	if (0 > prefetch.entries || 4 * prefetch.hits < prefetch.entries)
+		prefetch.threshold = MIN(2 * prefetch.threshold,
+				PREFETCH_THRESHOLD_MAX);
+	else if (0 < prefetch.entries &&
+			2 * prefetch.hits >= prefetch.entries &&
+			prefetch.threshold > PREFETCH_THRESHOLD_MIN)
+		prefetch.threshold /= 2;
+	strcpy(prefetch.prefetched, prefetch.dir);
+	strcpy(dir, prefetch.dir);
+	prefetch.entries = 0;
+	prefetch.hits = 0;
+	prefetch.misses = 0;
+	ret = 1;
+out:
+	pthread_mutex_unlock(&prefetch.mutex);
+
+	return ret;
+}
+
+/* @param entries Result of the directory's snapshot */
+static void prefetch_done(const char *dir, int entries)
+{
+	pthread_mutex_lock(&prefetch.mutex);
+	if (0 == strcmp(prefetch.prefetched, dir))
+		prefetch.entries = entries;
+	pthread_mutex_unlock(&prefetch.mutex);
+}
+
+/*
+ * gets the attributes of entries of dir in one round trip, they are stored in
+ * the directory cache, if dir's listing is there
+ * @param names Names of the entries, each followed by a '\0', at most
+ * DF_GETATTR_MANY_MAX of them
+ * @return number of entries whose attributes were received, errno-compatible
+ * negative value on error
+ */
+static int getattr_many(const char *dir, const char *names, size_t size)
+{
+	int ret;
+	int count = 0;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_GETATTR_MANY;
+	char __attribute__((cleanup(char_array_free))) *payload = NULL;
+	struct df_packet_header header;
+	size_t offset = 0;
+	const char *name;
+	char path[PATH_MAX];
+	int64_t err;
+	struct stat st;
+
+	lock = sock_lock();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, dir,
+			DF_DATA_BUFFER, size, names,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	ret = df_read_message(sock, &header, &payload);
+	if (0 > ret)
+		return ret;
+	if (0 != header.error)
+		return -header.error;
+
+	/* applied before the socket is released, see snapshot_read */
+	for (name = names; name < names + size; name += strlen(name) + 1) {
+		ret = df_parse_payload(payload, &offset, header.payload_size,
+				DF_DATA_INT, &err,
+				DF_DATA_STAT, &st,
+				DF_DATA_BLOCK_END);
+		if (0 > ret)
+			return ret;
+		if (0 != err || sizeof(path) <= (size_t)snprintf(path,
+					sizeof(path), "%s/%s",
+					0 == strcmp(dir, "/") ? "" : dir,
+					name))
+			continue;
+		df_dir_cache_put_attr(path, &st);
+		count++;
+	}
+	ret = df_parse_payload(payload, &offset, header.payload_size,
+			DF_DATA_END);
+
+	return 0 > ret ? ret : count;
+}
+
+static int snapshot(const char *root, int flags);
+
+/*
+ * fetches the attributes of the entries of dir, only of those missing if it's
+ * listing is cached, or with a snapshot of the directory if it isn't
+ * @return number of entries whose attributes were received, errno-compatible
+ * negative value on error
+ */
+static int prefetch_dir(const char *dir)
+{
+	int ret;
+	int count = 0;
+	int n;
+	size_t size;
+	size_t start;
+	size_t end;
+	char __attribute__((cleanup(char_array_free))) *names = NULL;
+
+	ret = df_dir_cache_unknown_attrs(dir, &names, &size);
+	if (-ENODATA == ret)
+		return snapshot(dir, DF_SCAN_SHALLOW);
+
+	for (start = 0; 0 <= ret && start < size; start = end) {
+		for (end = start, n = 0; end < size && n < DF_GETATTR_MANY_MAX;
+				n++)
+			end += strlen(names + end) + 1;
+		ret = getattr_many(dir, names + start, end - start);
+		if (0 < ret)
+			count += ret;
+	}
+
+	return 0 > ret ? ret : count;
+}
+
+static int df_getattr(const char *in_path, struct stat *out_stbuf)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_GETATTR;
+	char dir[PATH_MAX];
+
+	/*
+	 * lookups of missing entries in huge directories are the costly ones,
+	 * then the attributes received in a snapshot spare a round trip too
+	 */
+	ret = df_dir_cache_get_attr(in_path, out_stbuf);
+	if (-ENODATA != ret) {
+		prefetch_hit(in_path);
+		return ret;
+	}
+	if (prefetch_miss(in_path, dir)) {
+		prefetch_done(dir, prefetch_dir(dir));
+		ret = df_dir_cache_get_attr(in_path, out_stbuf);
+		if (-ENODATA != ret)
+			return ret;
+	}
+
+	lock = sock_lock();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_STAT, out_stbuf,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	df_dir_cache_set_attr(in_path, out_stbuf);
+
+	return 0;
+}
+
+#if FUSE_USE_VERSION >= 30
+static int df_getattr_fi(const char *in_path, struct stat *out_stbuf,
+		struct fuse_file_info __attribute__((unused)) *in_fi)
+{
+	return df_getattr(in_path, out_stbuf);
+}
+#endif
+
+static int df_mknod(const char *in_path, mode_t in_mode, dev_t in_rdev)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_MKNOD;
+
+	lock = sock_lock();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_INT, (int64_t)in_mode,
+			DF_DATA_INT, (int64_t)in_rdev,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_END);
+	df_dir_cache_invalidate(in_path, DF_NOTIFY_CREATE);
+
+	return ret;
+}
+
+/**
+ * @struct df_file
+ * @brief host side file handle, stored in the fuse_file_info's fh, keeps the
+ * content of the small files the device returned with the open, for the reads
+ * to be served without a round trip, until the file is modified
+ */
+struct df_file {
+	/** handle of the file on the device */
+	uint64_t fh;
+	/** content of the file, NULL if it isn't inlined, see inlined */
+	char *data;
+	size_t size;
+	/** path the file was opened with, and next inlined file */
+	char *path;
+	struct df_file *next;
+	/** bytes written unstable since the last commit */
+	size_t unstable;
+	/** first error reported by an intermediate commit, 0 if none */
+	int error;
+};
+
+/*
+ * flow control of the unstable writes : the bytes and the messages sent since
+ * the last answer are limited by a window, within the limits the device
+ * advertised at connection time. It's FLOW_GAIN times the bandwidth-delay
+ * product measured at each commit, the link staying busy while a commit waits
+ * for the device to catch up. Protected by the socket's lock
+ */
+#define FLOW_WINDOW_MIN (1024 * 1024)
+#define FLOW_GAIN 4
+
+static struct {
+	/** limits advertised by the device */
+	uint64_t max_bytes;
+	uint64_t max_msgs;
+	/** current window, in bytes */
+	uint64_t window;
+	/** sent since the last answer, and the date of the first */
+	uint64_t bytes;
+	uint64_t msgs;
+	struct timespec first;
+	/** smallest round trip time seen, in us, and bandwidth, in B/s */
+	uint64_t rtt;
+	uint64_t bandwidth;
+} flow = {
+	.max_bytes = FLOW_WINDOW_MIN,
+	.max_msgs = 1,
+	.window = FLOW_WINDOW_MIN,
+};
+
+static uint64_t elapsed_us(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec) * 1000000 +
+			(now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/* @return non-zero if a message of size bytes fits in the window */
+static int flow_room(size_t size)
+{
+	return 0 == flow.msgs || (flow.bytes + size <= flow.window &&
+			flow.msgs < flow.max_msgs);
+}
+
+static void flow_sent(size_t size)
+{
+	if (0 == flow.msgs)
+		clock_gettime(CLOCK_MONOTONIC, &flow.first);
+	flow.bytes += size;
+	flow.msgs++;
+}
+
+/*
+ * the device answered, so it has consumed all that was sent before
+ * @param rtt Round trip time of the request answered, in us
+ */
+static void flow_acked(uint64_t rtt)
+{
+	uint64_t elapsed;
+	uint64_t sample;
+
+	if (0 != rtt && (0 == flow.rtt || rtt < flow.rtt))
+		flow.rtt = rtt;
+	if (0 == flow.msgs)
+		return;
+
+	elapsed = elapsed_us(&flow.first);
+	if (0 != elapsed) {
+		sample = flow.bytes * 1000000 / elapsed;
+		flow.bandwidth = 0 == flow.bandwidth ? sample :
+				(3 * flow.bandwidth + sample) / 4;
+	}
+	flow.window = FLOW_GAIN * flow.bandwidth * flow.rtt / 1000000;
+	flow.window = MIN(MAX(flow.window, FLOW_WINDOW_MIN), flow.max_bytes);
+	flow.bytes = 0;
+	flow.msgs = 0;
+}
+
+/*
+ * exchanges the limits of the window with the device, the round trip giving a
+ * first estimation of the link's latency
+ * @return 0 on success, errno-compatible negative value on error
+ */
+static int flow_negotiate(void)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_WINDOW;
+	struct timespec start;
+	int64_t out_bytes;
+	int64_t out_msgs;
+
+	lock = sock_lock();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_INT, (int64_t)DF_WINDOW_BYTES_MAX,
+			DF_DATA_INT, (int64_t)DF_WINDOW_MSGS_MAX,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_INT, &out_bytes,
+			DF_DATA_INT, &out_msgs,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	if (0 >= out_bytes || 0 >= out_msgs)
+		return -EPROTO;
+
+	/* a device short of memory can ask for less than FLOW_WINDOW_MIN */
+	flow.max_bytes = out_bytes;
+	flow.max_msgs = out_msgs;
+	flow.window = MIN(flow.window, flow.max_bytes);
+	flow_acked(elapsed_us(&start));
+
+	return 0;
+}
+
+/*
+ * sends a DF_OP_COMMIT for the writes sent unstable on file, with the socket
+ * locked
+ * @param flags Combination of enum df_commit_flags
+ * @return 0 on success, the first error of the writes since the last commit
+ * otherwise, errno-compatible negative value
+ */
+static int commit(const char *path, struct df_file *file,
+		struct fuse_file_info *fi, int64_t flags)
+{
+	int ret;
+	enum df_op op_code = DF_OP_COMMIT;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, path,
+			DF_DATA_FUSE_FILE_INFO, fi,
+			DF_DATA_INT, flags,
+			DF_DATA_END);
+	if (0 <= ret)
+		ret = df_remote_answer(sock, op_code,
+				DF_DATA_END);
+	flow_acked(elapsed_us(&start));
+	file->unstable = 0;
+	if (0 != file->error) {
+		ret = file->error;
+		file->error = 0;
+	}
+
+	return ret;
+}
+
+/*
+ * makes room in the window for an unstable write of size bytes, committing
+ * those sent so far if needed, their errors being reported later
+ */
+static void unstable_reserve(const char *path, struct df_file *file,
+		struct fuse_file_info *fi, size_t size)
+{
+	int ret;
+
+	if (flow_room(size))
+		return;
+
+	ret = commit(path, file, fi, 0);
+	if (0 > ret)
+		file->error = ret;
+}
+
+static void unstable_sent(struct df_file *file, size_t size)
+{
+	file->unstable += size;
+	flow_sent(size);
+}
+
+/* @return the number of bytes of a read which can be served, at offset */
+static size_t file_inline_size(const struct df_file *file, size_t size,
+		off_t offset)
+{
+	if ((uint64_t)offset >= file->size)
+		return 0;
+
+	return size < file->size - offset ? size : file->size - offset;
+}
+
+/*
+ * files whose content is inlined, which is dropped when they are modified,
+ * through any handle or on the device, the reads going to the device then
+ */
+static struct {
+	pthread_mutex_t mutex;
+	struct df_file *head;
+} inlined = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void inline_attach(struct df_file *file, const char *path)
+{
+	file->path = strdup(path);
+	if (NULL == file->path) {
+		FREE(file->data);
+		return;
+	}
+	pthread_mutex_lock(&inlined.mutex);
+	file->next = inlined.head;
+	inlined.head = file;
+	pthread_mutex_unlock(&inlined.mutex);
+}
+
+static void inline_detach(struct df_file *file)
+{
+	struct df_file **f;
+
+	pthread_mutex_lock(&inlined.mutex);
+	for (f = &inlined.head; NULL != *f; f = &(*f)->next)
+		if (*f == file) {
+			*f = file->next;
+			break;
+		}
+	pthread_mutex_unlock(&inlined.mutex);
+	FREE(file->data);
+	FREE(file->path);
+}
+
+/*
+ * drops the content of the files opened with path, or with a path under it
+ * if subtree is non-zero
+ */
+static void inline_drop(const char *path, int subtree)
+{
+	size_t len = strlen(path);
+	struct df_file *file;
+	struct df_file **f = &inlined.head;
+
+	pthread_mutex_lock(&inlined.mutex);
+	while (NULL != *f) {
+		file = *f;
+		if (0 == strcmp(file->path, path) || (subtree &&
+				0 == strncmp(file->path, path, len) &&
+				('/' == file->path[len] || 1 == len))) {
+			*f = file->next;
+			FREE(file->data);
+			FREE(file->path);
+		} else {
+			f = &file->next;
+		}
+	}
+	pthread_mutex_unlock(&inlined.mutex);
+}
+
+/*
+ * serves a read from the content of file, if it's inlined
+ * @return number of bytes copied to buf, -ENODATA if it isn't inlined
+ */
+static int64_t inline_read(struct df_file *file, char *buf, size_t size,
+		off_t offset)
+{
+	int64_t res = -ENODATA;
+
+	pthread_mutex_lock(&inlined.mutex);
+	if (NULL != file->data) {
+		res = file_inline_size(file, size, offset);
+		if (0 < res)
+			memcpy(buf, file->data + offset, res);
+	}
+	pthread_mutex_unlock(&inlined.mutex);
+
+	return res;
+}
+
+/* @param device_fi On output, a copy of fi with the device's handle, to send */
+static struct df_file *file_from_fi(const struct fuse_file_info *fi,
+		struct fuse_file_info *device_fi)
+{
+	struct df_file *file = (struct df_file *)(uintptr_t)fi->fh;
+
+	*device_fi = *fi;
+	device_fi->fh = file->fh;
+
+	return file;
+}
+
+/*
+ * the content of a small file is sent with the answer to the open, a read-only
+ * handle of it then never talks to the device again but for it's release,
+ * unless the file is modified
+ */
+static int df_open(const char *in_path, struct fuse_file_info *in_fi)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_OPEN;
+	struct df_file *file;
+
+	int64_t out_inlined;
+	int64_t out_size;
+	char __attribute__((cleanup(char_array_free))) *out_data = NULL;
+
+	file = calloc(1, sizeof(*file));
+	if (NULL == file)
+		return -errno;
+
+#if FUSE_USE_VERSION >= 30
+	/*
+	 * with the writeback cache, the kernel reads the pages it writes
+	 * partially, and handles O_APPEND itself
+	 */
+	if (options.writeback) {
+		if (O_WRONLY == (in_fi->flags & O_ACCMODE))
+			in_fi->flags = (in_fi->flags & ~O_ACCMODE) | O_RDWR;
+		in_fi->flags &= ~O_APPEND;
+	}
+#endif
+
+	lock = sock_lock();
+	if (in_fi->flags & O_TRUNC) {
+		df_dir_cache_invalidate(in_path, DF_NOTIFY_CHANGE);
+		inline_drop(in_path, 0);
+	}
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_FUSE_FILE_INFO, in_fi,
+			DF_DATA_INT, (int64_t)DF_INLINE_SIZE,
+			DF_DATA_END);
+	if (0 <= ret)
+		ret = df_remote_answer(sock, op_code,
+				DF_DATA_FUSE_FILE_INFO, in_fi,
+				DF_DATA_INT, &out_inlined,
+				DF_DATA_BUFFER, &out_size, &out_data,
+				DF_DATA_END);
+	if (0 > ret) {
+		free(file);
+		return ret;
+	}
+
+	file->fh = in_fi->fh;
+	if (out_inlined) {
+		file->data = out_data;
+		file->size = out_size;
+		out_data = NULL;
+		inline_attach(file, in_path);
+	}
+	in_fi->fh = (uintptr_t)file;
+
+	return 0;
+}
+
+/* reads and discards the payload of a message whose header has been read */
+static int skip_payload(struct df_packet_header *header)
+{
+	char __attribute__((cleanup(char_array_free))) *payload = NULL;
+
+	payload = malloc(header->payload_size);
+	if (NULL == payload)
+		return -errno;
+
+	return df_read_data(sock, payload, header->payload_size);
+}
+
+/*
+ * size of the slices a read is split in, when interactive transactions are
+ * waiting, for them not to wait for a whole large read
+ */
+#define DF_READ_SLICE (64 * 1024)
+
+/*
+ * reads a slice of a file in one transaction, the data being spliced to p if
+ * it isn't NULL, read to mem otherwise
+ * @return number of bytes read, errno-compatible negative value on error
+ */
+static int read_slice(const char *path, struct fuse_file_info *fi,
+		size_t size, off_t offset, struct df_pipe *p, char *mem)
+{
+	int ret;
+	enum df_op op_code = DF_OP_READ;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+
+	struct df_packet_header header;
+	char prefix[DF_BUFFER_PREFIX_SIZE];
+	char suffix[sizeof(int64_t)];
+	size_t prefix_offset = 0;
+	size_t suffix_offset = 0;
+	int64_t res;
+
+	lock = sock_lock_bulk();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, path,
+			DF_DATA_INT, (int64_t)size,
+			DF_DATA_INT, (int64_t)offset,
+			DF_DATA_FUSE_FILE_INFO, fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	ret = df_read_header(sock, &header);
+	if (0 > ret)
+		return ret;
+	if (0 != header.error) {
+		ret = skip_payload(&header);
+		return 0 > ret ? ret : -header.error;
+	}
+
+	/* answer is : buffer prefix, buffer content, DF_DATA_END */
+	if (header.payload_size < sizeof(prefix) + sizeof(suffix))
+		return -EPROTO;
+	ret = df_read_data(sock, prefix, sizeof(prefix));
+	if (0 > ret)
+		return ret;
+	ret = df_parse_buffer_prefix(prefix, &prefix_offset, sizeof(prefix),
+			&res);
+	if (0 > ret)
+		return ret;
+	if ((size_t)res > size || header.payload_size !=
+			sizeof(prefix) + res + sizeof(suffix))
+		return -EPROTO;
+
+	if (NULL != p)
+		ret = df_splice_data(sock, p->fds[1], res);
+	else
+		ret = df_read_data(sock, mem, res);
+	if (0 > ret)
+		return ret;
+	ret = df_read_data(sock, suffix, sizeof(suffix));
+	if (0 > ret)
+		return ret;
+	ret = df_parse_payload(suffix, &suffix_offset, sizeof(suffix),
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return res;
+}
+
+/*
+ * reads size bytes at offset, in slices if interactive transactions are
+ * waiting, only the end of the file stopping it short
+ * @return number of bytes read, errno-compatible negative value on error
+ */
+static int read_sliced(const char *path, struct fuse_file_info *fi,
+		size_t size, off_t offset, struct df_pipe *p, char *mem)
+{
+	int ret;
+	size_t done;
+	size_t slice;
+
+	for (done = 0; done < size; done += ret) {
+		if (request_interrupted())
+			return -EINTR;
+		slice = size - done;
+		if (slice > DF_READ_SLICE && sock_contended())
+			slice = DF_READ_SLICE;
+		ret = read_slice(path, fi, slice, offset + done, p,
+				NULL == p ? mem + done : NULL);
+		if (0 > ret)
+			return ret;
+		if ((size_t)ret < slice)
+			return done + ret;
+	}
+
+	return done;
+}
+
+static int df_read(const char *in_path, char *out_buf, size_t in_size,
+		off_t in_offset, struct fuse_file_info *in_fi)
+{
+	int64_t res;
+	struct fuse_file_info fi;
+	struct df_file *file = file_from_fi(in_fi, &fi);
+
+	res = inline_read(file, out_buf, in_size, in_offset);
+	if (-ENODATA != res)
+		return res;
+
+	return read_sliced(in_path, &fi, in_size, in_offset, NULL, out_buf);
+}
+
+/*
+ * the answer's data is spliced from the socket to a per-thread pipe, then fuse
+ * splices it from the pipe to /dev/fuse, when splicing isn't possible, it's
+ * read into a buffer handed to fuse, with only one copy
+ */
+static int df_read_buf(const char *in_path, struct fuse_bufvec **out_bufp,
+		size_t in_size, off_t in_offset, struct fuse_file_info *in_fi)
+{
+	int ret;
+	int64_t res;
+	struct df_pipe *p;
+	struct fuse_bufvec *bufv;
+	struct fuse_file_info fi;
+	struct df_file *file = file_from_fi(in_fi, &fi);
+
+	/* only a hint, inline_read checks it again under the lock */
+	if (NULL != file->path) {
+		bufv = malloc(sizeof(*bufv));
+		if (NULL == bufv)
+			return -errno;
+		*bufv = FUSE_BUFVEC_INIT(in_size);
+		bufv->buf[0].mem = malloc(in_size ? in_size : 1);
+		if (NULL == bufv->buf[0].mem) {
+			free(bufv);
+			return -ENOMEM;
+		}
+		res = inline_read(file, bufv->buf[0].mem, in_size, in_offset);
+		if (-ENODATA != res) {
+			bufv->buf[0].size = res;
+			*out_bufp = bufv;
+			return 0;
+		}
+		free(bufv->buf[0].mem);
+		free(bufv);
+	}
+
+	bufv = malloc(sizeof(*bufv));
+	if (NULL == bufv)
+		return -errno;
+	*bufv = FUSE_BUFVEC_INIT(in_size);
+
+	p = df_pipe_get();
+	if (NULL != p && in_size <= p->capacity) {
+		bufv->buf[0].flags = FUSE_BUF_IS_FD;
+		bufv->buf[0].fd = p->fds[0];
+	} else {
+		p = NULL;
+		bufv->buf[0].mem = malloc(in_size ? in_size : 1);
+		if (NULL == bufv->buf[0].mem) {
+			free(bufv);
+			return -ENOMEM;
+		}
+	}
+	ret = read_sliced(in_path, &fi, in_size, in_offset, p,
+			bufv->buf[0].mem);
+	if (0 > ret) {
+		free(bufv->buf[0].mem);
+		free(bufv);
+		return ret;
+	}
+	bufv->buf[0].size = ret;
+	*out_bufp = bufv;
+
+	return 0;
+}
+
+/**
+ * @struct df_dir
+ * @brief host side directory handle, stored in the fuse_file_info's fh, keeps
+ * the last chunk of entries received, for the following readdir calls to be
+ * served from it, fuse passing us buffers much smaller than a chunk
+ */
+struct df_dir {
+	/** handle of the directory on the device */
+	uint64_t fh;
+	/** entries of the last chunk received */
+	struct df_dirent *entries;
+	size_t count;
+	/** offset the chunk was requested at */
+	int64_t start;
+	/** index of the entry to serve next, if the offset matches */
+	size_t next;
+	/** non-zero if the chunk is the last one of the directory */
+	int eof;
+};
+
+static struct df_dir *dir_from_fi(struct fuse_file_info *fi)
+{
+	return (struct df_dir *)(uintptr_t)fi->fh;
+}
+
+static void dir_clear_entries(struct df_dir *dir)
+{
+	while (dir->count--)
+		free(dir->entries[dir->count].name);
+	FREE(dir->entries);
+	dir->count = 0;
+	dir->next = 0;
+}
+
+/* returns the index of the entry following offset, or -1 if not cached */
+static ssize_t dir_find_offset(struct df_dir *dir, int64_t offset)
+{
+	size_t i;
+
+	if (NULL == dir->entries)
+		return -1;
+	if (offset == dir->start)
+		return 0;
+	if (dir->next > 0 && dir->next <= dir->count &&
+			dir->entries[dir->next - 1].off == offset)
+		return dir->next;
+	for (i = 0; i < dir->count; i++)
+		if (dir->entries[i].off == offset)
+			return i + 1;
+
+	return -1;
+}
+
+/* replaces the cached entries by the chunk starting at offset */
+static int readdir_chunk(const char *in_path, struct df_dir *dir,
+		int64_t offset)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	char __attribute__((cleanup(char_array_free))) *payload = NULL;
+	struct df_packet_header header;
+	size_t payload_offset = 0;
+	struct fuse_file_info fi;
+	struct df_dirent *entry;
+	size_t capacity = 0;
+	int64_t len;
+	int64_t eof;
+
+	dir_clear_entries(dir);
+	dir->start = offset;
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = dir->fh;
+
+	lock = sock_lock();
+	ret = df_remote_call(sock, DF_OP_READDIR,
+			DF_DATA_PATH, in_path,
+			DF_DATA_INT, offset,
+			DF_DATA_FUSE_FILE_INFO, &fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	ret = df_read_message(sock, &header, &payload);
+	if (0 > ret)
+		return ret;
+	if (0 != header.error)
+		return -header.error;
+	sock_unlock(&lock);
+	lock = NULL;
+
+	ret = df_parse_payload(payload, &payload_offset, header.payload_size,
+			DF_DATA_FUSE_FILE_INFO, &fi,
+			DF_DATA_BLOCK_END);
+	if (0 > ret)
+		return ret;
+
+	while (payload_offset + DF_READDIR_TRAILER_SIZE < header.payload_size) {
+		if (dir->count == capacity) {
+			capacity = capacity ? 2 * capacity : 256;
+			entry = realloc(dir->entries,
+					capacity * sizeof(*dir->entries));
+			if (NULL == entry)
+				return -errno;
+			dir->entries = entry;
+		}
+		entry = dir->entries + dir->count;
+		entry->name = NULL;
+		ret = df_parse_payload(payload, &payload_offset,
+				header.payload_size,
+
+				DF_DATA_BUFFER, &len, &entry->name,
+				DF_DATA_INT, &entry->ino,
+				DF_DATA_INT, &entry->type,
+				DF_DATA_INT, &entry->off,
+				DF_DATA_BLOCK_END);
+		if (0 > ret) {
+			free(entry->name);
+			return ret;
+		}
+		entry->name[len - 1] = '\0';
+		dir->count++;
+	}
+
+	ret = df_parse_payload(payload, &payload_offset, header.payload_size,
+			DF_DATA_INT, &eof,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	dir->eof = eof;
+	df_dir_cache_fill(in_path, offset, dir->entries, dir->count, eof);
+
+	return 0;
+}
+
+static int df_opendir(const char *in_path, struct fuse_file_info *in_fi)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_OPENDIR;
+	struct df_dir *dir;
+
+	dir = calloc(1, sizeof(*dir));
+	if (NULL == dir)
+		return -errno;
+
+	lock = sock_lock();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_FUSE_FILE_INFO, in_fi,
+			DF_DATA_END);
+	if (0 <= ret)
+		ret = df_remote_answer(sock, op_code,
+				DF_DATA_FUSE_FILE_INFO, in_fi,
+				DF_DATA_END);
+	if (0 > ret) {
+		free(dir);
+		return ret;
+	}
+
+	dir->fh = in_fi->fh;
+	in_fi->fh = (uintptr_t)dir;
+
+	return 0;
+}
+
+#if FUSE_USE_VERSION >= 30
+/*
+ * fills st with the cached attributes of the entry name of dir, for a
+ * readdirplus, the lookup libfuse does then for the entry not costing a round
+ * trip
+ * @return non-zero if they are cached
+ */
+static int entry_attr(const char *dir, const char *name, struct stat *st)
+{
+	char path[PATH_MAX];
+
+	if (0 == strcmp(name, ".") || 0 == strcmp(name, ".."))
+		return 0;
+	if (sizeof(path) <= (size_t)snprintf(path, sizeof(path), "%s/%s",
+				0 == strcmp(dir, "/") ? "" : dir, name))
+		return 0;
+
+	return 0 == df_dir_cache_get_attr(path, st);
+}
+#endif
+
+/*
+ * entries are passed to filler with their offset, so that fuse calls us back
+ * with the offset of the last entry it could store when it's buffer is full
+ */
+#if FUSE_USE_VERSION >= 30
+static int df_readdir(const char *in_path, void *in_buf, fuse_fill_dir_t filler,
+		       off_t in_offset, struct fuse_file_info *in_fi,
+		       enum fuse_readdir_flags in_flags)
+#else
+static int df_readdir(const char *in_path, void *in_buf, fuse_fill_dir_t filler,
+		       off_t in_offset, struct fuse_file_info *in_fi)
+#endif
+{
+	int ret;
+	struct df_dir *dir = dir_from_fi(in_fi);
+	struct df_dirent *entry;
+	ssize_t i;
+	struct stat st;
+#if FUSE_USE_VERSION >= 30
+	enum fuse_fill_dir_flags fill_flags;
+#endif
+
+	i = dir_find_offset(dir, in_offset);
+	if (-1 == i) {
+		ret = readdir_chunk(in_path, dir, in_offset);
+		if (0 > ret)
+			return ret;
+		i = 0;
+	}
+
+	memset(&st, 0, sizeof(st));
+	for (;;) {
+		if ((size_t)i == dir->count) {
+			if (dir->eof || 0 == dir->count)
+				break;
+			ret = readdir_chunk(in_path, dir,
+					dir->entries[dir->count - 1].off);
+			if (0 > ret)
+				return ret;
+			i = 0;
+			continue;
+		}
+		entry = dir->entries + i;
+#if FUSE_USE_VERSION >= 30
+		/* only the entries whose attributes are known are "plus" */
+		fill_flags = 0;
+		if ((in_flags & FUSE_READDIR_PLUS) &&
+				entry_attr(in_path, entry->name, &st)) {
+			fill_flags = FUSE_FILL_DIR_PLUS;
+		} else {
+			memset(&st, 0, sizeof(st));
+			st.st_ino = entry->ino;
+			st.st_mode = DTTOIF(entry->type);
+		}
+		if (filler(in_buf, entry->name, &st, entry->off, fill_flags))
+			break;
+#else
+		st.st_ino = entry->ino;
+		st.st_mode = DTTOIF(entry->type);
+		if (filler(in_buf, entry->name, &st, entry->off))
+			break;
+#endif
+		i++;
+	}
+	dir->next = i;
+
+	return 0;
+}
+
+static int df_releasedir(const char *in_path, struct fuse_file_info *in_fi)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_RELEASEDIR;
+	struct df_dir *dir = dir_from_fi(in_fi);
+
+	in_fi->fh = dir->fh;
+	dir_clear_entries(dir);
+	free(dir);
+
+	lock = sock_lock();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_FUSE_FILE_INFO, in_fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_remote_answer(sock, op_code,
+			DF_DATA_END);
+}
+
+static int df_readlink(const char *in_path, char *out_buf, size_t in_size)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	int64_t target_len = in_size;
+	char __attribute__((cleanup(char_array_free))) *tmp_buf = NULL;
+	enum df_op op_code = DF_OP_READLINK;
+
+	lock = sock_lock();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_INT, target_len,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_BUFFER, &target_len, &tmp_buf,
+			DF_DATA_END);
+
+	/* TODO use a strlcpy implementation */
+	strncpy(out_buf, tmp_buf, in_size);
+	out_buf[in_size] = '\0';
+
+	return ret;
+}
+
+static int df_release(const char *in_path, struct fuse_file_info *in_fi)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_RELEASE;
+	struct fuse_file_info fi;
+	struct df_file *file = file_from_fi(in_fi, &fi);
+
+	lock = sock_lock();
+	/* the kernel ignores the errors of release, but they get logged */
+	if (0 != file->unstable || 0 != file->error) {
+		ret = commit(in_path, file, &fi, 0);
+		if (0 > ret)
+			fprintf(stderr, "writes to %s: %s\n", in_path,
+					strerror(-ret));
+	}
+	inline_detach(file);
+	free(file);
+
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_FUSE_FILE_INFO, &fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_remote_answer(sock, op_code,
+			DF_DATA_FUSE_FILE_INFO, &fi,
+			DF_DATA_END);
+}
+
+/* reports the errors of the unstable writes, at close */
+static int df_flush(const char *in_path, struct fuse_file_info *in_fi)
+{
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	struct fuse_file_info fi;
+	struct df_file *file = file_from_fi(in_fi, &fi);
+
+	lock = sock_lock();
+	if (0 == file->unstable && 0 == file->error)
+		return 0;
+
+	return commit(in_path, file, &fi, 0);
+}
+
+static int df_fsync(const char *in_path, int in_datasync,
+		struct fuse_file_info *in_fi)
+{
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	struct fuse_file_info fi;
+	struct df_file *file = file_from_fi(in_fi, &fi);
+
+	lock = sock_lock();
+
+	return commit(in_path, file, &fi, in_datasync ? DF_COMMIT_DATASYNC :
+			DF_COMMIT_FSYNC);
+}
+
+static int df_unlink(const char *in_path)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_UNLINK;
+
+	lock = sock_lock();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	ret = df_remote_answer(sock, op_code,
+				DF_DATA_END);
+	df_dir_cache_invalidate(in_path, DF_NOTIFY_REMOVE);
+
+	return ret;
+}
+
+/* the kernel truncates the files opened with O_TRUNC through it too */
+static int df_truncate(const char *in_path, off_t in_size)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_TRUNCATE;
+
+	lock = sock_lock();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_INT, (int64_t)in_size,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_END);
+	df_dir_cache_invalidate(in_path, DF_NOTIFY_CHANGE);
+	inline_drop(in_path, 0);
+
+	return ret;
+}
+
+#if FUSE_USE_VERSION >= 30
+static int df_truncate_fi(const char *in_path, off_t in_size,
+		struct fuse_file_info __attribute__((unused)) *in_fi)
+{
+	return df_truncate(in_path, in_size);
+}
+#endif
+
+static int df_write(const char *in_path, const char *in_buf, size_t in_size,
+		off_t in_offset, struct fuse_file_info *in_fi)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = options.unstable ? DF_OP_WRITE_UNSTABLE :
+			DF_OP_WRITE;
+
+	struct fuse_file_info fi;
+	struct df_file *file;
+	int64_t out_res;
+
+	file = file_from_fi(in_fi, &fi);
+	lock = sock_lock_bulk();
+	df_dir_cache_invalidate(in_path, DF_NOTIFY_CHANGE);
+	inline_drop(in_path, 0);
+	if (DF_OP_WRITE_UNSTABLE == op_code)
+		unstable_reserve(in_path, file, &fi, in_size);
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_BUFFER, in_size, in_buf,
+			DF_DATA_INT, (int64_t)in_offset,
+			DF_DATA_FUSE_FILE_INFO, &fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	if (DF_OP_WRITE_UNSTABLE == op_code) {
+		unstable_sent(file, in_size);
+		return in_size;
+	}
+
+	ret = df_remote_answer(sock, op_code,
+				DF_DATA_INT, &out_res,
+				DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return out_res;
+}
+
+/*
+ * the data is sent in the middle of the request, straight from the buffers
+ * fuse hands us, which are spliced to the socket if they are pipes
+ */
+static int df_write_buf(const char *in_path, struct fuse_bufvec *in_buf,
+		off_t in_offset, struct fuse_file_info *in_fi)
+{
+	int ret;
+	ssize_t copied;
+	enum df_op op_code = options.unstable ? DF_OP_WRITE_UNSTABLE :
+			DF_OP_WRITE;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+
+	struct df_packet_header header;
+	char __attribute__((cleanup(char_array_free))) *prefix = NULL;
+	size_t prefix_size = 0;
+	char __attribute__((cleanup(char_array_free))) *suffix = NULL;
+	size_t suffix_size = 0;
+	size_t in_size = fuse_buf_size(in_buf);
+	struct fuse_bufvec sock_buf = FUSE_BUFVEC_INIT(in_size);
+
+	struct fuse_file_info fi;
+	struct df_file *file;
+	int64_t out_res;
+
+	file = file_from_fi(in_fi, &fi);
+	/* built before taking the lock, the path can't be a DF_DATA_PATH */
+	ret = df_build_payload(&prefix, &prefix_size,
+			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
+			DF_DATA_BLOCK_END);
+	if (0 > ret)
+		return ret;
+	ret = df_build_buffer_prefix(&prefix, &prefix_size, in_size);
+	if (0 > ret)
+		return ret;
+	ret = df_build_payload(&suffix, &suffix_size,
+			DF_DATA_INT, (int64_t)in_offset,
+			DF_DATA_FUSE_FILE_INFO, &fi,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	ret = fill_header(&header, prefix_size + in_size + suffix_size,
+			op_code, 0);
+	if (0 > ret)
+		return ret;
+
+	sock_buf.buf[0].flags = FUSE_BUF_IS_FD;
+	sock_buf.buf[0].fd = sock;
+
+	lock = sock_lock_bulk();
+	df_dir_cache_invalidate(in_path, DF_NOTIFY_CHANGE);
+	inline_drop(in_path, 0);
+	if (DF_OP_WRITE_UNSTABLE == op_code)
+		unstable_reserve(in_path, file, &fi, in_size);
+	ret = df_write_header(sock, &header);
+	if (0 > ret)
+		return ret;
+	ret = df_write_data(sock, prefix, prefix_size);
+	if (0 > ret)
+		return ret;
+	copied = fuse_buf_copy(&sock_buf, in_buf, FUSE_BUF_SPLICE_NONBLOCK);
+	if (0 > copied)
+		return copied;
+	if ((size_t)copied != in_size)
+		return -EIO;
+	ret = df_write_data(sock, suffix, suffix_size);
+	if (0 > ret)
+		return ret;
+	if (DF_OP_WRITE_UNSTABLE == op_code) {
+		unstable_sent(file, in_size);
+		return in_size;
+	}
+
+	ret = df_remote_answer(sock, op_code,
+				DF_DATA_INT, &out_res,
+				DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return out_res;
+}
+
+static int copy_range(const char *in_path, struct df_ioc_copy_range *arg)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_COPY_RANGE;
+
+	arg->src[DF_IOC_PATH_MAX - 1] = '\0';
+	if ('/' != arg->src[0])
+		return -EINVAL;
+
+	lock = sock_lock_bulk();
+	df_dir_cache_invalidate(in_path, DF_NOTIFY_CHANGE);
+	inline_drop(in_path, 0);
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, arg->src,
+			DF_DATA_INT, arg->src_offset,
+			DF_DATA_PATH, in_path,
+			DF_DATA_INT, arg->dst_offset,
+			DF_DATA_INT, arg->length,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_remote_answer(sock, op_code,
+				DF_DATA_INT, &arg->copied,
+				DF_DATA_END);
+}
+
+static int tree(struct df_ioc_tree *arg)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_TREE;
+	int64_t errors_len;
+	char __attribute__((cleanup(char_array_free))) *errors = NULL;
+
+	arg->path[DF_IOC_PATH_MAX - 1] = '\0';
+	if ('/' != arg->path[0])
+		return -EINVAL;
+
+	lock = sock_lock_bulk();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_INT, (int64_t)arg->op,
+			DF_DATA_PATH, arg->path,
+			DF_DATA_INT, (int64_t)arg->mode,
+			DF_DATA_INT, arg->uid,
+			DF_DATA_INT, arg->gid,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_INT, &arg->done,
+			DF_DATA_INT, &arg->failed,
+			DF_DATA_BUFFER, &errors_len, &errors,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	snprintf(arg->errors, DF_IOC_TREE_ERRORS_SIZE, "%.*s", (int)errors_len,
+			errors);
+
+	return 0;
+}
+
+/*
+ * hashes blocks of a range of a file on the device, see DF_OP_CHECKSUM
+ * @param digests Receives at most max_blocks digests
+ * @param count On output, number of digests received
+ * @param size On output, size of the file
+ */
+static int remote_checksum(const char *in_path, int64_t offset, int64_t length,
+		int64_t block_size, enum df_hash_algo algo, int64_t max_blocks,
+		uint8_t *digests, int64_t *count, int64_t *size)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_CHECKSUM;
+	size_t digest_size = df_hash_digest_size(algo);
+	int64_t out_len;
+	char __attribute__((cleanup(char_array_free))) *out_digests = NULL;
+
+	if (0 == digest_size)
+		return -EINVAL;
+
+	lock = sock_lock_bulk();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, in_path,
+			DF_DATA_INT, offset,
+			DF_DATA_INT, length,
+			DF_DATA_INT, block_size,
+			DF_DATA_INT, (int64_t)algo,
+			DF_DATA_INT, max_blocks,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_INT, size,
+			DF_DATA_BUFFER, &out_len, &out_digests,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	*count = out_len / digest_size;
+	if (*count > max_blocks)
+		return -EPROTO;
+	memcpy(digests, out_digests, *count * digest_size);
+
+	return 0;
+}
+
+static int checksum(const char *in_path, struct df_ioc_checksum *arg)
+{
+	int ret;
+	int64_t count;
+
+	ret = remote_checksum(in_path, arg->offset, arg->length,
+			arg->block_size, arg->algo, DF_IOC_CHECKSUM_MAX_BLOCKS,
+			arg->digests, &count, &arg->size);
+	arg->count = count;
+
+	return ret;
+}
+
+/* state of a delta push, the records are sent by chunks */
+struct push {
+	const char *path;
+	int64_t handle;
+	/* chunk being built, NULL if it has no record yet */
+	char *payload;
+	size_t size;
+	/* offsets in the new file of the chunk and of it's end */
+	int64_t offset;
+	int64_t end;
+	struct df_ioc_push *arg;
+};
+
+static int push_flush(struct push *p)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	char __attribute__((cleanup(char_array_free))) *payload = p->payload;
+	enum df_op op_code = DF_OP_DELTA_APPLY;
+	struct df_packet_header header;
+	int64_t out_offset;
+
+	if (NULL == payload)
+		return 0;
+	p->payload = NULL;
+	/* the delta is abandoned, the device's file left untouched */
+	if (request_interrupted())
+		return -EINTR;
+	ret = df_build_payload(&payload, &p->size,
+			DF_DATA_INT, (int64_t)DF_DELTA_END,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	lock = sock_lock_bulk();
+	fill_header(&header, p->size, op_code, 0);
+	ret = df_write_message(sock, &header, payload);
+	if (0 > ret)
+		return ret;
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_INT, &out_offset,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	if (out_offset != p->end)
+		return -EPROTO;
+	p->offset = p->end;
+
+	return 0;
+}
+
+/* starts a new chunk if needed, then appends a record */
+static int push_record(struct push *p, int64_t length, ...)
+{
+	int ret;
+	va_list args;
+
+	if (NULL == p->payload) {
+		p->size = 0;
+		/* sent later, the path can't be a DF_DATA_PATH */
+		ret = df_build_payload(&p->payload, &p->size,
+				DF_DATA_INT, p->handle,
+				DF_DATA_BUFFER, strlen(p->path) + 1, p->path,
+				DF_DATA_INT, p->offset,
+				DF_DATA_BLOCK_END);
+		if (0 > ret)
+			return ret;
+	}
+
+	va_start(args, length);
+	ret = df_vbuild_payload(&p->payload, &p->size, args);
+	va_end(args);
+	if (0 > ret)
+		return ret;
+	p->end += length;
+
+	return p->size < DF_DELTA_CHUNK_SIZE ? 0 : push_flush(p);
+}
+
+static int push_copy(void *ctx, int64_t src_offset, int64_t length)
+{
+	struct push *p = ctx;
+
+	p->arg->matched += length;
+
+	return push_record(p, length,
+			DF_DATA_INT, (int64_t)DF_DELTA_COPY,
+			DF_DATA_INT, src_offset,
+			DF_DATA_INT, length,
+			DF_DATA_BLOCK_END);
+}
+
+static int push_literal(void *ctx, const uint8_t *data, size_t size)
+{
+	int ret;
+	size_t piece;
+	struct push *p = ctx;
+
+	p->arg->literal += size;
+	for (; 0 != size; data += piece, size -= piece) {
+		piece = MIN(size, DF_DELTA_CHUNK_SIZE / 2);
+		ret = push_record(p, piece,
+				DF_DATA_INT, (int64_t)DF_DELTA_LITERAL,
+				DF_DATA_BUFFER, piece, data,
+				DF_DATA_BLOCK_END);
+		if (0 > ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* retrieves the signature of the device's version of the file, if any */
+static int push_signature(const char *path, struct df_delta_sig *sig)
+{
+	int ret;
+	int64_t count;
+	int64_t total;
+	int64_t size;
+	struct stat st;
+
+	ret = df_getattr(path, &st);
+	if (-ENOENT == ret)
+		return 0;
+	if (0 > ret)
+		return ret;
+	if (!S_ISREG(st.st_mode))
+		return -EINVAL;
+
+	sig->size = st.st_size;
+	sig->block_size = df_delta_block_size(st.st_size);
+	total = (st.st_size + sig->block_size - 1) / sig->block_size;
+	sig->digests = malloc(total * DF_HASH_RSYNC_SIZE + 1);
+	if (NULL == sig->digests)
+		return -errno;
+
+	/* by several requests, the signature of big files being big too */
+	for (sig->count = 0; sig->count < total; sig->count += count) {
+		ret = remote_checksum(path, sig->count * sig->block_size, -1,
+				sig->block_size, DF_HASH_RSYNC,
+				MIN(total - sig->count, DF_CHECKSUM_MAX_BLOCKS),
+				sig->digests + sig->count * DF_HASH_RSYNC_SIZE,
+				&count, &size);
+		if (0 > ret)
+			return ret;
+		if (0 == count)
+			break;
+	}
+
+	return 0;
+}
+
+static int push_begin(struct push *p, mode_t mode)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_DELTA_BEGIN;
+
+	lock = sock_lock_bulk();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, p->path,
+			DF_DATA_INT, (int64_t)mode,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_remote_answer(sock, op_code,
+			DF_DATA_INT, &p->handle,
+			DF_DATA_END);
+}
+
+static int push_commit(struct push *p, int commit)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_DELTA_COMMIT;
+
+	lock = sock_lock_bulk();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_INT, p->handle,
+			DF_DATA_PATH, p->path,
+			DF_DATA_INT, p->end,
+			DF_DATA_INT, (int64_t)commit,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_remote_answer(sock, op_code,
+			DF_DATA_END);
+}
+
+/*
+ * replaces a device file with a local one, sending only the blocks which
+ * differ from the device's version, see df_delta.h
+ */
+static int push(struct df_ioc_push *arg)
+{
+	int ret;
+	int fd;
+	void *data = NULL;
+	struct stat st;
+	struct df_delta_sig sig;
+	struct df_delta_ops ops = {
+		.copy = push_copy,
+		.literal = push_literal,
+	};
+	struct push p = {
+		.path = arg->dst,
+		.arg = arg,
+	};
+
+	arg->src[DF_IOC_PATH_MAX - 1] = '\0';
+	arg->dst[DF_IOC_PATH_MAX - 1] = '\0';
+	if ('/' != arg->dst[0])
+		return -EINVAL;
+	arg->size = arg->literal = arg->matched = 0;
+	memset(&sig, 0, sizeof(sig));
+
+	/* the local file is read with our rights, not the caller's */
+	if (fuse_get_context()->uid != getuid())
+		return -EPERM;
+	fd = open(arg->src, O_RDONLY | O_CLOEXEC);
+	if (-1 == fd)
+		return -errno;
+	if (-1 == fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (0 != st.st_size) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED == data) {
+			data = NULL;
+			ret = -errno;
+			goto out;
+		}
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+	}
+	arg->size = st.st_size;
+
+	ret = push_signature(arg->dst, &sig);
+	if (0 > ret)
+		goto out;
+	ret = push_begin(&p, st.st_mode & 07777);
+	if (0 > ret)
+		goto out;
+	ret = df_delta_compute(NULL == data ? (const uint8_t *)"" : data,
+			st.st_size, 0 == sig.count ? NULL : &sig, &ops, &p);
+	if (0 == ret)
+		ret = push_flush(&p);
+	if (0 == ret)
+		ret = push_commit(&p, 1);
+	else
+		push_commit(&p, 0);
+out:
+	free(p.payload);
+	free(sig.digests);
+	if (NULL != data)
+		munmap(data, st.st_size);
+	close(fd);
+
+	return ret;
+}
+
+static int export_begin(const char *path, int64_t *id)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_EXPORT_BEGIN;
+
+	lock = sock_lock_bulk();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, path,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_remote_answer(sock, op_code,
+			DF_DATA_INT, id,
+			DF_DATA_END);
+}
+
+/* reads the next chunk of the archive, data must be freed by the caller */
+static int export_read(int64_t id, char **data, int64_t *len, int64_t *eof,
+		int64_t *errors)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_EXPORT_READ;
+
+	lock = sock_lock_bulk();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_INT, id,
+			DF_DATA_INT, (int64_t)DF_EXPORT_CHUNK_SIZE,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_remote_answer(sock, op_code,
+			DF_DATA_BUFFER, len, data,
+			DF_DATA_INT, eof,
+			DF_DATA_INT, errors,
+			DF_DATA_END);
+}
+
+static int export_end(int64_t id)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_EXPORT_END;
+
+	lock = sock_lock_bulk();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_INT, id,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_remote_answer(sock, op_code,
+			DF_DATA_END);
+}
+
+/*
+ * copies a device tree locally, archived by the device and extracted while
+ * received, one chunk per transaction for the mount to stay responsive
+ */
+static int pull(struct df_ioc_pull *arg)
+{
+	int ret;
+	int64_t id;
+	int64_t len;
+	int64_t eof = 0;
+	char *data = NULL;
+	int64_t entries;
+	int64_t errors;
+	struct df_tar_reader *reader;
+
+	arg->src[DF_IOC_PATH_MAX - 1] = '\0';
+	arg->dst[DF_IOC_PATH_MAX - 1] = '\0';
+	if ('/' != arg->src[0] || '/' != arg->dst[0])
+		return -EINVAL;
+	arg->entries = arg->bytes = arg->errors = 0;
+
+	/* the local files are written with our rights, not the caller's */
+	if (fuse_get_context()->uid != getuid())
+		return -EPERM;
+	ret = df_tar_reader_open(&reader, arg->dst);
+	if (0 > ret)
+		return ret;
+	ret = export_begin(arg->src, &id);
+	if (0 > ret)
+		goto out;
+	/* the chunks are extracted while the socket is available to others */
+	while (0 == ret && !eof) {
+		if (request_interrupted()) {
+			ret = -EINTR;
+			break;
+		}
+		ret = export_read(id, &data, &len, &eof, &arg->errors);
+		if (0 == ret) {
+			arg->bytes += len;
+			ret = df_tar_reader_feed(reader, data, len);
+		}
+		FREE(data);
+	}
+	export_end(id);
+out:
+	df_tar_reader_finish(reader);
+	df_tar_reader_stats(reader, &entries, &errors);
+	df_tar_reader_close(&reader);
+	arg->entries = entries;
+	arg->errors += errors;
+
+	return ret;
+}
+
+static int import_begin(const char *path, int64_t *id)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_IMPORT_BEGIN;
+
+	lock = sock_lock_bulk();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_PATH, path,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_remote_answer(sock, op_code,
+			DF_DATA_INT, id,
+			DF_DATA_END);
+}
+
+static int import_write(int64_t id, const char *data, size_t size)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_IMPORT_WRITE;
+
+	lock = sock_lock_bulk();
+	ret = df_remote_call(sock, op_code,
+			DF_DATA_INT, id,
+			DF_DATA_BUFFER, (int64_t)size, data,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_remote_answer(sock, op_code,
+			DF_DATA_END);
+}
+
+static int import_end(int64_t id, struct df_ioc_import *arg)
 {
 	int ret;
-	enum df_op op_code = DF_OP_GETATTR;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_IMPORT_END;
+	int64_t out_errors;
+	int64_t out_len;
+	char __attribute__((cleanup(char_array_free))) *out_messages = NULL;
 
+	lock = sock_lock_bulk();
 	ret = df_remote_call(sock, op_code,
-			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
+			DF_DATA_INT, id,
 			DF_DATA_END);
 	if (0 > ret)
 		return ret;
 
-	return df_remote_answer(sock, op_code,
-			DF_DATA_STAT, out_stbuf,
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_INT, &arg->entries,
+			DF_DATA_INT, &out_errors,
+			DF_DATA_BUFFER, &out_len, &out_messages,
 			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	arg->errors += out_errors;
+	snprintf(arg->messages, sizeof(arg->messages), "%.*s", (int)out_len,
+			out_messages);
+
+	return 0;
 }
 
-static int df_mknod(const char *in_path, mode_t in_mode, dev_t in_rdev)
+/*
+ * copies a local tree into a device directory, archived while sent, the
+ * device extracting it, one chunk per transaction for the mount to stay
+ * responsive
+ */
+static int import(struct df_ioc_import *arg)
 {
 	int ret;
-	enum df_op op_code = DF_OP_MKNOD;
+	int64_t id;
+	ssize_t size;
+	struct df_tar_writer *writer;
+	char __attribute__((cleanup(char_array_free))) *buf = NULL;
+
+	arg->src[DF_IOC_PATH_MAX - 1] = '\0';
+	arg->dst[DF_IOC_PATH_MAX - 1] = '\0';
+	if ('/' != arg->src[0] || '/' != arg->dst[0])
+		return -EINVAL;
+	arg->entries = arg->bytes = arg->errors = 0;
+	arg->messages[0] = '\0';
+
+	/* the local files are read with our rights, not the caller's */
+	if (fuse_get_context()->uid != getuid())
+		return -EPERM;
+	buf = malloc(DF_IMPORT_CHUNK_SIZE);
+	if (NULL == buf)
+		return -errno;
+	ret = df_tar_writer_open(&writer, arg->src);
+	if (0 > ret)
+		return ret;
+	ret = import_begin(arg->dst, &id);
+	if (0 > ret)
+		goto out;
+	do {
+		if (request_interrupted()) {
+			ret = -EINTR;
+			break;
+		}
+		size = df_tar_writer_read(writer, buf, DF_IMPORT_CHUNK_SIZE);
+		if (0 > size) {
+			ret = size;
+			break;
+		}
+		ret = import_write(id, buf, size);
+		arg->bytes += size;
+	} while (0 == ret && DF_IMPORT_CHUNK_SIZE == size);
+	/* reports what has been extracted, even on failure */
+	if (0 == ret)
+		ret = import_end(id, arg);
+	else
+		import_end(id, arg);
+	arg->errors += df_tar_writer_errors(writer);
+out:
+	df_tar_writer_close(&writer);
+
+	return ret;
+}
+
+/*
+ * @param date On output, if not NULL, date of the scan, from the device's
+ * clock, to be used as the since of a later one
+ */
+static int scan_begin(const char *path, int64_t since_sec, int64_t since_nsec,
+		const char *manifest, size_t manifest_size, int flags,
+		int64_t *id, struct timespec *date)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_SCAN_BEGIN;
+	int64_t out_date_sec;
+	int64_t out_date_nsec;
 
+	lock = sock_lock();
 	ret = df_remote_call(sock, op_code,
-			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
-			DF_DATA_INT, (int64_t)in_mode,
-			DF_DATA_INT, (int64_t)in_rdev,
+			DF_DATA_PATH, path,
+			DF_DATA_INT, since_sec,
+			DF_DATA_INT, since_nsec,
+			DF_DATA_BUFFER, (int64_t)manifest_size, manifest,
+			DF_DATA_INT, (int64_t)flags,
 			DF_DATA_END);
 	if (0 > ret)
 		return ret;
 
-	return df_remote_answer(sock, op_code,
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_INT, id,
+			DF_DATA_INT, &out_date_sec,
+			DF_DATA_INT, &out_date_nsec,
 			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+	if (NULL != date) {
+		date->tv_sec = out_date_sec;
+		date->tv_nsec = out_date_nsec;
+	}
+
+	return 0;
 }
 
-static int df_open(const char *in_path, struct fuse_file_info *in_fi)
+/* starts a scan, sending the manifest read from a local file if any */
+static int scan_start(const char *path, struct df_ioc_scan *arg)
 {
 	int ret;
-	enum df_op op_code = DF_OP_OPEN;
+	int fd;
+	struct stat st;
+	void *manifest = NULL;
+
+	arg->manifest[DF_IOC_PATH_MAX - 1] = '\0';
+	if ('\0' == arg->manifest[0])
+		return scan_begin(path, arg->since_sec, arg->since_nsec, "", 0,
+				0, &arg->id, NULL);
+
+	/* the local file is read with our rights, not the caller's */
+	if (fuse_get_context()->uid != getuid())
+		return -EPERM;
+	fd = open(arg->manifest, O_RDONLY | O_CLOEXEC);
+	if (-1 == fd)
+		return -errno;
+	if (-1 == fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+	if (0 != st.st_size) {
+		manifest = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+				0);
+		if (MAP_FAILED == manifest) {
+			manifest = NULL;
+			ret = -errno;
+			goto out;
+		}
+	}
+	ret = scan_begin(path, arg->since_sec, arg->since_nsec,
+			NULL == manifest ? "" : manifest, st.st_size, 0,
+			&arg->id, NULL);
+out:
+	if (NULL != manifest)
+		munmap(manifest, st.st_size);
+	close(fd);
+
+	return ret;
+}
+
+static int scan_end(int64_t id)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_SCAN_END;
 
+	lock = sock_lock();
 	ret = df_remote_call(sock, op_code,
-			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
-			DF_DATA_FUSE_FILE_INFO, in_fi,
+			DF_DATA_INT, id,
 			DF_DATA_END);
 	if (0 > ret)
 		return ret;
 
 	return df_remote_answer(sock, op_code,
-			DF_DATA_FUSE_FILE_INFO, in_fi,
 			DF_DATA_END);
 }
 
-static int df_read(const char *in_path, char *out_buf, size_t in_size,
-		off_t in_offset, struct fuse_file_info *in_fi)
+static int scan_read(struct df_ioc_scan *arg, int64_t *eof)
 {
 	int ret;
-	enum df_op op_code = DF_OP_READ;
-
-	int64_t res;
-	char __attribute__((cleanup(char_array_free))) *tmp_buf = NULL;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_SCAN_READ;
+	int64_t out_len;
+	char __attribute__((cleanup(char_array_free))) *out_data = NULL;
 
+	lock = sock_lock_bulk();
 	ret = df_remote_call(sock, op_code,
-			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
-			DF_DATA_INT, (int64_t)in_size,
-			DF_DATA_INT, (int64_t)in_offset,
-			DF_DATA_FUSE_FILE_INFO, in_fi,
+			DF_DATA_INT, arg->id,
+			DF_DATA_INT, (int64_t)sizeof(arg->data),
 			DF_DATA_END);
 	if (0 > ret)
 		return ret;
 
 	ret = df_remote_answer(sock, op_code,
-				DF_DATA_BUFFER, &res, &tmp_buf,
-				DF_DATA_END);
-	memcpy(out_buf, tmp_buf, res);
+			DF_DATA_BUFFER, &out_len, &out_data,
+			DF_DATA_INT, eof,
+			DF_DATA_INT, &arg->errors,
+			DF_DATA_END);
 	if (0 > ret)
 		return ret;
+	if (out_len > (int64_t)sizeof(arg->data))
+		return -EPROTO;
+	memcpy(arg->data, out_data, out_len);
+	arg->size = out_len;
 
-	return res;
+	return 0;
 }
 
-static int df_readdir(const char *in_path, void *in_buf, fuse_fill_dir_t filler,
-		       off_t in_offset, struct fuse_file_info *in_fi)
+/* returns the next chunk of the changes of a tree, see df_scan.h */
+static int scan(const char *in_path, struct df_ioc_scan *arg)
 {
 	int ret;
-	char __attribute__((cleanup(char_array_free))) *payload = NULL;
-	struct df_packet_header header;
-	char __attribute__((cleanup(char_array_free))) *entry_path = NULL;
-	size_t payload_offset = 0;
-	int64_t len;
-	struct stat st;
+	int64_t eof;
 
-	ret = df_remote_call(sock, DF_OP_READDIR,
-			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
-			DF_DATA_INT, (int64_t)in_offset,
-			DF_DATA_FUSE_FILE_INFO, in_fi,
-			DF_DATA_END);
-	if (0 > ret)
+	if (0 > arg->id) {
+		ret = scan_start(in_path, arg);
+		if (0 > ret)
+			return ret;
+	}
+
+	ret = scan_read(arg, &eof);
+	if (0 > ret || eof) {
+		scan_end(arg->id);
+		arg->id = -1;
+	}
+
+	return ret;
+}
+
+/* control interface, see df_ioctl.h */
+static int df_ioctl(const char *in_path, int in_cmd,
+		void __attribute__((unused)) *in_arg,
+		struct fuse_file_info __attribute__((unused)) *in_fi,
+		unsigned int in_flags, void *in_data)
+{
+	int ret;
+
+	if (in_flags & FUSE_IOCTL_COMPAT)
+		return -ENOSYS;
+
+	switch ((unsigned int)in_cmd) {
+	case DF_IOC_COPY_RANGE:
+		return copy_range(in_path, in_data);
+
+	case DF_IOC_TREE:
+		ret = tree(in_data);
+		/* paths are terminated by the handlers, whether they fail or not */
+		df_dir_cache_invalidate(((struct df_ioc_tree *)in_data)->path,
+				DF_NOTIFY_OVERFLOW);
 		return ret;
 
-	ret = df_read_message(sock, &header, &payload);
-	if (0 > ret)
+	case DF_IOC_CHECKSUM:
+		return checksum(in_path, in_data);
+
+	case DF_IOC_PUSH:
+		ret = push(in_data);
+		df_dir_cache_invalidate(((struct df_ioc_push *)in_data)->dst,
+				DF_NOTIFY_CREATE);
 		return ret;
-	if (0 != header.error)
-		return -header.error;
 
-	ret = df_parse_payload(payload, &payload_offset, header.payload_size,
-			DF_DATA_FUSE_FILE_INFO, in_fi,
-			DF_DATA_BLOCK_END);
-	if (0 > ret)
+	case DF_IOC_PULL:
+		return pull(in_data);
+
+	case DF_IOC_IMPORT:
+		ret = import(in_data);
+		df_dir_cache_invalidate(((struct df_ioc_import *)in_data)->dst,
+				DF_NOTIFY_OVERFLOW);
 		return ret;
 
+	case DF_IOC_SCAN:
+		return scan(in_path, in_data);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+#if FUSE_USE_VERSION >= 30
+/*
+ * paths whose entries and attributes the kernel has to drop, it's done by a
+ * thread of it's own, the kernel possibly holding locks on them for the
+ * requests in progress, which could be the ones receiving the notifications
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct fuse *fuse;
+	char **paths;
+	size_t count;
+	size_t capacity;
+} kernel_inval = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void kernel_inval_push(const char *path, size_t len)
+{
+	char *copy;
+	char **paths;
+	size_t capacity;
+
+	copy = strndup(path, len);
+	if (NULL == copy)
+		return;
+
+	pthread_mutex_lock(&kernel_inval.mutex);
+	if (kernel_inval.count == kernel_inval.capacity) {
+		capacity = kernel_inval.capacity ?
+				2 * kernel_inval.capacity : 64;
+		paths = realloc(kernel_inval.paths, capacity * sizeof(*paths));
+		if (NULL == paths) {
+			pthread_mutex_unlock(&kernel_inval.mutex);
+			free(copy);
+			return;
+		}
+		kernel_inval.paths = paths;
+		kernel_inval.capacity = capacity;
+	}
+	kernel_inval.paths[kernel_inval.count++] = copy;
+	pthread_cond_signal(&kernel_inval.cond);
+	pthread_mutex_unlock(&kernel_inval.mutex);
+}
+
+static void *kernel_invalidator(void __attribute__((unused)) *arg)
+{
+	char **paths;
+	size_t count;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&kernel_inval.mutex);
+		while (0 == kernel_inval.count)
+			pthread_cond_wait(&kernel_inval.cond,
+					&kernel_inval.mutex);
+		paths = kernel_inval.paths;
+		count = kernel_inval.count;
+		kernel_inval.paths = NULL;
+		kernel_inval.count = kernel_inval.capacity = 0;
+		pthread_mutex_unlock(&kernel_inval.mutex);
+
+		/* fails with -ENOENT for the paths the kernel doesn't know */
+		for (i = 0; i < count; i++) {
+			fuse_invalidate_path(kernel_inval.fuse, paths[i]);
+			free(paths[i]);
+		}
+		free(paths);
+	}
+
+	return NULL;
+}
+#endif
+
+/* drops what we know about path, which changed on the device */
+static void invalidate(const char *path, int64_t flags)
+{
+	df_dir_cache_invalidate(path, flags);
+	if (flags & (DF_NOTIFY_CHANGE | DF_NOTIFY_OVERFLOW))
+		inline_drop(path, flags & DF_NOTIFY_OVERFLOW);
+#if FUSE_USE_VERSION >= 30
+	kernel_inval_push(path, strlen(path));
+	/* the parent's size and times changed too */
+	if (flags & (DF_NOTIFY_CREATE | DF_NOTIFY_REMOVE))
+		kernel_inval_push(path, parent_len(path));
+#else
 	/*
-	 * all has been parsed when consumed data (payload_offset) equals size
-	 * minus 8 because the last DF_DATA_END is popped out of the loop
+	 * the high-level API of libfuse 2 has no way to invalidate the kernel's
+	 * entries and attributes, which expire after their timeouts only
 	 */
-	while (payload_offset + 8 < header.payload_size) {
-		ret = df_parse_payload(payload, &payload_offset,
-				header.payload_size,
+#endif
+}
 
-				DF_DATA_BUFFER, &len, &entry_path,
-				DF_DATA_STAT, &st,
-				DF_DATA_BLOCK_END);
+static void on_notify(char *payload, size_t size)
+{
+	int ret;
+	size_t offset = 0;
+	int64_t path_len;
+	char __attribute__((cleanup(char_array_free))) *path = NULL;
+	int64_t flags;
+
+	ret = df_parse_payload(payload, &offset, size,
+			DF_DATA_BUFFER, &path_len, &path,
+			DF_DATA_INT, &flags,
+			DF_DATA_END);
+	if (0 > ret)
+		return;
+	path[path_len - 1] = '\0';
+
+	invalidate(path, flags);
+}
+
+/*
+ * the notifications are handled while reading answers, this thread handles
+ * those arriving while no request is in progress
+ */
+static void *notification_poller(void __attribute__((unused)) *arg)
+{
+	int ret;
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	struct pollfd pfd = {
+		.fd = sock,
+		.events = POLLIN,
+	};
+
+	background = 1;
+	for (;;) {
+		ret = poll(&pfd, 1, -1);
+		if (-1 == ret && EINTR != errno)
+			break;
+		if (1 != ret)
+			continue;
+		if (pfd.revents & (POLLHUP | POLLERR))
+			break;
+
+		/* the data may have been consumed by a request meanwhile */
+		lock = sock_lock_idle();
+		ret = df_read_notifications(sock);
+		sock_unlock(&lock);
+		lock = NULL;
 		if (0 > ret)
-			return ret;
-		if (filler(in_buf, entry_path, &st, 0))
 			break;
-		FREE(entry_path);
 	}
 
-	return df_parse_payload(payload, &payload_offset, header.payload_size,
-			DF_DATA_END);
+	return NULL;
 }
 
-static int df_readlink(const char *in_path, char *out_buf, size_t in_size)
+/*
+ * feeds the directory cache with a chunk of the snapshot of root, started at
+ * date, the listings of the directories which didn't change since the
+ * previous one being merged from the index
+ * @param flags Flags of the scan, the subdirectories being listed unless it's
+ * DF_SCAN_SHALLOW
+ * @return number of entries received, errno-compatible negative value on error
+ */
+static int snapshot_apply(const char *root, const struct timespec *since,
+		const struct timespec *date, const uint8_t *records,
+		size_t size, int flags)
 {
 	int ret;
-	int64_t target_len = in_size;
-	char __attribute__((cleanup(char_array_free))) *tmp_buf = NULL;
-	enum df_op op_code = DF_OP_READLINK;
+	int count = 0;
+	size_t offset = 0;
+	struct stat st;
+	const char *name;
+	char path[PATH_MAX];
+	char dir[PATH_MAX];
+	struct df_scan_entry entry = { .kind = DF_SCAN_ENTRY };
 
-	ret = df_remote_call(sock, op_code,
-			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
-			DF_DATA_INT, target_len,
-			DF_DATA_END);
-	if (0 > ret)
-		return ret;
+	while (offset < size) {
+		ret = df_scan_decode(records, size, &offset, &entry);
+		if (0 > ret)
+			return ret;
+		if (sizeof(path) <= (size_t)snprintf(path, sizeof(path),
+					"%s%s%s", root, '\0' == entry.path[0] ||
+					0 == strcmp(root, "/") ? "" : "/",
+					entry.path))
+			return -ENAMETOOLONG;
+
+		switch (entry.kind) {
+		case DF_SCAN_ATTRS:
+			df_dir_cache_stat(&entry, &st);
+			name = strrchr(path, '/');
+			snprintf(dir, sizeof(dir), "%.*s", name == path ? 1 :
+					(int)(name - path), path);
+			df_dir_cache_add(dir, name + 1, &st);
+			count++;
+			if (!S_ISDIR(st.st_mode) || (flags & DF_SCAN_SHALLOW))
+				break;
+			df_dir_cache_begin(path, &st, date);
+			/* only it's changed entries will follow */
+			if (!df_scan_changed(&entry, since))
+				df_dir_cache_merge(path);
+			break;
 
-	ret = df_remote_answer(sock, op_code,
-			DF_DATA_BUFFER, &target_len, &tmp_buf,
-			DF_DATA_END);
+		case DF_SCAN_LISTED:
+		case DF_SCAN_UNLISTED:
+			df_dir_cache_end(path, DF_SCAN_LISTED == entry.kind);
+			break;
 
-	/* TODO use a strlcpy implementation */
-	strncpy(out_buf, tmp_buf, in_size);
-	out_buf[in_size] = '\0';
+		default:
+			return -EPROTO;
+		}
+	}
 
-	return ret;
+	return count;
 }
 
-static int df_release(const char *in_path, struct fuse_file_info *in_fi)
+/* reads the next chunk of a snapshot and applies it, see snapshot_apply */
+static int snapshot_read(const char *root, const struct timespec *since,
+		const struct timespec *date, int64_t id, int flags,
+		int64_t *eof)
 {
 	int ret;
-	enum df_op op_code = DF_OP_RELEASE;
-
+	pthread_mutex_t __attribute__((cleanup(sock_unlock))) *lock = NULL;
+	enum df_op op_code = DF_OP_SCAN_READ;
+	int64_t out_len;
+	char __attribute__((cleanup(char_array_free))) *out_data = NULL;
+	int64_t out_errors;
+
+	/* the warm up's snapshots can wait, a prefetch's can't */
+	lock = flags & DF_SCAN_SHALLOW ? sock_lock() : sock_lock_bulk();
 	ret = df_remote_call(sock, op_code,
-			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
-			DF_DATA_FUSE_FILE_INFO, in_fi,
+			DF_DATA_INT, id,
+			DF_DATA_INT, (int64_t)DF_SCAN_CHUNK_SIZE,
 			DF_DATA_END);
 	if (0 > ret)
 		return ret;
 
-	return df_remote_answer(sock, op_code,
-			DF_DATA_FUSE_FILE_INFO, in_fi,
+	ret = df_remote_answer(sock, op_code,
+			DF_DATA_BUFFER, &out_len, &out_data,
+			DF_DATA_INT, eof,
+			DF_DATA_INT, &out_errors,
 			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	/*
+	 * applied before the socket is released, for the notifications sent
+	 * after this answer to be handled after it, dropping what changed
+	 * since the entries were read
+	 */
+	return snapshot_apply(root, since, date, (uint8_t *)out_data,
+			out_len, flags);
 }
 
-static int df_unlink(const char *in_path)
+/*
+ * fills the directory cache with the listings and the attributes of the tree
+ * under root, which the device watches from then on, for them to be dropped
+ * when they change, only the changes since root's listing in the index, if
+ * any, being transferred
+ * @param flags DF_SCAN_SHALLOW to fetch only root's listing, or 0
+ * @return number of entries received, errno-compatible negative value on error
+ */
+static int snapshot(const char *root, int flags)
 {
 	int ret;
-	enum df_op op_code = DF_OP_UNLINK;
+	int count = 0;
+	int64_t id;
+	int64_t eof = 0;
+	struct stat st;
+	struct timespec since = { 0, 0 };
+	struct timespec date;
 
-	ret = df_remote_call(sock, op_code,
-			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
-			DF_DATA_END);
+	flags |= DF_SCAN_SNAPSHOT | DF_SCAN_WATCH;
+	df_dir_cache_indexed_since(root, &since);
+	ret = scan_begin(root, since.tv_sec, since.tv_nsec, "", 0, flags, &id,
+			&date);
 	if (0 > ret)
 		return ret;
 
-	return df_remote_answer(sock, op_code,
-				DF_DATA_END);
+	/* the root's entries are all reported */
+	ret = df_getattr(root, &st);
+	if (0 == ret)
+		df_dir_cache_begin(root, &st, &date);
+	while (0 <= ret && !eof) {
+		ret = snapshot_read(root, &since, &date, id, flags, &eof);
+		if (0 < ret)
+			count += ret;
+	}
+	scan_end(id);
+
+	return 0 > ret ? ret : count;
 }
 
-static int df_write(const char *in_path, const char *in_buf, size_t in_size,
-		off_t in_offset, struct fuse_file_info *in_fi)
+/* snapshots the directories of the warm option, while the mount is in use */
+static void *warm_up(void *arg)
 {
 	int ret;
-	enum df_op op_code = DF_OP_WRITE;
+	size_t len;
+	char *root;
+	char *saveptr;
+
+	background = 1;
+	for (root = strtok_r(arg, ":", &saveptr); NULL != root;
+			root = strtok_r(NULL, ":", &saveptr)) {
+		/* paths are compared as they are, by the directory cache */
+		len = strlen(root);
+		while (len > 1 && '/' == root[len - 1])
+			root[--len] = '\0';
+		ret = '/' == root[0] ? snapshot(root, 0) : -EINVAL;
+		if (0 > ret)
+			fprintf(stderr, "warm up of %s: %s\n", root,
+					strerror(-ret));
+	}
 
-	int64_t out_res;
+	return NULL;
+}
 
-	ret = df_remote_call(sock, op_code,
-			DF_DATA_BUFFER, strlen(in_path) + 1, in_path,
-			DF_DATA_BUFFER, in_size, in_buf,
-			DF_DATA_INT, (int64_t)in_offset,
-			DF_DATA_FUSE_FILE_INFO, in_fi,
-			DF_DATA_END);
-	if (0 > ret)
-		return ret;
+#if FUSE_USE_VERSION >= 30
+static void *df_init(struct fuse_conn_info *conn,
+		struct fuse_config __attribute__((unused)) *cfg)
+#else
+static void *df_init(struct fuse_conn_info *conn)
+#endif
+{
+	int ret;
+	pthread_t poller;
+	pthread_t warm;
+#if FUSE_USE_VERSION >= 30
+	pthread_t invalidator;
+#endif
 
-	ret = df_remote_answer(sock, op_code,
-				DF_DATA_INT, &out_res,
-				DF_DATA_END);
-	if (0 > ret)
-		return ret;
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+			FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	/* df_ctl's commands are ioctls on the mount's root */
+	if (conn->capable & FUSE_CAP_IOCTL_DIR)
+		conn->want |= FUSE_CAP_IOCTL_DIR;
+	else
+		fprintf(stderr, "ioctls on directories unsupported, most of "
+				"df_ctl's commands won't work\n");
+#if FUSE_USE_VERSION >= 30
+	/*
+	 * the requests are serialized on the socket anyway, but the kernel
+	 * doesn't wait for a lookup to end to send the next one in the same
+	 * directory, and the getattrs following a readdir are spared when the
+	 * attributes are cached
+	 */
+	conn->want |= conn->capable & (FUSE_CAP_PARALLEL_DIROPS |
+			FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+	if (options.writeback)
+		conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+	/* libfuse asks the kernel for more than 32 pages per request then */
+	conn->max_write = (options.max_pages ? options.max_pages :
+			DF_MAX_PAGES) * getpagesize();
+
+	kernel_inval.fuse = fuse_get_context()->fuse;
+	ret = pthread_create(&invalidator, NULL, kernel_invalidator, NULL);
+	if (0 != ret)
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+	else
+		pthread_detach(invalidator);
+#endif
 
-	return out_res;
+	/* started here, for it not to be lost when fuse_main daemonizes */
+	df_set_notify_handler(on_notify);
+	ret = pthread_create(&poller, NULL, notification_poller, NULL);
+	if (0 != ret)
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+	else
+		pthread_detach(poller);
+
+	if (NULL != options.index) {
+		ret = df_dir_cache_load(options.index);
+		if (0 > ret && -ENOENT != ret)
+			fprintf(stderr, "loading %s: %s\n", options.index,
+					strerror(-ret));
+	}
+
+	/* the mount is usable meanwhile, the snapshots are only a shortcut */
+	if (NULL != options.warm) {
+		ret = pthread_create(&warm, NULL, warm_up, options.warm);
+		if (0 != ret)
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		else
+			pthread_detach(warm);
+	}
+
+	return NULL;
 }
 
 static struct fuse_operations df_oper = {
 	.access		= df_access,
+#if FUSE_USE_VERSION >= 30
+	.getattr	= df_getattr_fi,
+#else
 	.getattr	= df_getattr,
+#endif
 	.open		= df_open,
+	.opendir	= df_opendir,
 	.mknod		= df_mknod,
 	.read		= df_read,
+	.read_buf	= df_read_buf,
 	.readdir	= df_readdir,
 	.readlink	= df_readlink,
 	.release	= df_release,
+	.flush		= df_flush,
+	.fsync		= df_fsync,
+	.releasedir	= df_releasedir,
 	.unlink		= df_unlink,
+#if FUSE_USE_VERSION >= 30
+	.truncate	= df_truncate_fi,
+#else
+	.truncate	= df_truncate,
+#endif
 	.write		= df_write,
+	.write_buf	= df_write_buf,
+	.ioctl		= df_ioctl,
+	.init		= df_init,
 };
 
 /**
@@ -324,6 +2953,88 @@ static struct fuse_operations df_oper = {
 	return 1;
 }
 
+/*
+ * @return serial of the device whose adb forward we connect through, e.g.
+ * for "adb forward tcp:6666 tcp:6666", to be freed, NULL if there is none
+ */
+static char *forward_serial(void)
+{
+	char *line;
+	char *next;
+	char *local;
+	char *serial = NULL;
+	char __attribute__((cleanup(char_array_free))) *forwards = NULL;
+#ifdef USE_UNIX_SOCKET
+	const char *endpoint = "localabstract:dfuse.socket";
+#else
+	char endpoint[16];
+
+	snprintf(endpoint, sizeof(endpoint), "tcp:%d", DF_HOST_PORT);
+#endif
+
+	/* one "serial local remote" line per forward */
+	forwards = adb_query("host:list-forward");
+	if (NULL == forwards)
+		return NULL;
+	for (line = strtok_r(forwards, "\n", &next); NULL != line;
+			line = strtok_r(NULL, "\n", &next)) {
+		local = strchr(line, ' ');
+		if (NULL == local)
+			continue;
+		*local++ = '\0';
+		if (0 == strncmp(local, endpoint, strlen(endpoint)) &&
+				' ' == local[strlen(endpoint)]) {
+			serial = strdup(line);
+			break;
+		}
+	}
+
+	return serial;
+}
+
+/*
+ * @return path of the index of the device's snapshots, in the user's cache
+ * directory, to be freed, or NULL if it can't be determined
+ */
+static char *default_index(void)
+{
+	char *p;
+	char *dir = NULL;
+	char *path = NULL;
+	char *serial;
+	const char *cache = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+
+	serial = forward_serial();
+	if (NULL == serial || (NULL == cache && NULL == home))
+		goto out;
+	for (p = serial; '\0' != *p; p++)
+		if ('/' == *p)
+			*p = '_';
+
+	if (NULL == cache) {
+		if (-1 == asprintf(&dir, "%s/.cache", home)) {
+			dir = NULL;
+			goto out;
+		}
+		mkdir(dir, 0700);
+		cache = dir;
+	}
+	if (-1 == asprintf(&path, "%s/dfuse", cache)) {
+		path = NULL;
+		goto out;
+	}
+	mkdir(path, 0700);
+	free(path);
+	if (-1 == asprintf(&path, "%s/dfuse/%s.index", cache, serial))
+		path = NULL;
+out:
+	free(dir);
+	free(serial);
+
+	return path;
+}
+
 /* ./misc/adb forward tcp:6665 tcp:6666 */
 int main(int argc, char *argv[])
 {
@@ -336,11 +3047,19 @@ int main(int argc, char *argv[])
 	int domain = AF_INET;
 #endif
 	socklen_t addr_len = sizeof(addr);
+	int err;
 	uint32_t host_version;
 	sigset_t sig;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	printf("dfuse host daemon (build "__DATE__" - "__TIME__")\n");
 
+	/* options.warm is used by the warm up thread, until we exit */
+	if (-1 == fuse_opt_parse(&args, &options, df_opts, NULL))
+		return EXIT_FAILURE;
+	if (NULL != options.warm && NULL == options.index)
+		options.index = default_index();
+
 	sock = socket(domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (0 > sock) {
 		perror("socket");
@@ -368,8 +3087,13 @@ int main(int argc, char *argv[])
 
 	printf("Connected to device\n");
 
+	/*
+	 * libfuse signals the threads whose requests are interrupted with
+	 * SIGUSR1, which is only unblocked while waiting for an answer
+	 */
 	sigemptyset(&sig);
 	sigaddset(&sig, SIGPIPE);
+	sigaddset(&sig, SIGUSR1);
 	sigprocmask(SIG_BLOCK, &sig, NULL);
 
 	ret = df_read_handshake(sock, &host_version);
@@ -386,7 +3110,39 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	ret = fuse_main(argc, argv, &df_oper, NULL);
+	ret = flow_negotiate();
+	if (0 > ret) {
+		fprintf(stderr, "window negotiation: %s\n", strerror(-ret));
+		return EXIT_FAILURE;
+	}
+
+	/* the device stops working on the requests interrupted */
+	df_set_interrupt_handler(request_interrupted, SIGUSR1);
+	if (-1 == fuse_opt_add_arg(&args, "-ointr"))
+		return EXIT_FAILURE;
+#if FUSE_USE_VERSION < 30
+	/* the device's changes can't be notified to the kernel, see invalidate */
+	if (-1 == fuse_opt_insert_arg(&args, 1,
+				"-oattr_timeout=1,entry_timeout=1"))
+		return EXIT_FAILURE;
+#endif
+
+	ret = pthread_key_create(&pipe_key, df_pipe_destroy);
+	if (0 != ret) {
+		fprintf(stderr, "pthread_key_create: %s\n", strerror(ret));
+		return EXIT_FAILURE;
+	}
+
+	ret = fuse_main(args.argc, args.argv, &df_oper, NULL);
+	fuse_opt_free_args(&args);
+	/* only what the warm up brought is saved */
+	if (NULL != options.warm && NULL != options.index) {
+		err = df_dir_cache_save(options.index);
+		if (0 > err)
+			fprintf(stderr, "saving %s: %s\n", options.index,
+					strerror(-err));
+	}
+	df_dir_cache_cleanup();
 
 	if (-1 != sock)
 		close(sock);
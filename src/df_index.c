@@ -0,0 +1,344 @@
+/**
+ * @file df_index.c
+ *
+ * Index of directory listings, persisted by the host between two mounts,
+ * the file being : a header, then the directories, each a dir_header followed
+ * by the path, the records, and padding up to 8 bytes, then the table of
+ * their offsets
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "df_index.h"
+
+#define DF_INDEX_MAGIC "dfindex"
+
+/* to be incremented on each change of the format */
+#define DF_INDEX_VERSION 1
+
+struct header {
+	char magic[8];
+	uint32_t version;
+	/* number of directories */
+	uint32_t count;
+	/* offset of the table, of mask + 1 offsets of dir_header, 0 if free */
+	uint64_t table;
+	uint64_t mask;
+};
+
+struct dir_header {
+	uint64_t hash;
+	int64_t since_sec;
+	int64_t since_nsec;
+	uint32_t path_len;
+	/* size of the records */
+	uint32_t size;
+};
+
+struct df_index {
+	const uint8_t *map;
+	size_t size;
+	const struct header *header;
+	const uint64_t *table;
+};
+
+struct df_index_writer {
+	FILE *file;
+	/* path of the index, and of the temporary file */
+	char *path;
+	char *tmp_path;
+	/* offsets and hashes of the directories written */
+	uint64_t *offsets;
+	uint64_t *hashes;
+	size_t count;
+	size_t capacity;
+	uint64_t offset;
+};
+
+/* FNV-1a */
+static uint64_t hash_path(const char *path)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	while (*path) {
+		hash ^= (uint8_t)*path++;
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+static uint64_t padded(uint64_t size)
+{
+	return (size + 7) & ~(uint64_t)7;
+}
+
+int df_index_open(struct df_index **index, const char *file)
+{
+	int fd;
+	int ret;
+	struct stat st;
+	struct df_index *idx;
+	const struct header *header;
+
+	if (NULL == index || NULL == file)
+		return -EINVAL;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (-1 == fd)
+		return -errno;
+	if (-1 == fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+	ret = -EINVAL;
+	if ((uint64_t)st.st_size < sizeof(*header))
+		goto out;
+
+	idx = calloc(1, sizeof(*idx));
+	if (NULL == idx) {
+		ret = -errno;
+		goto out;
+	}
+	idx->size = st.st_size;
+	idx->map = mmap(NULL, idx->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == idx->map) {
+		ret = -errno;
+		free(idx);
+		goto out;
+	}
+	header = idx->header = (const struct header *)idx->map;
+	/* the table must fit, with a number of slots being a power of 2 */
+	if (0 != memcmp(header->magic, DF_INDEX_MAGIC, sizeof(header->magic))
+			|| DF_INDEX_VERSION != header->version ||
+			header->table % 8 || header->table > idx->size ||
+			header->mask >= (idx->size - header->table) / 8 ||
+			0 != (header->mask & (header->mask + 1))) {
+		df_index_close(&idx);
+		goto out;
+	}
+	idx->table = (const uint64_t *)(idx->map + header->table);
+	*index = idx;
+	ret = 0;
+out:
+	close(fd);
+
+	return ret;
+}
+
+int df_index_find(struct df_index *index, const char *path,
+		const uint8_t **records, size_t *size, struct timespec *since)
+{
+	uint64_t i;
+	uint64_t n;
+	uint64_t offset;
+	size_t len = strlen(path);
+	uint64_t hash = hash_path(path);
+	const uint64_t mask = index->header->mask;
+	const struct dir_header *dir;
+
+	for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+		offset = index->table[i];
+		if (0 == offset)
+			return -ENOENT;
+		if (offset % 8 || offset > index->header->table ||
+				index->header->table - offset < sizeof(*dir))
+			return -EINVAL;
+		dir = (const struct dir_header *)(index->map + offset);
+		offset += sizeof(*dir);
+		if ((uint64_t)dir->path_len + dir->size >
+				index->header->table - offset)
+			return -EINVAL;
+		if (hash != dir->hash || len != dir->path_len ||
+				0 != memcmp(index->map + offset, path, len))
+			continue;
+
+		*records = index->map + offset + len;
+		*size = dir->size;
+		since->tv_sec = dir->since_sec;
+		since->tv_nsec = dir->since_nsec;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+void df_index_close(struct df_index **index)
+{
+	if (NULL == index || NULL == *index)
+		return;
+
+	munmap((void *)(*index)->map, (*index)->size);
+	free(*index);
+	*index = NULL;
+}
+
+int df_index_writer_open(struct df_index_writer **writer, const char *file)
+{
+	int fd;
+	int ret;
+	struct header header;
+	struct df_index_writer *w;
+
+	if (NULL == writer || NULL == file)
+		return -EINVAL;
+
+	w = calloc(1, sizeof(*w));
+	if (NULL == w)
+		return -errno;
+	w->path = strdup(file);
+	if (NULL == w->path || -1 == asprintf(&w->tmp_path, "%s.tmp", file)) {
+		w->tmp_path = NULL;
+		ret = -ENOMEM;
+		goto err;
+	}
+	fd = open(w->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (-1 == fd) {
+		ret = -errno;
+		goto err;
+	}
+	w->file = fdopen(fd, "w");
+	if (NULL == w->file) {
+		ret = -errno;
+		close(fd);
+		goto err;
+	}
+
+	/* written for real once the table's offset is known */
+	memset(&header, 0, sizeof(header));
+	if (1 != fwrite(&header, sizeof(header), 1, w->file)) {
+		ret = -EIO;
+		goto err;
+	}
+	w->offset = sizeof(header);
+	*writer = w;
+
+	return 0;
+err:
+	df_index_writer_close(&w, 0);
+
+	return ret;
+}
+
+int df_index_writer_add(struct df_index_writer *writer, const char *path,
+		const struct timespec *since, const uint8_t *records,
+		size_t size)
+{
+	size_t capacity;
+	uint64_t *array;
+	struct dir_header dir;
+	static const uint8_t zeros[8];
+	uint64_t end;
+
+	if (strlen(path) >= PATH_MAX || size > UINT32_MAX)
+		return -EINVAL;
+
+	if (writer->count == writer->capacity) {
+		capacity = writer->capacity ? 2 * writer->capacity : 256;
+		array = realloc(writer->offsets, capacity * sizeof(*array));
+		if (NULL == array)
+			return -errno;
+		writer->offsets = array;
+		array = realloc(writer->hashes, capacity * sizeof(*array));
+		if (NULL == array)
+			return -errno;
+		writer->hashes = array;
+		writer->capacity = capacity;
+	}
+
+	memset(&dir, 0, sizeof(dir));
+	dir.hash = hash_path(path);
+	dir.since_sec = since->tv_sec;
+	dir.since_nsec = since->tv_nsec;
+	dir.path_len = strlen(path);
+	dir.size = size;
+	end = writer->offset + sizeof(dir) + dir.path_len + size;
+	if (1 != fwrite(&dir, sizeof(dir), 1, writer->file) ||
+			dir.path_len != fwrite(path, 1, dir.path_len,
+				writer->file) ||
+			size != fwrite(records, 1, size, writer->file) ||
+			padded(end) - end != fwrite(zeros, 1,
+				padded(end) - end, writer->file))
+		return -EIO;
+
+	writer->offsets[writer->count] = writer->offset;
+	writer->hashes[writer->count] = dir.hash;
+	writer->count++;
+	writer->offset = padded(end);
+
+	return 0;
+}
+
+/* writes the table and the header */
+static int write_table(struct df_index_writer *writer)
+{
+	size_t i;
+	size_t j;
+	uint64_t *table;
+	uint64_t slots = 16;
+	struct header header;
+	int ret = 0;
+
+	/* load factor of at most 1/2 */
+	while (slots < 2 * writer->count)
+		slots *= 2;
+	table = calloc(slots, sizeof(*table));
+	if (NULL == table)
+		return -errno;
+	for (i = 0; i < writer->count; i++) {
+		for (j = writer->hashes[i] & (slots - 1); 0 != table[j];
+				j = (j + 1) & (slots - 1))
+			;
+		table[j] = writer->offsets[i];
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DF_INDEX_MAGIC, sizeof(header.magic));
+	header.version = DF_INDEX_VERSION;
+	header.count = writer->count;
+	header.table = writer->offset;
+	header.mask = slots - 1;
+	if (slots != fwrite(table, sizeof(*table), slots, writer->file) ||
+			0 != fseek(writer->file, 0, SEEK_SET) ||
+			1 != fwrite(&header, sizeof(header), 1, writer->file) ||
+			0 != fflush(writer->file))
+		ret = -EIO;
+	free(table);
+
+	return ret;
+}
+
+int df_index_writer_close(struct df_index_writer **writer, int commit)
+{
+	int ret = 0;
+	struct df_index_writer *w;
+
+	if (NULL == writer || NULL == *writer)
+		return -EINVAL;
+	w = *writer;
+
+	if (commit)
+		ret = write_table(w);
+	if (NULL != w->file && 0 != fclose(w->file) && 0 == ret)
+		ret = -EIO;
+	if (commit && 0 == ret && -1 == rename(w->tmp_path, w->path))
+		ret = -errno;
+	if ((!commit || 0 > ret) && NULL != w->tmp_path)
+		unlink(w->tmp_path);
+
+	free(w->path);
+	free(w->tmp_path);
+	free(w->offsets);
+	free(w->hashes);
+	free(w);
+	*writer = NULL;
+
+	return ret;
+}
@@ -0,0 +1,62 @@
+#ifndef DF_INDEX_H
+#define DF_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * on disk index of directory listings, written by the host when it unmounts
+ * and mapped in memory when it mounts again, each listing being a chunk of
+ * df_scan records, see df_scan.h, found by the path of it's directory through
+ * an open addressing hash table, without the file being read entirely.
+ * Integers are in the host's byte order, the file is never exchanged.
+ */
+
+struct df_index;
+
+/**
+ * maps an index file
+ * @param index On output, the index, to be released with df_index_close
+ * @return 0 on success, errno-compatible negative value on error, -EINVAL if
+ * the file isn't an index, or was written by another version
+ */
+int df_index_open(struct df_index **index, const char *file);
+
+/**
+ * finds the listing of a directory
+ * @param records On output, the records, which stay valid until the index is
+ * closed
+ * @param since On output, the date the listing was up to date at
+ * @return 0 on success, -ENOENT if path isn't indexed, -EINVAL if the index
+ * is corrupted
+ */
+int df_index_find(struct df_index *index, const char *path,
+		const uint8_t **records, size_t *size, struct timespec *since);
+
+void df_index_close(struct df_index **index);
+
+struct df_index_writer;
+
+/**
+ * starts writing an index, in a temporary file, which replaces file only
+ * when the writer is closed with commit set
+ * @param writer On output, the writer, to be released with
+ * df_index_writer_close
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_index_writer_open(struct df_index_writer **writer, const char *file);
+
+/* adds the listing of a directory, see df_index_find */
+int df_index_writer_add(struct df_index_writer *writer, const char *path,
+		const struct timespec *since, const uint8_t *records,
+		size_t size);
+
+/**
+ * @param commit Non-zero to replace the file, zero to abandon the index
+ * @return 0 on success, errno-compatible negative value on error, in which
+ * case the file is left untouched
+ */
+int df_index_writer_close(struct df_index_writer **writer, int commit);
+
+#endif /* DF_INDEX_H */
@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <errno.h>
 #include <assert.h>
@@ -75,3 +76,25 @@ ssize_t df_write(int fd, void *buf, size_t count)
 
 	return written_so_far;
 }
+
+ssize_t df_splice(int fd_in, int fd_out, size_t count)
+{
+	size_t spliced_so_far = 0;
+	ssize_t spliced_this_time = 0;
+
+	while (spliced_so_far < count) {
+		spliced_this_time = TEMP_FAILURE_RETRY(splice(fd_in, NULL,
+					fd_out, NULL, count - spliced_so_far,
+					SPLICE_F_MOVE));
+		if (-1 == spliced_this_time)
+			return -errno;
+		if (0 == spliced_this_time)
+			return spliced_so_far;
+
+		spliced_so_far += spliced_this_time;
+	}
+
+	assert(spliced_so_far == count);
+
+	return spliced_so_far;
+}
@@ -3,5 +3,7 @@
 
 ssize_t df_read(int fd, void *buf, size_t count);
 ssize_t df_write(int fd, void *buf, size_t count);
+/* at least one of fd_in and fd_out must be a pipe */
+ssize_t df_splice(int fd_in, int fd_out, size_t count);
 
 #endif /* DF_IO_H */
@@ -0,0 +1,190 @@
+#ifndef DF_IOCTL_H
+#define DF_IOCTL_H
+
+/*
+ * control interface of a dfuse mount : ioctls issued on files or directories
+ * of the mount point, to make the device perform operations which can't be
+ * expressed efficiently with regular file system calls
+ */
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define DF_IOC_MAGIC 'D'
+
+/* maximum size of the paths passed, the whole argument must fit in 16KiB */
+#define DF_IOC_PATH_MAX 4096
+
+/**
+ * @struct df_ioc_copy_range
+ * @brief copies a range of a file to the file the ioctl is issued on, without
+ * the data leaving the device
+ */
+struct df_ioc_copy_range {
+	/** source path, relative to the root of the mount point */
+	char src[DF_IOC_PATH_MAX];
+	int64_t src_offset;
+	int64_t dst_offset;
+	/** bytes to copy, negative to copy up to the end of the source */
+	int64_t length;
+	/** out : bytes actually copied, less than length at end of source */
+	int64_t copied;
+};
+
+#define DF_IOC_COPY_RANGE _IOWR(DF_IOC_MAGIC, 1, struct df_ioc_copy_range)
+
+/* operations of DF_IOC_TREE, same values as enum df_tree_op */
+#define DF_IOC_TREE_REMOVE 0
+#define DF_IOC_TREE_CHMOD 1
+#define DF_IOC_TREE_CHOWN 2
+#define DF_IOC_TREE_MKDIR 3
+
+/* size of the error messages buffer of struct df_ioc_tree */
+#define DF_IOC_TREE_ERRORS_SIZE 8192
+
+/**
+ * @struct df_ioc_tree
+ * @brief applies an operation recursively on a tree of the device, in one
+ * request, the ioctl can be issued on any file or directory of the mount
+ */
+struct df_ioc_tree {
+	/** root of the tree, relative to the root of the mount point */
+	char path[DF_IOC_PATH_MAX];
+	/** one of the DF_IOC_TREE_* operations */
+	int32_t op;
+	/** mode for DF_IOC_TREE_CHMOD and DF_IOC_TREE_MKDIR */
+	uint32_t mode;
+	/** owner and group for DF_IOC_TREE_CHOWN, -1 not to change them */
+	int64_t uid;
+	int64_t gid;
+	/** out : number of entries processed successfully */
+	int64_t done;
+	/** out : number of entries on which the operation failed */
+	int64_t failed;
+	/** out : "path: error" lines for the first errors, nul-terminated */
+	char errors[DF_IOC_TREE_ERRORS_SIZE];
+};
+
+#define DF_IOC_TREE _IOWR(DF_IOC_MAGIC, 2, struct df_ioc_tree)
+
+/* hash algorithms of DF_IOC_CHECKSUM, same values as enum df_hash_algo */
+#define DF_IOC_HASH_XXH64 0
+#define DF_IOC_HASH_SHA256 1
+
+/* maximum number of digests returned by one DF_IOC_CHECKSUM */
+#define DF_IOC_CHECKSUM_MAX_BLOCKS 256
+
+/**
+ * @struct df_ioc_checksum
+ * @brief hashes blocks of a range of the file the ioctl is issued on, on the
+ * device, for only the digests to be transferred
+ */
+struct df_ioc_checksum {
+	int64_t offset;
+	/** size of the range, negative for up to the end of the file */
+	int64_t length;
+	/** size of the blocks, 0 for one digest of the whole range */
+	int64_t block_size;
+	/** one of the DF_IOC_HASH_* algorithms */
+	int32_t algo;
+	/** out : number of digests, at most DF_IOC_CHECKSUM_MAX_BLOCKS */
+	int32_t count;
+	/** out : size of the file */
+	int64_t size;
+	/** out : digests of the blocks, in their canonical representation */
+	uint8_t digests[DF_IOC_CHECKSUM_MAX_BLOCKS * 32];
+};
+
+#define DF_IOC_CHECKSUM _IOWR(DF_IOC_MAGIC, 3, struct df_ioc_checksum)
+
+/**
+ * @struct df_ioc_push
+ * @brief replaces a file of the device with a local file, transferring only
+ * the blocks which differ, the ioctl can be issued on any file or directory of
+ * the mount
+ */
+struct df_ioc_push {
+	/** absolute path of the local file */
+	char src[DF_IOC_PATH_MAX];
+	/** destination, relative to the root of the mount point */
+	char dst[DF_IOC_PATH_MAX];
+	/** out : size of the file */
+	int64_t size;
+	/** out : bytes sent as is */
+	int64_t literal;
+	/** out : bytes found on the device */
+	int64_t matched;
+};
+
+#define DF_IOC_PUSH _IOWR(DF_IOC_MAGIC, 4, struct df_ioc_push)
+
+/**
+ * @struct df_ioc_pull
+ * @brief copies a tree of the device into a local directory, streamed as an
+ * archive, the ioctl can be issued on any file or directory of the mount
+ */
+struct df_ioc_pull {
+	/** tree to copy, relative to the root of the mount point */
+	char src[DF_IOC_PATH_MAX];
+	/** absolute path of the local directory, which must exist */
+	char dst[DF_IOC_PATH_MAX];
+	/** out : number of entries created */
+	int64_t entries;
+	/** out : size of the archive transferred */
+	int64_t bytes;
+	/** out : number of entries which couldn't be read or created */
+	int64_t errors;
+};
+
+#define DF_IOC_PULL _IOWR(DF_IOC_MAGIC, 5, struct df_ioc_pull)
+
+/* kept small for the struct to fit in the 14 bits of an ioctl's size */
+#define DF_IOC_IMPORT_MESSAGES_SIZE 4096
+
+/**
+ * @struct df_ioc_import
+ * @brief copies a local tree into a directory of the device, streamed as an
+ * archive, the ioctl can be issued on any file or directory of the mount
+ */
+struct df_ioc_import {
+	/** absolute path of the local tree */
+	char src[DF_IOC_PATH_MAX];
+	/** directory, which must exist, relative to the root of the mount */
+	char dst[DF_IOC_PATH_MAX];
+	/** out : number of entries created */
+	int64_t entries;
+	/** out : size of the archive transferred */
+	int64_t bytes;
+	/** out : number of entries which couldn't be read or created */
+	int64_t errors;
+	/** out : "path: error" lines for the first device errors */
+	char messages[DF_IOC_IMPORT_MESSAGES_SIZE];
+};
+
+#define DF_IOC_IMPORT _IOWR(DF_IOC_MAGIC, 6, struct df_ioc_import)
+
+/* size of the records returned by one DF_IOC_SCAN, see df_scan.h */
+#define DF_IOC_SCAN_DATA_SIZE 8192
+
+/**
+ * @struct df_ioc_scan
+ * @brief reports the entries of the tree of the directory the ioctl is issued
+ * on, which changed, see df_scan_open, by chunks of records
+ */
+struct df_ioc_scan {
+	/** absolute path of a local file of DF_SCAN_ENTRY records, or "" */
+	char manifest[DF_IOC_PATH_MAX];
+	int64_t since_sec;
+	int64_t since_nsec;
+	/** in / out : -1 to start a scan, then as returned, -1 at it's end */
+	int64_t id;
+	/** out : number of entries which couldn't be scanned so far */
+	int64_t errors;
+	/** out : size of the records in data, which is decodable on it's own */
+	int64_t size;
+	uint8_t data[DF_IOC_SCAN_DATA_SIZE];
+};
+
+#define DF_IOC_SCAN _IOWR(DF_IOC_MAGIC, 7, struct df_ioc_scan)
+
+#endif /* DF_IOCTL_H */
@@ -0,0 +1,386 @@
+/**
+ * @file df_path_cache.c
+ *
+ * LRU cache of O_PATH directory fds, indexed by path, used by the device to
+ * perform the file system requests with *at() syscalls. The directories can
+ * be renamed or removed behind our back, by the apps of the device, so an fd
+ * is used only if the kernel still reports the path it had when it was opened.
+ * Checking it costs a readlink of /proc/self/fd though, so the directories and
+ * their ancestors are watched, and those watched are checked again only once
+ * something was renamed or removed, see df_path_cache_changed
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "df_path_cache.h"
+#include "df_watch.h"
+
+#ifndef O_PATH
+#define O_PATH 010000000
+#endif
+
+#define BUCKETS_NB (2 * DF_PATH_CACHE_SIZE)
+
+#define FREE(p) do { \
+	if (p) \
+		free(p); \
+	(p) = NULL; \
+} while (0) \
+
+static void char_array_free(char **array)
+{
+	FREE(*array);
+}
+
+struct entry {
+	/* path of the directory, without trailing slash, apart for "/" */
+	char *dir;
+	size_t len;
+	uint32_t hash;
+	int fd;
+	/*
+	 * non-zero if the directory and all it's ancestors are watched, for it
+	 * to be checked only if one of them may have been renamed or removed
+	 */
+	int watched;
+	/* value of changes when the entry was last checked */
+	unsigned long checked;
+	/* path of fd according to the kernel, symlinks resolved */
+	char *real;
+	/* next entry of the same bucket */
+	struct entry *next;
+	/* neighbours in the LRU list, lru.next being the least recently used */
+	struct entry *lru_prev;
+	struct entry *lru_next;
+};
+
+static struct entry *buckets[BUCKETS_NB];
+
+/* sentinel of the circular LRU list, lru.lru_prev is the most recently used */
+static struct entry lru = {
+	.lru_prev = &lru,
+	.lru_next = &lru,
+};
+
+static unsigned count;
+
+/* number of calls to df_path_cache_changed */
+static unsigned long changes;
+
+/* FNV-1a */
+static uint32_t hash_path(const char *path, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ (unsigned char)*path++) * 16777619U;
+
+	return hash;
+}
+
+static void lru_unlink(struct entry *e)
+{
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(struct entry *e)
+{
+	e->lru_prev = lru.lru_prev;
+	e->lru_next = &lru;
+	lru.lru_prev->lru_next = e;
+	lru.lru_prev = e;
+}
+
+static struct entry *lookup(const char *dir, size_t len)
+{
+	uint32_t hash = hash_path(dir, len);
+	struct entry *e;
+
+	for (e = buckets[hash % BUCKETS_NB]; NULL != e; e = e->next)
+		if (e->hash == hash && e->len == len &&
+				0 == memcmp(e->dir, dir, len))
+			return e;
+
+	return NULL;
+}
+
+/*
+ * @return the path of the file fd refers to, as maintained by the kernel
+ * through the renames of the file and of it's ancestors, to be freed, NULL on
+ * error
+ */
+static char *real_path(int fd)
+{
+	ssize_t ret;
+	char link[32];
+	char buf[PATH_MAX];
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	ret = readlink(link, buf, sizeof(buf));
+	if (-1 == ret)
+		return NULL;
+	if (sizeof(buf) == (size_t)ret) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	return strndup(buf, ret);
+}
+
+static void remove_entry(struct entry *e)
+{
+	struct entry **p;
+
+	for (p = buckets + e->hash % BUCKETS_NB; *p != e; p = &(*p)->next)
+		;
+	*p = e->next;
+	lru_unlink(e);
+	close(e->fd);
+	free(e->dir);
+	free(e->real);
+	free(e);
+	count--;
+}
+
+/*
+ * looks dir up, bumping it in the LRU list, it's entry being dropped if the
+ * directory was renamed or removed since it was opened, it's path having
+ * changed then, " (deleted)" being appended to it in the latter case
+ */
+static struct entry *lookup_valid(const char *dir, size_t len)
+{
+	struct entry *e = lookup(dir, len);
+	char __attribute__((cleanup(char_array_free))) *real = NULL;
+
+	if (NULL == e)
+		return NULL;
+	if (!e->watched || e->checked != changes) {
+		real = real_path(e->fd);
+		if (NULL == real || 0 != strcmp(real, e->real)) {
+			remove_entry(e);
+			return NULL;
+		}
+		e->checked = changes;
+	}
+	lru_unlink(e);
+	lru_push(e);
+
+	return e;
+}
+
+/* length of the path of the parent of the path of length len, "/" included */
+static size_t parent_len(const char *path, size_t len)
+{
+	while (len > 1 && path[len - 1] != '/')
+		len--;
+
+	return len > 1 ? len - 1 : len;
+}
+
+/*
+ * watches dir and it's ancestors, up to the first one cached and watched, all
+ * of whose ancestors are
+ * @return non-zero if they are all watched
+ */
+static int watch_ancestors(const char *dir, size_t len)
+{
+	struct entry *e;
+	char path[PATH_MAX];
+
+	if (len >= sizeof(path))
+		return 0;
+
+	for (;;) {
+		e = lookup(dir, len);
+		if (NULL != e && e->watched)
+			return 1;
+		snprintf(path, sizeof(path), "%.*s", (int)len, dir);
+		if (0 > df_watch_dir(path))
+			return 0;
+		if (1 == len)
+			return 1;
+		len = parent_len(dir, len);
+	}
+}
+
+static int insert(const char *dir, size_t len, int fd)
+{
+	struct entry *e;
+
+	if (DF_PATH_CACHE_SIZE == count)
+		remove_entry(lru.lru_next);
+
+	e = calloc(1, sizeof(*e));
+	if (NULL == e)
+		return -1;
+	e->dir = strndup(dir, len);
+	e->watched = watch_ancestors(dir, len);
+	e->checked = changes;
+	e->real = real_path(fd);
+	if (NULL == e->dir || NULL == e->real) {
+		free(e->dir);
+		free(e->real);
+		free(e);
+		return -1;
+	}
+	e->len = len;
+	e->hash = hash_path(dir, len);
+	e->fd = fd;
+	e->next = buckets[e->hash % BUCKETS_NB];
+	buckets[e->hash % BUCKETS_NB] = e;
+	lru_push(e);
+	count++;
+
+	return 0;
+}
+
+/*
+ * opens the directory dir, relatively to the deepest ancestor cached, caching
+ * it's parent on the way if cache_parent is non-zero, for it to serve as an
+ * ancestor for it's siblings
+ */
+static int open_dir(const char *dir, size_t len, int cache_parent)
+{
+	int fd;
+	int ancestor_fd = AT_FDCWD;
+	size_t ancestor_len = len;
+	size_t plen;
+	struct entry *e = NULL;
+	char __attribute__((cleanup(char_array_free))) *rel = NULL;
+
+	while (ancestor_len > 1) {
+		ancestor_len = parent_len(dir, ancestor_len);
+		e = lookup_valid(dir, ancestor_len);
+		if (NULL != e)
+			break;
+	}
+	if (NULL != e)
+		ancestor_fd = e->fd;
+	else
+		ancestor_len = 0;
+
+	/* cache the parent too, if it isn't the ancestor already */
+	plen = parent_len(dir, len);
+	if (cache_parent && plen > ancestor_len && plen < len) {
+		fd = open_dir(dir, plen, 0);
+		if (0 > fd)
+			return fd;
+		ancestor_fd = fd;
+		ancestor_len = plen;
+	}
+
+	/* skip the ancestor's path and the slash following it */
+	rel = strndup(dir + ancestor_len, len - ancestor_len);
+	if (NULL == rel)
+		return -1;
+	fd = openat(ancestor_fd, *rel == '/' && ancestor_len ? rel + 1 : rel,
+			O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (-1 == fd)
+		return -1;
+	if (-1 == insert(dir, len, fd)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int df_path_resolve(struct df_path *at, const char *path)
+{
+	const char *slash;
+	size_t len;
+	struct entry *e;
+
+	if (NULL == at || NULL == path || '/' != *path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	slash = strrchr(path, '/');
+	len = slash == path ? 1 : (size_t)(slash - path);
+	at->path = path;
+	at->name = '\0' == slash[1] ? "." : slash + 1;
+
+	e = lookup_valid(path, len);
+	at->cached = NULL != e;
+	if (at->cached) {
+		at->dirfd = e->fd;
+		return 0;
+	}
+
+	at->dirfd = open_dir(path, len, 1);
+
+	return 0 > at->dirfd ? -1 : 0;
+}
+
+/* non-zero if the directory has been removed since it's fd was cached */
+static int is_removed(struct entry *e)
+{
+	struct stat st;
+
+	return -1 == fstat(e->fd, &st) || 0 == st.st_nlink;
+}
+
+int df_path_stale(struct df_path *at, int ret)
+{
+	const char *slash;
+	size_t len;
+	struct entry *e;
+
+	if (-1 != ret || ENOENT != errno || !at->cached)
+		return 0;
+
+	slash = strrchr(at->path, '/');
+	len = slash == at->path ? 1 : (size_t)(slash - at->path);
+	e = lookup(at->path, len);
+	if (NULL == e || !is_removed(e))
+		return 0;
+
+	/* drop the removed ancestors too, not to resolve the retry from them */
+	for (;;) {
+		remove_entry(e);
+		if (1 == len)
+			break;
+		len = parent_len(at->path, len);
+		e = lookup(at->path, len);
+		if (NULL == e || !is_removed(e))
+			break;
+	}
+	errno = ENOENT;
+
+	return 1;
+}
+
+void df_path_invalidate(const char *path)
+{
+	size_t len = strlen(path);
+	struct entry *e;
+	struct entry *next;
+
+	for (e = lru.lru_next; e != &lru; e = next) {
+		next = e->lru_next;
+		if (0 == strncmp(e->dir, path, len) &&
+				('\0' == e->dir[len] || '/' == e->dir[len] ||
+				 1 == len))
+			remove_entry(e);
+	}
+}
+
+void df_path_cache_changed(void)
+{
+	changes++;
+}
+
+void df_path_cache_cleanup(void)
+{
+	while (lru.lru_next != &lru)
+		remove_entry(lru.lru_next);
+}
@@ -0,0 +1,78 @@
+#ifndef DF_PATH_CACHE_H
+#define DF_PATH_CACHE_H
+
+/* maximum number of directory fds kept open by the cache */
+#define DF_PATH_CACHE_SIZE 64
+
+/**
+ * @struct df_path
+ * @brief result of the resolution of a path, to be used by *at() syscalls
+ */
+struct df_path {
+	/** path resolved */
+	const char *path;
+	/** O_PATH fd of the parent directory, owned by the cache */
+	int dirfd;
+	/** last component of path, relative to dirfd */
+	const char *name;
+	/** non-zero if dirfd was already in the cache */
+	int cached;
+};
+
+/**
+ * resolves the parent directory of an absolute path to a cached O_PATH fd,
+ * opened if needed relatively to the deepest ancestor already cached, so that
+ * the kernel doesn't walk the whole path for each request. The fds of the
+ * directories renamed or removed since they were cached aren't used
+ * @param at Filled with the fd and the name to pass to *at() syscalls, dirfd
+ * stays valid until the next call to a df_path_* function
+ * @param path Absolute path to resolve
+ * @return 0 on success, -1 on error, with errno set
+ */
+int df_path_resolve(struct df_path *at, const char *path);
+
+/**
+ * to be called after the *at() syscall made with a resolved path, if it
+ * failed with ENOENT because the cached directory has been removed, and maybe
+ * replaced, since it has been opened, it's cache entry is dropped, along with
+ * those of it's removed ancestors
+ * @param ret Return value of the *at() syscall
+ * @return non-zero if the syscall is worth retrying after a new resolution
+ */
+int df_path_stale(struct df_path *at, int ret);
+
+/**
+ * drops the cached fds of path and of all the directories under it, for them
+ * to be closed
+ */
+void df_path_invalidate(const char *path);
+
+/**
+ * to be called when a directory watched may have been renamed or removed, on
+ * a DF_NOTIFY_REMOVE, the fds cached being checked again before their next
+ * use. On a DF_NOTIFY_OVERFLOW, the watches of their ancestors may be gone,
+ * they have to be dropped with df_path_invalidate("/") instead
+ */
+void df_path_cache_changed(void);
+
+/* closes all the fds cached */
+void df_path_cache_cleanup(void);
+
+/**
+ * evaluates expr, a *at() syscall using at->dirfd and at->name, resolved from
+ * path, evaluating it once more with a freshly opened directory fd if it
+ * failed because the cached one was stale
+ * @return expr's value, or -1 with errno set if path can't be resolved
+ */
+#define DF_PATH_AT(at, in_path, expr) ({ \
+	int __ret = df_path_resolve((at), (in_path)); \
+	if (0 == __ret) { \
+		__ret = (expr); \
+		if (df_path_stale((at), __ret)) \
+			__ret = 0 == df_path_resolve((at), (in_path)) ? \
+					(expr) : -1; \
+	} \
+	__ret; \
+})
+
+#endif /* DF_PATH_CACHE_H */
@@ -5,6 +5,10 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 #include <fuse.h>
 
@@ -28,6 +32,8 @@ static void char_array_free(char **array)
 static const char * const op_to_str[] = {
 	[DF_OP_INVALID]     = "DF_OP_INVALID",
 	[DF_OP_READDIR]     = "DF_OP_READDIR",
+	[DF_OP_OPENDIR]     = "DF_OP_OPENDIR",
+	[DF_OP_RELEASEDIR]  = "DF_OP_RELEASEDIR",
 
 	[DF_OP_GETATTR]     = "DF_OP_GETATTR",
 	[DF_OP_READLINK]    = "DF_OP_READLINK",
@@ -57,6 +63,28 @@ static const char * const op_to_str[] = {
 	[DF_OP_LISTXATTR]   = "DF_OP_LISTXATTR",
 	[DF_OP_REMOVEXATTR] = "DF_OP_REMOVEXATTR",
 
+	[DF_OP_COPY_RANGE]  = "DF_OP_COPY_RANGE",
+	[DF_OP_TREE]        = "DF_OP_TREE",
+	[DF_OP_CHECKSUM]    = "DF_OP_CHECKSUM",
+	[DF_OP_DELTA_BEGIN] = "DF_OP_DELTA_BEGIN",
+	[DF_OP_DELTA_APPLY] = "DF_OP_DELTA_APPLY",
+	[DF_OP_DELTA_COMMIT] = "DF_OP_DELTA_COMMIT",
+	[DF_OP_EXPORT_BEGIN] = "DF_OP_EXPORT_BEGIN",
+	[DF_OP_EXPORT_READ] = "DF_OP_EXPORT_READ",
+	[DF_OP_EXPORT_END] = "DF_OP_EXPORT_END",
+	[DF_OP_IMPORT_BEGIN] = "DF_OP_IMPORT_BEGIN",
+	[DF_OP_IMPORT_WRITE] = "DF_OP_IMPORT_WRITE",
+	[DF_OP_IMPORT_END] = "DF_OP_IMPORT_END",
+	[DF_OP_SCAN_BEGIN] = "DF_OP_SCAN_BEGIN",
+	[DF_OP_SCAN_READ] = "DF_OP_SCAN_READ",
+	[DF_OP_SCAN_END] = "DF_OP_SCAN_END",
+	[DF_OP_NOTIFY] = "DF_OP_NOTIFY",
+	[DF_OP_GETATTR_MANY] = "DF_OP_GETATTR_MANY",
+	[DF_OP_WRITE_UNSTABLE] = "DF_OP_WRITE_UNSTABLE",
+	[DF_OP_COMMIT] = "DF_OP_COMMIT",
+	[DF_OP_WINDOW] = "DF_OP_WINDOW",
+	[DF_OP_CANCEL] = "DF_OP_CANCEL",
+
 	[DF_OP_QUIT]        = "DF_OP_QUIT",
 };
 
@@ -71,8 +99,25 @@ static const char const *type_to_str[] = {
 	[DF_DATA_STAT]           = "DF_DATA_STAT",
 	[DF_DATA_STATVFS]        = "DF_DATA_STATVFS",
 	[DF_DATA_TIMESPEC]       = "DF_DATA_TIMESPEC",
+	[DF_DATA_PATH]           = "DF_DATA_PATH",
+};
+
+/* directory part of a path, stored in a slot of a dictionary */
+struct path_prefix {
+	char *prefix;
+	size_t len;
 };
 
+/*
+ * dictionaries of the prefixes of the paths sent and received, the process
+ * having only one connection, see DF_PATH_DICT_SIZE
+ */
+static struct path_prefix out_prefixes[DF_PATH_DICT_SIZE];
+static struct path_prefix in_prefixes[DF_PATH_DICT_SIZE];
+
+/* shorter prefixes aren't worth a slot, the slot's number costing 8 bytes */
+#define PATH_PREFIX_MIN 16
+
 static void dump_header(struct df_packet_header *header, int in)
 {
 	char *direction = in ? "received" : "sent";
@@ -168,12 +213,11 @@ int df_read_handshake(int fd, uint32_t *prot_version)
 /* converts back a header from big endian to host order */
 static void unmarshall_header(struct df_packet_header *header)
 {
-	header->payload_size = be16toh(header->payload_size);
+	header->payload_size = be32toh(header->payload_size);
 	if (header->is_host_packet)
 		header->error = be16toh(header->error);
 }
 
-/* reads a message header */
 static int read_header(int fd, struct df_packet_header *header)
 {
 	ssize_t ret;
@@ -181,6 +225,9 @@ static int read_header(int fd, struct df_packet_header *header)
 	ret = df_read(fd, header, sizeof(*header));
 	if (0 > ret)
 		return ret;
+	/* peer has closed the connection */
+	if (0 == ret)
+		return -EPIPE;
 
 	unmarshall_header(header);
 
@@ -197,6 +244,147 @@ static int read_payload(int fd, struct df_packet_header *header, char **payload)
 	return df_read(fd, *payload, header->payload_size);
 }
 
+static df_notify_handler_t notify_handler;
+
+void df_set_notify_handler(df_notify_handler_t handler)
+{
+	notify_handler = handler;
+}
+
+/* reads the payload of a notification and passes it to the handler */
+static int handle_notification(int fd, struct df_packet_header *header)
+{
+	int ret;
+	char __attribute__ ((cleanup(char_array_free)))*payload = NULL;
+
+	ret = read_payload(fd, header, &payload);
+	if (0 > ret)
+		return ret;
+	if (dbg) {
+		dump_header(header, 1);
+		dump_payload(payload, header->payload_size, 1);
+	}
+	notify_handler(payload, header->payload_size);
+
+	return 0;
+}
+
+int df_read_notifications(int fd)
+{
+	int ret;
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	struct df_packet_header header;
+
+	while (1 == poll(&pfd, 1, 0)) {
+		if (!(pfd.revents & POLLIN))
+			return -EPIPE;
+		ret = read_header(fd, &header);
+		if (0 > ret)
+			return ret;
+		if (DF_OP_NOTIFY != header.op_code || NULL == notify_handler)
+			return -EPROTO;
+		ret = handle_notification(fd, &header);
+		if (0 > ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static df_interrupt_handler_t interrupt_handler;
+static int interrupt_signum;
+
+void df_set_interrupt_handler(df_interrupt_handler_t handler, int signum)
+{
+	interrupt_handler = handler;
+	interrupt_signum = signum;
+}
+
+static int send_cancel(int fd)
+{
+	int ret;
+	struct df_packet_header header;
+	char __attribute__ ((cleanup(char_array_free)))*payload = NULL;
+
+	ret = df_request_build(&header, &payload, DF_OP_CANCEL,
+			DF_DATA_END);
+	if (0 > ret)
+		return ret;
+
+	return df_write_message(fd, &header, payload);
+}
+
+/*
+ * waits for fd to be readable, with interrupt_signum unblocked, for the
+ * interrupt handler to be able to cancel the request
+ */
+static int wait_readable(int fd)
+{
+	int ret;
+	int cancelled = 0;
+	sigset_t mask;
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+
+	pthread_sigmask(SIG_SETMASK, NULL, &mask);
+	sigdelset(&mask, interrupt_signum);
+	for (;;) {
+		ret = ppoll(&pfd, 1, NULL, &mask);
+		if (1 == ret)
+			return 0;
+		if (-1 == ret && EINTR != errno)
+			return -errno;
+		if (cancelled || !interrupt_handler())
+			continue;
+		ret = send_cancel(fd);
+		if (0 > ret)
+			return ret;
+		cancelled = 1;
+	}
+}
+
+int df_cancel_pending(int fd)
+{
+	ssize_t ret;
+	struct df_packet_header header;
+	char __attribute__ ((cleanup(char_array_free)))*payload = NULL;
+
+	ret = recv(fd, &header, sizeof(header), MSG_PEEK | MSG_DONTWAIT);
+	if (sizeof(header) != ret)
+		return 0;
+	unmarshall_header(&header);
+	if (DF_OP_CANCEL != header.op_code)
+		return 0;
+
+	return 0 == df_read_message(fd, &header, &payload);
+}
+
+int df_read_header(int fd, struct df_packet_header *header)
+{
+	int ret;
+
+	for (;;) {
+		if (NULL != interrupt_handler) {
+			ret = wait_readable(fd);
+			if (0 > ret)
+				return ret;
+		}
+		ret = read_header(fd, header);
+		if (0 > ret)
+			return ret;
+		if (DF_OP_NOTIFY != header->op_code || NULL == notify_handler)
+			return 0;
+		ret = handle_notification(fd, header);
+		if (0 > ret)
+			return ret;
+	}
+}
+
 int df_read_message(int fd, struct df_packet_header *header, char **payload)
 {
 	int ret;
@@ -204,7 +392,7 @@ int df_read_message(int fd, struct df_packet_header *header, char **payload)
 	if (NULL == header || NULL == payload || NULL != *payload)
 		return -EINVAL;
 
-	ret = read_header(fd, header);
+	ret = df_read_header(fd, header);
 	if (0 > ret)
 		return ret;
 
@@ -220,13 +408,19 @@ int df_read_message(int fd, struct df_packet_header *header, char **payload)
 	return 0;
 }
 
-/* reallocates space to append new data to the payload */
-static int adjust_payload(char **payload, size_t *size, size_t data_size)
+/*
+ * reallocates space to append new data to the payload, if capacity is not zero,
+ * the payload is a preallocated buffer of this size, which is never reallocated
+ */
+static int adjust_payload(char **payload, size_t *size, size_t capacity,
+		size_t data_size)
 {
 	size_t new_size;
 	char *new_payload;
 
 	new_size = *size + data_size;
+	if (0 != capacity)
+		return new_size > capacity ? -ENOSPC : 0;
 	new_payload = realloc(*payload, new_size);
 	if (NULL == new_payload)
 		return -errno;
@@ -236,12 +430,12 @@ static int adjust_payload(char **payload, size_t *size, size_t data_size)
 }
 
 /* adjusts the size of the payload and appends the data at it's end */
-static int append_data(char **payload, size_t *size, void *marshalled_data,
-		size_t marshalled_data_size)
+static int append_data(char **payload, size_t *size, size_t capacity,
+		void *marshalled_data, size_t marshalled_data_size)
 {
 	int ret;
 
-	ret = adjust_payload(payload, size, marshalled_data_size);
+	ret = adjust_payload(payload, size, capacity, marshalled_data_size);
 	if (0 > ret)
 		return ret;
 
@@ -253,48 +447,53 @@ static int append_data(char **payload, size_t *size, void *marshalled_data,
 
 /* marshalls a ffi struct and append it to the payload resized to contain it */
 static int append_fuse_file_info(char **payload, size_t *size,
-		struct fuse_file_info *data)
+		size_t capacity, struct fuse_file_info *data)
 {
 	int64_t marshalled_ffi[MARSHALLED_FFI_FIELDS];
 
 	marshall_fuse_file_info(data, marshalled_ffi);
 
-	return append_data(payload, size, marshalled_ffi, MARSHALLED_FFI_SIZE);
+	return append_data(payload, size, capacity, marshalled_ffi,
+			MARSHALLED_FFI_SIZE);
 }
 
-static int append_int(char **payload, size_t *size, int64_t data)
+static int append_int(char **payload, size_t *size, size_t capacity,
+		int64_t data)
 {
 	data = htobe64(data);
 
-	return append_data(payload, size, &data, sizeof(data));
+	return append_data(payload, size, capacity, &data, sizeof(data));
 }
 
-static int append_stat(char **payload, size_t *size, struct stat *data)
+static int append_stat(char **payload, size_t *size, size_t capacity,
+		struct stat *data)
 {
 	int64_t marshalled_stat[MARSHALLED_STAT_FIELDS];
 
 	marshall_stat(data, marshalled_stat);
 
-	return append_data(payload, size, marshalled_stat,
+	return append_data(payload, size, capacity, marshalled_stat,
 			MARSHALLED_STAT_SIZE);
 }
-static int append_statvfs(char **payload, size_t *size, struct statvfs *data)
+static int append_statvfs(char **payload, size_t *size, size_t capacity,
+		struct statvfs *data)
 {
 	int64_t marshalled_statvfs[MARSHALLED_STATVFS_FIELDS];
 
 	marshall_statvfs(data, marshalled_statvfs);
 
-	return append_data(payload, size, marshalled_statvfs,
+	return append_data(payload, size, capacity, marshalled_statvfs,
 			MARSHALLED_STATVFS_SIZE);
 }
 
-static int append_timespec(char **payload, size_t *size, struct timespec *data)
+static int append_timespec(char **payload, size_t *size, size_t capacity,
+		struct timespec *data)
 {
 	int64_t marshalled_timespec[MARSHALLED_TIMESPEC_FIELDS];
 
 	marshall_timespec(data, marshalled_timespec);
 
-	return append_data(payload, size, marshalled_timespec,
+	return append_data(payload, size, capacity, marshalled_timespec,
 			MARSHALLED_TIMESPEC_SIZE);
 }
 
@@ -345,12 +544,15 @@ static int pop_data_type(char *payload, size_t *offset, size_t size,
 static int pop_buffer(char *payload, size_t *offset, size_t size,
 		void **buffer_data, int64_t buffer_size)
 {
-	if (NULL == buffer_data || NULL != *buffer_data)
+	if (NULL == buffer_data || NULL != *buffer_data || 0 > buffer_size)
 		return -EINVAL;
 
-	*buffer_data = malloc(buffer_size);
-	if (NULL == buffer_data)
+	/* empty buffers are valid, e.g. an empty list of digests */
+	*buffer_data = malloc(buffer_size ? buffer_size : 1);
+	if (NULL == *buffer_data)
 		return -errno;
+	if (0 == buffer_size)
+		return 0;
 
 	return pop_data(payload, offset, size, *buffer_data, buffer_size);
 }
@@ -431,6 +633,150 @@ static int pop_timespec(char *payload, size_t *offset, size_t size,
 	return 0;
 }
 
+/* @return the length of path's directory part, up to it's last '/' */
+static size_t path_prefix_len(const char *path, size_t len)
+{
+	const char *slash = memrchr(path, '/', len);
+
+	return NULL == slash ? 0 : slash - path + 1;
+}
+
+/* FNV-1a */
+static size_t path_prefix_slot(const char *prefix, size_t len)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	while (len--) {
+		hash ^= (uint8_t)*prefix++;
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash & (DF_PATH_DICT_SIZE - 1);
+}
+
+static int set_prefix(struct path_prefix *slot, const char *prefix, size_t len)
+{
+	char *copy;
+
+	copy = malloc(len + 1);
+	if (NULL == copy)
+		return -errno;
+	memcpy(copy, prefix, len);
+	copy[len] = '\0';
+	free(slot->prefix);
+	slot->prefix = copy;
+	slot->len = len;
+
+	return 0;
+}
+
+/*
+ * called when a message which may have defined slots isn't sent, the next
+ * paths using the slots forgotten defining them again
+ */
+static void forget_out_prefixes(void)
+{
+	size_t i;
+
+	for (i = 0; i < DF_PATH_DICT_SIZE; i++) {
+		FREE(out_prefixes[i].prefix);
+		out_prefixes[i].len = 0;
+	}
+}
+
+/*
+ * the prefix's slot is determined by it's hash, a prefix evicts the one which
+ * was in it's slot, by defining it again
+ * @param defined Set to 1 if a slot was defined
+ */
+static int append_path(char **payload, size_t *size, size_t capacity,
+		const char *path, int *defined)
+{
+	int ret;
+	int64_t ref = -1;
+	size_t len = strlen(path) + 1;
+	size_t prefix_len = path_prefix_len(path, len);
+	struct path_prefix *slot;
+
+	if (prefix_len >= PATH_PREFIX_MIN) {
+		ref = path_prefix_slot(path, prefix_len);
+		slot = out_prefixes + ref;
+		if (slot->len == prefix_len &&
+				0 == memcmp(slot->prefix, path, prefix_len)) {
+			path += prefix_len;
+			len -= prefix_len;
+		} else {
+			ret = set_prefix(slot, path, prefix_len);
+			if (0 > ret)
+				return ret;
+			ref |= DF_PATH_DEFINE;
+			*defined = 1;
+		}
+	}
+
+	ret = append_int(payload, size, capacity, ref);
+	if (0 > ret)
+		return ret;
+	ret = append_int(payload, size, capacity, len);
+	if (0 > ret)
+		return ret;
+
+	return append_data(payload, size, capacity, (void *)path, len);
+}
+
+/* @param path_len On output, length of the path, it's final '\0' included */
+static int pop_path(char *payload, size_t *offset, size_t size,
+		int64_t *path_len, char **path)
+{
+	int ret;
+	int64_t ref;
+	int64_t len;
+	const char *data;
+	const struct path_prefix *prefix = NULL;
+	size_t prefix_len = 0;
+
+	if (NULL == path_len || NULL == path || NULL != *path)
+		return -EINVAL;
+	ret = pop_int(payload, offset, size, &ref);
+	if (0 > ret)
+		return ret;
+	ret = pop_int(payload, offset, size, &len);
+	if (0 > ret)
+		return ret;
+	data = payload + *offset;
+	if (0 >= len || (uint64_t)len > size - *offset ||
+			'\0' != data[len - 1])
+		return -EINVAL;
+
+	if (-1 != ref) {
+		if (0 > ref || (ref & ~DF_PATH_DEFINE) >= DF_PATH_DICT_SIZE)
+			return -EINVAL;
+		if (ref & DF_PATH_DEFINE) {
+			ret = set_prefix(in_prefixes +
+					(ref & ~DF_PATH_DEFINE), data,
+					path_prefix_len(data, len));
+			if (0 > ret)
+				return ret;
+		} else {
+			prefix = in_prefixes + ref;
+			if (NULL == prefix->prefix)
+				return -EINVAL;
+			prefix_len = prefix->len;
+		}
+	}
+
+	*path = malloc(prefix_len + len);
+	if (NULL == *path)
+		return -errno;
+	if (NULL != prefix)
+		memcpy(*path, prefix->prefix, prefix_len);
+	memcpy(*path + prefix_len, data, len);
+	*path_len = prefix_len + len;
+	*offset += len;
+
+	return 0;
+}
+
 int df_parse_payload(char *payload, size_t *offset, size_t size, ...)
 {
 	int ret = 0;
@@ -473,7 +819,9 @@ int df_vparse_payload(char *payload, size_t *offset, size_t size, va_list args)
 			fprintf(stderr, "Parsed %s\n",
 					df_data_type_to_str(data_type));
 
-		if (data_type != requested_data_type)
+		if (data_type != requested_data_type &&
+				(DF_DATA_PATH != requested_data_type ||
+				 DF_DATA_BUFFER != data_type))
 			return -EINVAL;
 
 		switch (data_type) {
@@ -516,6 +864,13 @@ int df_vparse_payload(char *payload, size_t *offset, size_t size, va_list args)
 					timespec_data);
 			break;
 
+		case DF_DATA_PATH:
+			POP_DATA_POINTER(int_data);
+			POP_DATA_POINTER(buffer_data);
+			ret = pop_path(payload, offset, size, int_data,
+					(char **)buffer_data);
+			break;
+
 		case DF_DATA_END:
 			loop = 0;
 			break;
@@ -542,7 +897,8 @@ int df_build_payload(char **payload, size_t *size, ...)
 	return ret;
 }
 
-int df_vbuild_payload(char **payload, size_t *size, va_list args)
+static int vbuild_payload(char **payload, size_t *size, size_t capacity,
+		va_list args)
 {
 	enum df_data_type data_type;
 	int loop = 1;
@@ -556,6 +912,8 @@ int df_vbuild_payload(char **payload, size_t *size, va_list args)
 	struct stat *stat_data;
 	struct statvfs *statvfs_data;
 	struct timespec *timespec_data;
+	const char *path_data;
+	int defined = 0;
 
 	if (NULL == payload || NULL == size)
 		return -EINVAL;
@@ -566,7 +924,7 @@ int df_vbuild_payload(char **payload, size_t *size, va_list args)
 			break;
 
 		/* prefix each datum by it's type */
-		ret = append_int(payload, size, data_type);
+		ret = append_int(payload, size, capacity, data_type);
 		if (0 > ret)
 			break;
 		if (dbg)
@@ -578,36 +936,45 @@ int df_vbuild_payload(char **payload, size_t *size, va_list args)
 			buffer_size = va_arg(args, size_t);
 			buffer_data = va_arg(args, void *);
 			int_data = buffer_size;
-			ret = append_int(payload, size, int_data);
+			ret = append_int(payload, size, capacity, int_data);
 			if (0 > ret)
-				return ret;
-			ret = append_data(payload, size, buffer_data,
+				break;
+			ret = append_data(payload, size, capacity, buffer_data,
 					buffer_size);
 			break;
 
 		case DF_DATA_FUSE_FILE_INFO:
 			ffi_data = va_arg(args, struct fuse_file_info *);
-			ret = append_fuse_file_info(payload, size, ffi_data);
+			ret = append_fuse_file_info(payload, size, capacity,
+					ffi_data);
 			break;
 
 		case DF_DATA_INT:
 			int_data = va_arg(args, int64_t);
-			ret = append_int(payload, size, int_data);
+			ret = append_int(payload, size, capacity, int_data);
 			break;
 
 		case DF_DATA_STAT:
 			stat_data = va_arg(args, struct stat *);
-			ret = append_stat(payload, size, stat_data);
+			ret = append_stat(payload, size, capacity, stat_data);
 			break;
 
 		case DF_DATA_STATVFS:
 			statvfs_data = va_arg(args, struct statvfs *);
-			ret = append_statvfs(payload, size, statvfs_data);
+			ret = append_statvfs(payload, size, capacity,
+					statvfs_data);
 			break;
 
 		case DF_DATA_TIMESPEC:
 			timespec_data = va_arg(args, struct timespec *);
-			ret = append_timespec(payload, size, timespec_data);
+			ret = append_timespec(payload, size, capacity,
+					timespec_data);
+			break;
+
+		case DF_DATA_PATH:
+			path_data = va_arg(args, const char *);
+			ret = append_path(payload, size, capacity, path_data,
+					&defined);
 			break;
 
 		case DF_DATA_END:
@@ -619,18 +986,141 @@ int df_vbuild_payload(char **payload, size_t *size, va_list args)
 			break;
 		}
 	} while (loop && 0 == ret);
+	if (0 > ret && defined)
+		forget_out_prefixes();
 
 	return ret;
 }
 
+int df_vbuild_payload(char **payload, size_t *size, va_list args)
+{
+	return vbuild_payload(payload, size, 0, args);
+}
+
+int df_build_payload_fixed(char *payload, size_t capacity, size_t *size, ...)
+{
+	int ret;
+	size_t initial_size;
+	va_list args;
+
+	if (NULL == payload || NULL == size || 0 == capacity)
+		return -EINVAL;
+
+	initial_size = *size;
+	va_start(args, size);
+	ret = vbuild_payload(&payload, size, capacity, args);
+	va_end(args);
+	/* don't leave a partially built datum behind */
+	if (0 > ret)
+		*size = initial_size;
+
+	return ret;
+}
+
+int df_build_buffer_prefix(char **payload, size_t *size, size_t buffer_size)
+{
+	int ret;
+
+	if (NULL == payload || NULL == size)
+		return -EINVAL;
+
+	ret = append_int(payload, size, 0, DF_DATA_BUFFER);
+	if (0 > ret)
+		return ret;
+
+	return append_int(payload, size, 0, buffer_size);
+}
+
+int df_parse_buffer_prefix(char *payload, size_t *offset, size_t size,
+		int64_t *buffer_size)
+{
+	int ret;
+	enum df_data_type data_type;
+
+	if (NULL == payload || NULL == offset || NULL == buffer_size)
+		return -EINVAL;
+
+	ret = pop_data_type(payload, offset, size, &data_type);
+	if (0 > ret)
+		return ret;
+	if (DF_DATA_BUFFER != data_type)
+		return -EINVAL;
+
+	ret = pop_int(payload, offset, size, buffer_size);
+	if (0 > ret)
+		return ret;
+
+	return 0 > *buffer_size ? -EINVAL : 0;
+}
+
 /* converts a header from host order to big endian */
 static void marshall_header(struct df_packet_header *header)
 {
-	header->payload_size = htobe16(header->payload_size);
+	header->payload_size = htobe32(header->payload_size);
 	if (header->is_host_packet)
 		header->error = htobe16(header->error);
 }
 
+int df_write_header(int fd, struct df_packet_header *header)
+{
+	ssize_t ret;
+
+	if (0 > fd || NULL == header)
+		return -EINVAL;
+
+	marshall_header(header);
+	ret = df_write(fd, header, sizeof(*header));
+	unmarshall_header(header);
+	if (0 > ret)
+		return ret;
+
+	if (dbg)
+		dump_header(header, 0);
+
+	return 0;
+}
+
+int df_write_data(int fd, const void *data, size_t size)
+{
+	ssize_t ret;
+
+	ret = df_write(fd, (void *)data, size);
+	if (0 > ret)
+		return ret;
+
+	if (dbg)
+		dump_payload(data, size, 0);
+
+	return 0;
+}
+
+int df_read_data(int fd, void *data, size_t size)
+{
+	ssize_t ret;
+
+	ret = df_read(fd, data, size);
+	if (0 > ret)
+		return ret;
+	if ((size_t)ret != size)
+		return -EPIPE;
+
+	if (dbg)
+		dump_payload(data, size, 1);
+
+	return 0;
+}
+
+int df_splice_data(int fd_in, int fd_out, size_t size)
+{
+	ssize_t ret;
+
+	ret = df_splice(fd_in, fd_out, size);
+	if (0 > ret)
+		return ret;
+
+	return (size_t)ret == size ? 0 : -EPIPE;
+}
+
 /* write an entire message, header + payload */
 int df_write_message(int fd, struct df_packet_header *header, char *payload)
 {
@@ -3,14 +3,19 @@
 
 #define DF_HEADER_SIZE 8
 
-#define DF_PROTOCOL_VERSION 1U
+/* marshalled sizes of some data types, type prefix included */
+#define DF_INT_MARSHALLED_SIZE (2 * sizeof(int64_t))
+#define DF_END_MARSHALLED_SIZE (sizeof(int64_t))
+
+#define DF_PROTOCOL_VERSION 19U
 
 /* list of the options supported */
 enum df_op {
 	DF_OP_INVALID = 0,
 	DF_OP_READDIR,
+	DF_OP_OPENDIR,
+	DF_OP_RELEASEDIR,
 
-	/* TODO add support for closedir/opendir in a second step*/
 	DF_OP_GETATTR,
 	DF_OP_READLINK,
 	DF_OP_MKDIR,
@@ -39,9 +44,93 @@ enum df_op {
 	DF_OP_LISTXATTR,
 	DF_OP_REMOVEXATTR,
 
+	DF_OP_COPY_RANGE, /**< copy between two files, done by the device */
+	DF_OP_TREE, /**< recursive operation, done by the device */
+	DF_OP_CHECKSUM, /**< digests of the blocks of a range of a file */
+	DF_OP_DELTA_BEGIN, /**< start rebuilding a file from a delta */
+	DF_OP_DELTA_APPLY, /**< apply a chunk of a delta */
+	DF_OP_DELTA_COMMIT, /**< replace the file with the rebuilt one */
+	DF_OP_EXPORT_BEGIN, /**< start archiving a tree */
+	DF_OP_EXPORT_READ, /**< read the next chunk of an archive */
+	DF_OP_EXPORT_END, /**< release an archive */
+	DF_OP_IMPORT_BEGIN, /**< start extracting an archive */
+	DF_OP_IMPORT_WRITE, /**< extract the next chunk of an archive */
+	DF_OP_IMPORT_END, /**< finish an extraction and report errors */
+	DF_OP_SCAN_BEGIN, /**< start looking for the changes in a tree */
+	DF_OP_SCAN_READ, /**< read the next changes found */
+	DF_OP_SCAN_END, /**< release a scan */
+	DF_OP_NOTIFY, /**< change on the device, sent unsolicited */
+	DF_OP_GETATTR_MANY, /**< attributes of several entries of a directory */
+	DF_OP_WRITE_UNSTABLE, /**< write which isn't answered */
+	DF_OP_COMMIT, /**< report the errors of the unstable writes */
+	DF_OP_WINDOW, /**< negotiate the limits of the flow control */
+	DF_OP_CANCEL, /**< abort the request being served, not answered */
+
 	DF_OP_QUIT, /**< send a "bye bye" message */
 };
 
+/*
+ * maximum size of a readdir answer, it contains the fuse_file_info, then for
+ * each entry, it's name, inode, d_type and offset of the next entry, then an
+ * end of directory flag
+ */
+#define DF_READDIR_CHUNK_SIZE (256 * 1024)
+#define DF_READDIR_TRAILER_SIZE (DF_INT_MARSHALLED_SIZE + \
+		DF_END_MARSHALLED_SIZE)
+
+/* maximum number of digests in a checksum answer, 128KiB for SHA-256 */
+#define DF_CHECKSUM_MAX_BLOCKS 4096
+
+/* size from which the records of a delta are sent in a DF_OP_DELTA_APPLY */
+#define DF_DELTA_CHUNK_SIZE (1024 * 1024)
+
+/* maximum size of the archive data in a DF_OP_EXPORT_READ answer */
+#define DF_EXPORT_CHUNK_SIZE (1024 * 1024)
+
+/* size of the archive data sent in a DF_OP_IMPORT_WRITE */
+#define DF_IMPORT_CHUNK_SIZE (1024 * 1024)
+
+/* maximum size of the records in a DF_OP_SCAN_READ answer */
+#define DF_SCAN_CHUNK_SIZE (256 * 1024)
+
+/*
+ * maximum number of names in a DF_OP_GETATTR_MANY, whose answer contains for
+ * each, an errno value, then the attributes, zeroed on error
+ */
+#define DF_GETATTR_MANY_MAX 1024
+
+/*
+ * maximum size of the content a DF_OP_OPEN answer carries, for the reads of
+ * small files not to cost a round trip each
+ */
+#define DF_INLINE_SIZE (16 * 1024)
+
+/*
+ * what a DF_OP_COMMIT does once the unstable writes of the handle are known to
+ * have succeeded, values are part of the protocol
+ */
+enum df_commit_flags {
+	DF_COMMIT_FSYNC = 1 << 0, /**< fsync the file */
+	DF_COMMIT_DATASYNC = 1 << 1, /**< fdatasync it */
+};
+
+/*
+ * maximum bytes and messages of the requests left unanswered in flight, which
+ * wait in the socket buffers of the device and of adbd, each side advertising
+ * it's limits in a DF_OP_WINDOW, the smallest being used
+ */
+#define DF_WINDOW_BYTES_MAX (32 * 1024 * 1024)
+#define DF_WINDOW_MSGS_MAX 1024
+
+/* changes reported by DF_OP_NOTIFY, values are part of the protocol */
+enum df_notify_flags {
+	DF_NOTIFY_CHANGE = 1 << 0, /**< content or attributes modified */
+	DF_NOTIFY_CREATE = 1 << 1, /**< entry created or moved in */
+	DF_NOTIFY_REMOVE = 1 << 2, /**< entry removed or moved out */
+	/** events were lost, anything under the path may have changed */
+	DF_NOTIFY_OVERFLOW = 1 << 3,
+};
+
 /* packet header, aligned on 64bits */
 struct df_packet_header {
 	/** size of useful data in the payload part of the packet */
@@ -66,8 +155,27 @@ enum df_data_type {
 	DF_DATA_STAT,
 	DF_DATA_STATVFS,
 	DF_DATA_TIMESPEC,
+	/**
+	 * absolute path, sent as a DF_DATA_BUFFER would be, but whose
+	 * directory part is replaced by a slot of a dictionary, once it has
+	 * been sent, see DF_PATH_DICT_SIZE. Built from a const char *, parsed
+	 * as a DF_DATA_BUFFER, a DF_DATA_BUFFER being accepted in it's place
+	 */
+	DF_DATA_PATH,
 };
 
+/*
+ * number of slots of the dictionaries of path prefixes, one per direction of
+ * the connection. A DF_DATA_PATH is sent as an int, then a buffer, the int
+ * being either -1, the buffer containing the whole path, or a slot, the buffer
+ * containing the path's last component, appended to the slot's prefix, or a
+ * slot ORed with DF_PATH_DEFINE, the buffer containing the whole path, whose
+ * directory part, up to the last '/', is stored in the slot. The messages
+ * containing a DF_DATA_PATH must hence be sent in the order they are built.
+ */
+#define DF_PATH_DICT_SIZE 1024
+#define DF_PATH_DEFINE (1 << 30)
+
 int fill_header(struct df_packet_header *header, size_t size,
 		enum df_op op_code, int error);
 
@@ -77,8 +185,66 @@ int df_send_handshake(int fd, uint32_t prot_version);
 
 int df_read_handshake(int fd, uint32_t *prot_version);
 
+/**
+ * receiver of the DF_OP_NOTIFY messages, which the device sends unsolicited,
+ * between answers
+ */
+typedef void (*df_notify_handler_t)(char *payload, size_t size);
+
+/**
+ * sets the handler of the DF_OP_NOTIFY messages, which are then consumed by
+ * df_read_header, before the message expected
+ */
+void df_set_notify_handler(df_notify_handler_t handler);
+
+/**
+ * handles the DF_OP_NOTIFY messages available, without blocking, no answer
+ * must be expected on fd
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_read_notifications(int fd);
+
+/**
+ * decides whether the request whose answer is awaited has to be cancelled,
+ * when the wait is interrupted by a signal
+ * @return non-zero to cancel it
+ */
+typedef int (*df_interrupt_handler_t)(void);
+
+/**
+ * sets the handler called when signum interrupts df_read_header's wait for a
+ * message, signum being unblocked only during those waits. A DF_OP_CANCEL is
+ * sent, once, if the handler says so, the answer, possibly an ECANCELED error,
+ * still being read
+ */
+void df_set_interrupt_handler(df_interrupt_handler_t handler, int signum);
+
+/**
+ * consumes the next message available on the socket fd, without blocking, if
+ * it's a DF_OP_CANCEL, for the long requests to check if they are cancelled
+ * @return non-zero if it was one
+ */
+int df_cancel_pending(int fd);
+
+/* reads and unmarshalls a message header, but not the payload following it */
+int df_read_header(int fd, struct df_packet_header *header);
+
 int df_read_message(int fd, struct df_packet_header *header, char **payload);
 
+/* writes a message header alone, the payload has to be sent separately */
+int df_write_header(int fd, struct df_packet_header *header);
+
+/*
+ * raw payload parts transfers, for messages sent or received in several parts,
+ * return 0 only when exactly size bytes have been transferred
+ */
+int df_write_data(int fd, const void *data, size_t size);
+
+int df_read_data(int fd, void *data, size_t size);
+
+/* moves size bytes of payload from fd_in to fd_out, without a user copy */
+int df_splice_data(int fd_in, int fd_out, size_t size);
+
 /**
  * parses the payload content, storing values according to the
  * (df_data_type, lvalue_pointer) passed as an argument list
@@ -102,6 +268,31 @@ int df_build_payload(char **payload, size_t *size, ...);
 
 int df_vbuild_payload(char **payload, size_t *size, va_list args);
 
+/**
+ * same as df_build_payload, but appends to a preallocated payload, of capacity
+ * bytes, which is never reallocated
+ * @return -ENOSPC if the data doesn't fit, in which case, size is left
+ * untouched
+ */
+int df_build_payload_fixed(char *payload, size_t capacity, size_t *size, ...);
+
+/**
+ * appends only the type and the size of a DF_DATA_BUFFER to the payload, the
+ * buffer's content must then be sent by the caller, right after the payload
+ * @param buffer_size Size of the buffer which will be sent afterwards
+ */
+int df_build_buffer_prefix(char **payload, size_t *size, size_t buffer_size);
+
+/**
+ * counterpart of df_build_buffer_prefix, pops the type and the size of a
+ * DF_DATA_BUFFER, leaving it's content unread
+ */
+int df_parse_buffer_prefix(char *payload, size_t *offset, size_t size,
+		int64_t *buffer_size);
+
+/* size of the data emitted by df_build_buffer_prefix */
+#define DF_BUFFER_PREFIX_SIZE (2 * sizeof(int64_t))
+
 /* write an entire message, header + payload */
 int df_write_message(int fd, struct df_packet_header *header, char *payload);
 
@@ -0,0 +1,606 @@
+/**
+ * @file df_scan.c
+ *
+ * Scans of trees for the entries which changed, so that the host can
+ * revalidate whatever it knows about a tree in a few requests
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "df_scan.h"
+
+static size_t put_varint(uint8_t *p, uint64_t value)
+{
+	size_t len = 0;
+
+	do {
+		p[len] = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+		value >>= 7;
+		len++;
+	} while (value);
+
+	return len;
+}
+
+static int get_varint(const uint8_t *buf, size_t size, size_t *offset,
+		uint64_t *value)
+{
+	unsigned shift;
+
+	*value = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if (*offset >= size)
+			return -EINVAL;
+		*value |= (uint64_t)(buf[*offset] & 0x7F) << shift;
+		if (!(buf[(*offset)++] & 0x80))
+			return 0;
+	}
+
+	return -EINVAL;
+}
+
+static uint64_t time_value(time_t t)
+{
+	return 0 > t ? 0 : t;
+}
+
+/* @return non-zero if records of this kind carry more than a path */
+static int has_values(enum df_scan_kind kind)
+{
+	return DF_SCAN_REMOVED != kind && DF_SCAN_LISTED != kind &&
+			DF_SCAN_UNLISTED != kind;
+}
+
+size_t df_scan_encode(uint8_t *buf, size_t size, const char *prev,
+		const struct df_scan_entry *entry)
+{
+	size_t len;
+	size_t shared = 0;
+	size_t suffix_len;
+	uint8_t record[DF_SCAN_RECORD_MAX];
+
+	while (prev[shared] && prev[shared] == entry->path[shared])
+		shared++;
+	suffix_len = strlen(entry->path + shared);
+
+	record[0] = entry->kind;
+	len = 1;
+	len += put_varint(record + len, shared);
+	len += put_varint(record + len, suffix_len);
+	memcpy(record + len, entry->path + shared, suffix_len);
+	len += suffix_len;
+	if (has_values(entry->kind)) {
+		len += put_varint(record + len, entry->mode);
+		len += put_varint(record + len, entry->ino);
+		len += put_varint(record + len, entry->size);
+		len += put_varint(record + len,
+				time_value(entry->mtime.tv_sec));
+		len += put_varint(record + len, entry->mtime.tv_nsec);
+		len += put_varint(record + len,
+				time_value(entry->ctime.tv_sec));
+		len += put_varint(record + len, entry->ctime.tv_nsec);
+	}
+	if (DF_SCAN_ATTRS == entry->kind) {
+		len += put_varint(record + len, entry->nlink);
+		len += put_varint(record + len, entry->uid);
+		len += put_varint(record + len, entry->gid);
+		len += put_varint(record + len, entry->rdev);
+		len += put_varint(record + len, entry->blocks);
+		len += put_varint(record + len, entry->blksize);
+		len += put_varint(record + len,
+				time_value(entry->atime.tv_sec));
+		len += put_varint(record + len, entry->atime.tv_nsec);
+	}
+	if (len > size)
+		return 0;
+	memcpy(buf, record, len);
+
+	return len;
+}
+
+int df_scan_decode(const uint8_t *buf, size_t size, size_t *offset,
+		struct df_scan_entry *entry)
+{
+	int ret;
+	uint64_t shared;
+	uint64_t suffix_len;
+	uint64_t values[15] = {0};
+	unsigned count = 0;
+	unsigned i;
+
+	if (*offset >= size || buf[*offset] > DF_SCAN_UNLISTED)
+		return -EINVAL;
+	entry->kind = buf[(*offset)++];
+
+	ret = get_varint(buf, size, offset, &shared);
+	if (0 == ret)
+		ret = get_varint(buf, size, offset, &suffix_len);
+	if (0 > ret)
+		return ret;
+	if (shared > strlen(entry->path) || shared + suffix_len >= PATH_MAX ||
+			suffix_len > size - *offset)
+		return -EINVAL;
+	memcpy(entry->path + shared, buf + *offset, suffix_len);
+	entry->path[shared + suffix_len] = '\0';
+	*offset += suffix_len;
+
+	if (has_values(entry->kind))
+		count = DF_SCAN_ATTRS == entry->kind ? 15 : 7;
+	for (i = 0; i < count; i++) {
+		ret = get_varint(buf, size, offset, values + i);
+		if (0 > ret)
+			return ret;
+	}
+	entry->mode = values[0];
+	entry->ino = values[1];
+	entry->size = values[2];
+	entry->mtime.tv_sec = values[3];
+	entry->mtime.tv_nsec = values[4];
+	entry->ctime.tv_sec = values[5];
+	entry->ctime.tv_nsec = values[6];
+	entry->nlink = values[7];
+	entry->uid = values[8];
+	entry->gid = values[9];
+	entry->rdev = values[10];
+	entry->blocks = values[11];
+	entry->blksize = values[12];
+	entry->atime.tv_sec = values[13];
+	entry->atime.tv_nsec = values[14];
+
+	return 0;
+}
+
+/* entry of the manifest, in an open addressing hash table */
+struct slot {
+	/* NULL if the slot is free */
+	char *path;
+	uint64_t ino;
+	int64_t size;
+	int seen;
+};
+
+/* directory being scanned */
+struct level {
+	/* NULL if it couldn't be opened, for it to be reported as unlisted */
+	DIR *dir;
+	/* length of the scan's path before the directory's name was added */
+	size_t path_len;
+	/* non-zero if some entries couldn't be reported */
+	int incomplete;
+	/* non-zero if all the entries are reported, in a snapshot */
+	int full;
+};
+
+struct df_scan {
+	int flags;
+	/* path of the root of the scan, passed to dir_cb */
+	char *root;
+	df_scan_dir_cb dir_cb;
+	void *dir_ctx;
+	struct level *stack;
+	size_t depth;
+	size_t capacity;
+	/* path of the top directory, relative to the root of the scan */
+	char path[PATH_MAX];
+	size_t path_len;
+	struct timespec since;
+	struct slot *slots;
+	/* number of slots minus one, the number of slots being a power of 2 */
+	size_t mask;
+	/* next slot to check for removals, once the walk is over */
+	size_t removed;
+	/* record which didn't fit in the previous chunk */
+	struct df_scan_entry entry;
+	int has_entry;
+	int64_t errors;
+};
+
+/* FNV-1a */
+static size_t hash_path(const char *path)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	while (*path) {
+		hash ^= (uint8_t)*path++;
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+static struct slot *find_slot(struct df_scan *scan, const char *path)
+{
+	size_t i;
+
+	for (i = hash_path(path) & scan->mask;
+			NULL != scan->slots[i].path;
+			i = (i + 1) & scan->mask)
+		if (0 == strcmp(scan->slots[i].path, path))
+			break;
+
+	return scan->slots + i;
+}
+
+static int load_manifest(struct df_scan *scan, const uint8_t *manifest,
+		size_t size)
+{
+	int ret;
+	size_t offset;
+	size_t count = 0;
+	size_t slots = 16;
+	struct slot *slot;
+	struct df_scan_entry *entry = &scan->entry;
+
+	/* sizes the table for a load factor of at most 1/2 */
+	entry->path[0] = '\0';
+	for (offset = 0; offset < size; count++) {
+		ret = df_scan_decode(manifest, size, &offset, entry);
+		if (0 > ret)
+			return ret;
+	}
+	while (slots < 2 * count)
+		slots *= 2;
+	scan->slots = calloc(slots, sizeof(*scan->slots));
+	if (NULL == scan->slots)
+		return -errno;
+	scan->mask = slots - 1;
+
+	entry->path[0] = '\0';
+	for (offset = 0; offset < size; ) {
+		df_scan_decode(manifest, size, &offset, entry);
+		slot = find_slot(scan, entry->path);
+		if (NULL == slot->path) {
+			slot->path = strdup(entry->path);
+			if (NULL == slot->path)
+				return -errno;
+		}
+		slot->ino = entry->ino;
+		slot->size = entry->size;
+	}
+
+	return 0;
+}
+
+/*
+ * marks the manifest entries of the subtree at path as seen, the subtree
+ * couldn't be walked, yet it's entries mustn't be reported as removed
+ */
+static void mark_seen(struct df_scan *scan, const char *path)
+{
+	size_t i;
+	const char *p;
+	size_t len = strlen(path);
+
+	if (NULL == scan->slots)
+		return;
+
+	for (i = 0; i <= scan->mask; i++) {
+		p = scan->slots[i].path;
+		if (NULL != p && (0 == len || (0 == strncmp(p, path, len) &&
+					('\0' == p[len] || '/' == p[len]))))
+			scan->slots[i].seen = 1;
+	}
+}
+
+static int push_dir(struct df_scan *scan, DIR *dir, size_t path_len)
+{
+	struct level *stack;
+
+	if (scan->depth == scan->capacity) {
+		stack = realloc(scan->stack, 2 * (scan->capacity + 4) *
+				sizeof(*stack));
+		if (NULL == stack)
+			return -errno;
+		scan->stack = stack;
+		scan->capacity = 2 * (scan->capacity + 4);
+	}
+	scan->stack[scan->depth].dir = dir;
+	scan->stack[scan->depth].path_len = path_len;
+	scan->stack[scan->depth].incomplete = 0;
+	scan->stack[scan->depth].full = 1;
+	scan->depth++;
+
+	return 0;
+}
+
+static int is_after(const struct timespec *t, const struct timespec *ref)
+{
+	return t->tv_sec > ref->tv_sec ||
+			(t->tv_sec == ref->tv_sec && t->tv_nsec > ref->tv_nsec);
+}
+
+int df_scan_changed(const struct df_scan_entry *entry,
+		const struct timespec *since)
+{
+	return is_after(&entry->mtime, since) || is_after(&entry->ctime, since);
+}
+
+/*
+ * @param full Non-zero if all the entries of the parent directory must be
+ * reported, in a snapshot
+ * @return non-zero if the entry, whose path is in scan->entry, is reported
+ */
+static int check_entry(struct df_scan *scan, const struct stat *st, int full)
+{
+	struct slot *slot;
+	struct df_scan_entry *entry = &scan->entry;
+
+	entry->mode = st->st_mode;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime = st->st_mtim;
+	entry->ctime = st->st_ctim;
+
+	if (scan->flags & DF_SCAN_SNAPSHOT) {
+		entry->kind = DF_SCAN_ATTRS;
+		entry->nlink = st->st_nlink;
+		entry->uid = st->st_uid;
+		entry->gid = st->st_gid;
+		entry->rdev = st->st_rdev;
+		entry->blocks = st->st_blocks;
+		entry->blksize = st->st_blksize;
+		entry->atime = st->st_atim;
+		return full || S_ISDIR(st->st_mode) ||
+				df_scan_changed(entry, &scan->since);
+	}
+
+	entry->kind = DF_SCAN_CHANGED;
+	if (NULL != scan->slots) {
+		slot = find_slot(scan, entry->path);
+		if (NULL == slot->path) {
+			entry->kind = DF_SCAN_NEW;
+			return 1;
+		}
+		slot->seen = 1;
+		if (slot->ino != entry->ino || (S_ISREG(st->st_mode) &&
+					slot->size != entry->size))
+			return 1;
+	}
+
+	return df_scan_changed(entry, &scan->since);
+}
+
+/*
+ * descends in the directory whose path, of length len, is in scan->entry,
+ * name being it's name in the directory parent_fd, and st it's attributes
+ */
+static void enter_dir(struct df_scan *scan, int parent_fd, const char *name,
+		size_t len, const struct stat *st)
+{
+	struct df_scan_entry changed = {
+		.mtime = st->st_mtim,
+		.ctime = st->st_ctim,
+	};
+	int fd;
+	DIR *dir;
+	int incomplete = 0;
+	char *path = scan->entry.path;
+
+	if (NULL != scan->dir_cb)
+		incomplete = scan->dir_cb(scan->root, path, scan->dir_ctx);
+
+	fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			O_CLOEXEC);
+	dir = -1 == fd ? NULL : fdopendir(fd);
+	if (NULL == dir) {
+		/* only a directory which is gone has it's entries removed */
+		if (ENOENT != errno)
+			mark_seen(scan, path);
+		if (-1 != fd)
+			close(fd);
+		scan->errors++;
+		/* a snapshot still has to report it as unlisted */
+		if (!(scan->flags & DF_SCAN_SNAPSHOT))
+			return;
+		incomplete = 1;
+	}
+	if (0 > push_dir(scan, dir, scan->path_len)) {
+		if (NULL != dir)
+			closedir(dir);
+		mark_seen(scan, path);
+		scan->errors++;
+		return;
+	}
+	scan->stack[scan->depth - 1].incomplete = incomplete;
+	/* if it's names changed, the host can't rely on those it knows */
+	scan->stack[scan->depth - 1].full = df_scan_changed(&changed,
+			&scan->since);
+	scan->path_len = len;
+	strcpy(scan->path, path);
+}
+
+/*
+ * walks the tree up to the next entry to report, stored in scan->entry
+ * @return 1 if there is one, 0 at the end of the walk
+ */
+static int next_changed(struct df_scan *scan)
+{
+	int full;
+	size_t len;
+	struct level *top;
+	struct dirent *de;
+	struct stat st;
+	char *path = scan->entry.path;
+
+	while (0 != scan->depth) {
+		top = scan->stack + scan->depth - 1;
+		errno = 0;
+		de = NULL == top->dir ? NULL : readdir(top->dir);
+		if (NULL == de) {
+			if (0 != errno) {
+				mark_seen(scan, scan->path);
+				scan->errors++;
+				top->incomplete = 1;
+			}
+			if (scan->flags & DF_SCAN_SNAPSHOT) {
+				scan->entry.kind = top->incomplete ?
+						DF_SCAN_UNLISTED :
+						DF_SCAN_LISTED;
+				strcpy(path, scan->path);
+			}
+			if (NULL != top->dir)
+				closedir(top->dir);
+			scan->path_len = top->path_len;
+			scan->path[scan->path_len] = '\0';
+			scan->depth--;
+			if (scan->flags & DF_SCAN_SNAPSHOT)
+				return 1;
+			continue;
+		}
+		if (0 == strcmp(de->d_name, ".") ||
+				0 == strcmp(de->d_name, ".."))
+			continue;
+
+		len = scan->path_len + (0 != scan->path_len) +
+				strlen(de->d_name);
+		if (len >= PATH_MAX) {
+			scan->errors++;
+			top->incomplete = 1;
+			continue;
+		}
+		strcpy(path, scan->path);
+		if (0 != scan->path_len)
+			strcat(path, "/");
+		strcat(path, de->d_name);
+		if (-1 == fstatat(dirfd(top->dir), de->d_name, &st,
+					AT_SYMLINK_NOFOLLOW)) {
+			if (ENOENT != errno)
+				mark_seen(scan, path);
+			scan->errors++;
+			top->incomplete = 1;
+			continue;
+		}
+
+		/* top may be moved by enter_dir */
+		full = top->full;
+		if (S_ISDIR(st.st_mode) && !(scan->flags & DF_SCAN_SHALLOW))
+			enter_dir(scan, dirfd(top->dir), de->d_name, len, &st);
+
+		if (check_entry(scan, &st, full))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* @return 1 if a manifest entry not seen was found, 0 if there are no more */
+static int next_removed(struct df_scan *scan)
+{
+	struct slot *slot;
+
+	for (; NULL != scan->slots && scan->removed <= scan->mask;
+			scan->removed++) {
+		slot = scan->slots + scan->removed;
+		if (NULL == slot->path || slot->seen)
+			continue;
+		memset(&scan->entry, 0, sizeof(scan->entry));
+		scan->entry.kind = DF_SCAN_REMOVED;
+		strcpy(scan->entry.path, slot->path);
+		scan->removed++;
+		return 1;
+	}
+
+	return 0;
+}
+
+ssize_t df_scan_read(struct df_scan *scan, uint8_t *buf, size_t size)
+{
+	size_t len;
+	size_t out = 0;
+	char prev[PATH_MAX] = "";
+
+	if (size < DF_SCAN_RECORD_MAX)
+		return -EINVAL;
+
+	for (;;) {
+		if (!scan->has_entry) {
+			scan->has_entry = next_changed(scan) ||
+					next_removed(scan);
+			if (!scan->has_entry)
+				break;
+		}
+		len = df_scan_encode(buf + out, size - out, prev,
+				&scan->entry);
+		if (0 == len)
+			break;
+		out += len;
+		strcpy(prev, scan->entry.path);
+		scan->has_entry = 0;
+	}
+
+	return out;
+}
+
+int df_scan_open(struct df_scan **scan, const char *path,
+		const struct timespec *since, const uint8_t *manifest,
+		size_t manifest_size, int flags)
+{
+	int ret;
+	DIR *dir;
+	struct df_scan *s;
+
+	if (NULL == scan || NULL == path || NULL == since)
+		return -EINVAL;
+
+	s = calloc(1, sizeof(*s));
+	if (NULL == s)
+		return -errno;
+	s->since = *since;
+	s->flags = flags;
+	s->root = strdup(path);
+
+	ret = NULL == s->root ? -errno : 0;
+	if (0 == ret && NULL != manifest && !(flags & DF_SCAN_SNAPSHOT))
+		ret = load_manifest(s, manifest, manifest_size);
+	if (0 == ret) {
+		dir = opendir(path);
+		ret = NULL == dir ? -errno : push_dir(s, dir, 0);
+		if (0 > ret && NULL != dir)
+			closedir(dir);
+	}
+	if (0 > ret) {
+		df_scan_close(&s);
+		return ret;
+	}
+	*scan = s;
+
+	return 0;
+}
+
+void df_scan_set_dir_cb(struct df_scan *scan, df_scan_dir_cb cb, void *ctx)
+{
+	scan->dir_cb = cb;
+	scan->dir_ctx = ctx;
+}
+
+int64_t df_scan_errors(struct df_scan *scan)
+{
+	return scan->errors;
+}
+
+void df_scan_close(struct df_scan **scan)
+{
+	size_t i;
+	struct df_scan *s;
+
+	if (NULL == scan || NULL == *scan)
+		return;
+	s = *scan;
+
+	while (s->depth--)
+		if (NULL != s->stack[s->depth].dir)
+			closedir(s->stack[s->depth].dir);
+	free(s->stack);
+	free(s->root);
+	if (NULL != s->slots)
+		for (i = 0; i <= s->mask; i++)
+			free(s->slots[i].path);
+	free(s->slots);
+	free(s);
+	*scan = NULL;
+}
@@ -0,0 +1,139 @@
+#ifndef DF_SCAN_H
+#define DF_SCAN_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* kinds of the records of a scan, values are part of the protocol */
+enum df_scan_kind {
+	DF_SCAN_ENTRY,   /**< entry of a manifest */
+	DF_SCAN_CHANGED, /**< modified since the reference, or differing */
+	DF_SCAN_NEW,     /**< present on the device, absent from the manifest */
+	DF_SCAN_REMOVED, /**< present in the manifest, absent from the device */
+	DF_SCAN_ATTRS,   /**< entry of a snapshot, with all it's attributes */
+	DF_SCAN_LISTED,  /**< all the entries of the directory were reported */
+	DF_SCAN_UNLISTED, /**< some entries of the directory weren't reported */
+};
+
+/* options of a scan, values are part of the protocol */
+enum df_scan_flags {
+	/**
+	 * reports as DF_SCAN_ATTRS records every directory, all the entries
+	 * of the root and of the directories changed after since, but only
+	 * the entries changed after since, of the others, the manifest being
+	 * ignored, then each directory, once walked, as a DF_SCAN_LISTED or a
+	 * DF_SCAN_UNLISTED record, the root's path being ""
+	 */
+	DF_SCAN_SNAPSHOT = 1 << 0,
+	/** the device watches the directories walked, before reading them */
+	DF_SCAN_WATCH = 1 << 1,
+	/**
+	 * the subdirectories of the root are reported, but not walked, a
+	 * manifest must hence list only the root's entries
+	 */
+	DF_SCAN_SHALLOW = 1 << 2,
+};
+
+/*
+ * records are encoded as : kind byte, then as LEB128 varints, the length of
+ * the prefix shared with the previous path of the chunk, the length of the
+ * rest of the path, followed by it's bytes, then, except for removals and
+ * the ends of listings, the mode, inode, size, mtime seconds and nanoseconds,
+ * ctime seconds and nanoseconds, followed for DF_SCAN_ATTRS records by the
+ * number of links, uid, gid, rdev, number of blocks, block size, atime
+ * seconds and nanoseconds, negative times being encoded as 0
+ */
+
+/* maximum size of an encoded record */
+#define DF_SCAN_RECORD_MAX (1 + 2 * 10 + PATH_MAX + 15 * 10)
+
+/**
+ * @struct df_scan_entry
+ * @brief decoded record
+ */
+struct df_scan_entry {
+	enum df_scan_kind kind;
+	/** path relative to the root of the scan */
+	char path[PATH_MAX];
+	mode_t mode;
+	uint64_t ino;
+	int64_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	/** valid only for DF_SCAN_ATTRS records */
+	nlink_t nlink;
+	uid_t uid;
+	gid_t gid;
+	dev_t rdev;
+	int64_t blocks;
+	int64_t blksize;
+	struct timespec atime;
+};
+
+/**
+ * encodes a record
+ * @param prev Previous path encoded in buf, "" for the first record
+ * @return size of the record, 0 if it doesn't fit in size bytes
+ */
+size_t df_scan_encode(uint8_t *buf, size_t size, const char *prev,
+		const struct df_scan_entry *entry);
+
+/**
+ * decodes the record at *offset, which is advanced past it
+ * @param entry On input, it's path must be the previous path decoded from
+ * buf, "" for the first record
+ * @return 0 on success, -EINVAL if the record is corrupted
+ */
+int df_scan_decode(const uint8_t *buf, size_t size, size_t *offset,
+		struct df_scan_entry *entry);
+
+/**
+ * @return non-zero if entry was modified or if it's status changed after
+ * since, the criterion of the scans
+ */
+int df_scan_changed(const struct df_scan_entry *entry,
+		const struct timespec *since);
+
+struct df_scan;
+
+/**
+ * starts scanning a tree, for the entries modified or whose status changed
+ * after since, or, if a manifest is given, which differ from it by their
+ * inode or size, appeared or disappeared, symbolic links aren't followed
+ * @param scan On output, the scan, to be released with df_scan_close
+ * @param path Absolute path of the root of the tree
+ * @param manifest DF_SCAN_ENTRY records, in any order, or NULL
+ * @param flags Combination of enum df_scan_flags, DF_SCAN_WATCH being left to
+ * the caller, see df_scan_set_dir_cb
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_scan_open(struct df_scan **scan, const char *path,
+		const struct timespec *since, const uint8_t *manifest,
+		size_t manifest_size, int flags);
+
+/**
+ * called for each directory below the root, before it's entries are read
+ * @param root Path of the root of the scan
+ * @param path Path of the directory, relative to root
+ * @return non-zero if the directory mustn't be reported as DF_SCAN_LISTED
+ */
+typedef int (*df_scan_dir_cb)(const char *root, const char *path, void *ctx);
+
+void df_scan_set_dir_cb(struct df_scan *scan, df_scan_dir_cb cb, void *ctx);
+
+/**
+ * fills buf with the next records, each chunk being decodable on it's own
+ * @param size At least DF_SCAN_RECORD_MAX
+ * @return number of bytes written to buf, 0 at the end of the scan, or
+ * errno-compatible negative value on error
+ */
+ssize_t df_scan_read(struct df_scan *scan, uint8_t *buf, size_t size);
+
+/* @return number of entries which couldn't be scanned so far */
+int64_t df_scan_errors(struct df_scan *scan);
+
+void df_scan_close(struct df_scan **scan);
+
+#endif /* DF_SCAN_H */
@@ -0,0 +1,911 @@
+/**
+ * @file df_tar.c
+ *
+ * Streaming GNU tar writer and reader, used to transfer whole trees in a few
+ * requests, the device archiving them and the host extracting them
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "df_tar.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define BLOCK_SIZE 512
+
+/* name of the GNU entries holding the long names of the entry following */
+#define LONG_LINK_NAME "././@LongLink"
+#define GNU_MAGIC "ustar  "
+
+/* maximum size of a long name accepted when reading */
+#define LONG_NAME_MAX (4 * PATH_MAX)
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[8];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char padding[167];
+};
+
+/* room for an entry's headers, with their long names and link target */
+#define PENDING_SIZE (5 * BLOCK_SIZE + 2 * PATH_MAX)
+
+static size_t padding_of(uint64_t size)
+{
+	return (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+}
+
+/* octal if it fits, GNU's base-256 encoding otherwise */
+static void put_number(char *field, size_t len, uint64_t value)
+{
+	size_t i;
+
+	if (value < 1ULL << (3 * (len - 1))) {
+		snprintf(field, len, "%0*llo", (int)len - 1,
+				(unsigned long long)value);
+		return;
+	}
+
+	for (i = len - 1; i > 0; i--) {
+		field[i] = value & 0xFF;
+		value >>= 8;
+	}
+	field[0] = (char)0x80;
+}
+
+static uint64_t get_number(const char *field, size_t len)
+{
+	size_t i;
+	uint64_t value = 0;
+
+	if (field[0] & 0x80) {
+		for (i = 1; i < len; i++)
+			value = (value << 8) | (unsigned char)field[i];
+		return value;
+	}
+
+	for (i = 0; i < len && (' ' == field[i] || '\0' == field[i]); i++)
+		;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		value = (value << 3) | (field[i] - '0');
+
+	return value;
+}
+
+static unsigned header_checksum(const struct tar_header *h)
+{
+	size_t i;
+	unsigned sum = 0;
+	const unsigned char *p = (const unsigned char *)h;
+
+	for (i = 0; i < sizeof(*h); i++)
+		sum += i >= offsetof(struct tar_header, chksum) &&
+				i < offsetof(struct tar_header, typeflag) ?
+				' ' : p[i];
+
+	return sum;
+}
+
+/* directory being archived */
+struct level {
+	DIR *dir;
+	/* length of the writer's path before the directory's name was added */
+	size_t path_len;
+};
+
+struct df_tar_writer {
+	struct level *stack;
+	size_t depth;
+	size_t capacity;
+	/* path of the top directory, relative to the root of the archive */
+	char path[PATH_MAX];
+	size_t path_len;
+	/* bytes queued before the content of the current file, if any */
+	char pending[PENDING_SIZE];
+	size_t pending_size;
+	size_t pending_offset;
+	/* regular file being archived, -1 if none */
+	int fd;
+	int64_t remaining;
+	size_t padding;
+	/* non-zero once the end of archive has been queued */
+	int done;
+	int64_t errors;
+};
+
+static void queue(struct df_tar_writer *w, const void *data, size_t size)
+{
+	memcpy(w->pending + w->pending_size, data, size);
+	w->pending_size += size;
+}
+
+static void queue_zeros(struct df_tar_writer *w, size_t size)
+{
+	memset(w->pending + w->pending_size, 0, size);
+	w->pending_size += size;
+}
+
+static void queue_block(struct df_tar_writer *w, struct tar_header *h)
+{
+	memcpy(h->magic, GNU_MAGIC, sizeof(h->magic));
+	snprintf(h->chksum, sizeof(h->chksum), "%06o", header_checksum(h));
+	h->chksum[7] = ' ';
+	queue(w, h, sizeof(*h));
+}
+
+/* queues a GNU long name entry, of type 'L' for names, 'K' for targets */
+static void queue_long_name(struct df_tar_writer *w, char type,
+		const char *name)
+{
+	size_t len = strlen(name) + 1;
+	struct tar_header h;
+
+	memset(&h, 0, sizeof(h));
+	strcpy(h.name, LONG_LINK_NAME);
+	put_number(h.mode, sizeof(h.mode), 0);
+	put_number(h.uid, sizeof(h.uid), 0);
+	put_number(h.gid, sizeof(h.gid), 0);
+	put_number(h.size, sizeof(h.size), len);
+	put_number(h.mtime, sizeof(h.mtime), 0);
+	h.typeflag = type;
+	queue_block(w, &h);
+	queue(w, name, len);
+	queue_zeros(w, padding_of(len));
+}
+
+static void queue_header(struct df_tar_writer *w, const char *name,
+		const struct stat *st, char type, const char *target)
+{
+	struct tar_header h;
+
+	if (strlen(name) >= sizeof(h.name))
+		queue_long_name(w, 'L', name);
+	if (NULL != target && strlen(target) >= sizeof(h.linkname))
+		queue_long_name(w, 'K', target);
+
+	memset(&h, 0, sizeof(h));
+	strncpy(h.name, name, sizeof(h.name));
+	put_number(h.mode, sizeof(h.mode), st->st_mode & 07777);
+	put_number(h.uid, sizeof(h.uid), st->st_uid);
+	put_number(h.gid, sizeof(h.gid), st->st_gid);
+	put_number(h.size, sizeof(h.size), '0' == type ? st->st_size : 0);
+	put_number(h.mtime, sizeof(h.mtime),
+			0 > st->st_mtime ? 0 : st->st_mtime);
+	h.typeflag = type;
+	if (NULL != target)
+		strncpy(h.linkname, target, sizeof(h.linkname));
+	if ('3' == type || '4' == type) {
+		put_number(h.devmajor, sizeof(h.devmajor),
+				major(st->st_rdev));
+		put_number(h.devminor, sizeof(h.devminor),
+				minor(st->st_rdev));
+	}
+	queue_block(w, &h);
+}
+
+static int push_dir(struct df_tar_writer *w, DIR *dir, size_t path_len)
+{
+	struct level *stack;
+
+	if (w->depth == w->capacity) {
+		stack = realloc(w->stack, 2 * (w->capacity + 4) *
+				sizeof(*stack));
+		if (NULL == stack)
+			return -errno;
+		w->stack = stack;
+		w->capacity = 2 * (w->capacity + 4);
+	}
+	w->stack[w->depth].dir = dir;
+	w->stack[w->depth].path_len = path_len;
+	w->depth++;
+
+	return 0;
+}
+
+/*
+ * queues the headers of an entry, opening it if it's a regular file or a
+ * directory, name being it's name in the archive
+ * @return 0 if the entry is archived, errno-compatible negative value if it
+ * must be skipped
+ */
+static int add_entry(struct df_tar_writer *w, int dirfd, const char *fs_name,
+		const char *name)
+{
+	int fd;
+	ssize_t len;
+	DIR *dir;
+	struct stat st;
+	char target[PATH_MAX];
+	char dir_name[PATH_MAX + 1];
+
+	if (-1 == fstatat(dirfd, fs_name, &st, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+
+	switch (st.st_mode & S_IFMT) {
+	case S_IFDIR:
+		/* the directory is archived, even if it's content can't be */
+		snprintf(dir_name, sizeof(dir_name), "%s/", name);
+		queue_header(w, dir_name, &st, '5', NULL);
+		fd = openat(dirfd, fs_name, O_RDONLY | O_DIRECTORY |
+				O_NOFOLLOW | O_CLOEXEC);
+		dir = -1 == fd ? NULL : fdopendir(fd);
+		if (NULL == dir) {
+			if (-1 != fd)
+				close(fd);
+			w->errors++;
+			return 0;
+		}
+		if (0 > push_dir(w, dir, w->path_len)) {
+			closedir(dir);
+			w->errors++;
+			return 0;
+		}
+		w->path_len = strlen(name);
+		memmove(w->path, name, w->path_len + 1);
+		return 0;
+
+	case S_IFREG:
+		fd = openat(dirfd, fs_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (-1 == fd)
+			return -errno;
+		queue_header(w, name, &st, '0', NULL);
+		w->fd = fd;
+		w->remaining = st.st_size;
+		w->padding = padding_of(st.st_size);
+		return 0;
+
+	case S_IFLNK:
+		len = readlinkat(dirfd, fs_name, target, sizeof(target) - 1);
+		if (-1 == len)
+			return -errno;
+		target[len] = '\0';
+		queue_header(w, name, &st, '2', target);
+		return 0;
+
+	case S_IFCHR:
+		queue_header(w, name, &st, '3', NULL);
+		return 0;
+
+	case S_IFBLK:
+		queue_header(w, name, &st, '4', NULL);
+		return 0;
+
+	case S_IFIFO:
+		queue_header(w, name, &st, '6', NULL);
+		return 0;
+
+	default:
+		/* sockets can't be archived */
+		return 0;
+	}
+}
+
+/* queues the next entry of the walk, or the end of the archive */
+static void next_entry(struct df_tar_writer *w)
+{
+	int ret;
+	struct level *top;
+	struct dirent *de;
+	char name[PATH_MAX];
+
+	for (;;) {
+		if (0 == w->depth) {
+			queue_zeros(w, 2 * BLOCK_SIZE);
+			w->done = 1;
+			return;
+		}
+
+		top = w->stack + w->depth - 1;
+		errno = 0;
+		de = readdir(top->dir);
+		if (NULL == de) {
+			if (0 != errno)
+				w->errors++;
+			closedir(top->dir);
+			w->path_len = top->path_len;
+			w->path[w->path_len] = '\0';
+			w->depth--;
+			continue;
+		}
+		if (0 == strcmp(de->d_name, ".") ||
+				0 == strcmp(de->d_name, ".."))
+			continue;
+
+		ret = snprintf(name, sizeof(name), "%s%s%s", w->path,
+				0 == w->path_len ? "" : "/", de->d_name);
+		if (ret >= (int)sizeof(name)) {
+			w->errors++;
+			continue;
+		}
+		ret = add_entry(w, dirfd(top->dir), de->d_name, name);
+		if (0 > ret) {
+			w->errors++;
+			continue;
+		}
+		return;
+	}
+}
+
+int df_tar_writer_open(struct df_tar_writer **writer, const char *path)
+{
+	int ret;
+	DIR *dir;
+	const char *base;
+	struct df_tar_writer *w;
+
+	if (NULL == writer || NULL == path || '/' != path[0])
+		return -EINVAL;
+
+	w = calloc(1, sizeof(*w));
+	if (NULL == w)
+		return -errno;
+	w->fd = -1;
+
+	dir = opendir(path);
+	if (NULL != dir) {
+		ret = push_dir(w, dir, 0);
+		if (0 > ret)
+			closedir(dir);
+	} else if (ENOTDIR == errno) {
+		base = strrchr(path, '/') + 1;
+		ret = add_entry(w, AT_FDCWD, path, '\0' == *base ? "." : base);
+	} else {
+		ret = -errno;
+	}
+	if (0 > ret) {
+		free(w);
+		return ret;
+	}
+	*writer = w;
+
+	return 0;
+}
+
+ssize_t df_tar_writer_read(struct df_tar_writer *w, char *buf, size_t size)
+{
+	size_t n;
+	ssize_t ret;
+	size_t out = 0;
+
+	while (out < size) {
+		if (w->pending_offset < w->pending_size) {
+			n = MIN(size - out, w->pending_size - w->pending_offset);
+			memcpy(buf + out, w->pending + w->pending_offset, n);
+			w->pending_offset += n;
+			out += n;
+			continue;
+		}
+		w->pending_offset = w->pending_size = 0;
+
+		if (-1 != w->fd && 0 != w->remaining) {
+			n = MIN((int64_t)(size - out), w->remaining);
+			ret = read(w->fd, buf + out, n);
+			if (-1 == ret && EINTR == errno)
+				continue;
+			/* the file shrank, the size announced must be kept */
+			if (0 >= ret) {
+				w->errors++;
+				memset(buf + out, 0, n);
+				close(w->fd);
+				w->fd = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+				if (-1 == w->fd)
+					return -errno;
+				ret = n;
+			}
+			out += ret;
+			w->remaining -= ret;
+			continue;
+		}
+		if (-1 != w->fd) {
+			close(w->fd);
+			w->fd = -1;
+			queue_zeros(w, w->padding);
+			continue;
+		}
+
+		if (w->done)
+			break;
+		next_entry(w);
+	}
+
+	return out;
+}
+
+int64_t df_tar_writer_errors(struct df_tar_writer *w)
+{
+	return w->errors;
+}
+
+void df_tar_writer_close(struct df_tar_writer **writer)
+{
+	struct df_tar_writer *w;
+
+	if (NULL == writer || NULL == *writer)
+		return;
+	w = *writer;
+
+	while (w->depth)
+		closedir(w->stack[--w->depth].dir);
+	free(w->stack);
+	if (-1 != w->fd)
+		close(w->fd);
+	free(w);
+	*writer = NULL;
+}
+
+/* entry whose creation or attributes are set at the end of the extraction */
+struct deferred {
+	struct deferred *next;
+	char *name;
+	/* target of symbolic links, NULL for directories */
+	char *target;
+	mode_t mode;
+	struct timespec times[2];
+};
+
+enum reader_state {
+	READ_HEADER,
+	READ_DATA,
+	READ_PADDING,
+};
+
+struct df_tar_reader {
+	int dirfd;
+	enum reader_state state;
+	char header[BLOCK_SIZE];
+	size_t header_fill;
+	/* data of the entry being read */
+	int64_t remaining;
+	size_t padding;
+	/* file being extracted, -1 if the data is skipped */
+	int fd;
+	char *name;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timespec times[2];
+	/* long name being read, the type of it's entry being long_type */
+	char long_type;
+	char *long_buf;
+	size_t long_fill;
+	/* long names read, for the entry following */
+	char *long_name;
+	char *long_link;
+	/* LIFO, to set the attributes of children before their parents' */
+	struct deferred *deferred;
+	int64_t entries;
+	int64_t errors;
+	/* "name: error" lines of the first errors */
+	char *messages;
+	size_t messages_size;
+};
+
+static void report_error(struct df_tar_reader *r, const char *name, int err)
+{
+	int len;
+	char *messages;
+	char line[PATH_MAX + 128];
+
+	r->errors++;
+
+	len = snprintf(line, sizeof(line), "%s: %s\n", name, strerror(err));
+	if (0 > len)
+		return;
+	len = (size_t)len < sizeof(line) ? len : (int)sizeof(line) - 1;
+	if (r->messages_size + len > DF_TAR_ERRORS_MAX)
+		return;
+
+	messages = realloc(r->messages, r->messages_size + len + 1);
+	if (NULL == messages)
+		return;
+	memcpy(messages + r->messages_size, line, len + 1);
+	r->messages = messages;
+	r->messages_size += len;
+}
+
+/*
+ * strips the leading "./" and trailing slashes of a name, the result being
+ * empty for the root
+ * @return -1 if the name is unsafe, i.e. absolute or escaping with ".."
+ */
+static int sanitize(char *name)
+{
+	size_t len;
+	const char *p;
+
+	while ('.' == name[0] && '/' == name[1])
+		memmove(name, name + 2, strlen(name + 2) + 1);
+	len = strlen(name);
+	while (len && '/' == name[len - 1])
+		name[--len] = '\0';
+	if (0 == strcmp(name, "."))
+		name[0] = '\0';
+	if ('/' == name[0])
+		return -1;
+
+	for (p = name; NULL != p; p = strchr(p, '/')) {
+		if ('/' == *p)
+			p++;
+		if (0 == strncmp(p, "..", 2) && ('\0' == p[2] || '/' == p[2]))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int defer(struct df_tar_reader *r, const char *target)
+{
+	struct deferred *d;
+
+	d = calloc(1, sizeof(*d));
+	if (NULL == d)
+		return -errno;
+	d->name = strdup(r->name);
+	d->target = NULL == target ? NULL : strdup(target);
+	if (NULL == d->name || (NULL != target && NULL == d->target)) {
+		free(d->name);
+		free(d->target);
+		free(d);
+		return -ENOMEM;
+	}
+	d->mode = r->mode;
+	memcpy(d->times, r->times, sizeof(d->times));
+	d->next = r->deferred;
+	r->deferred = d;
+
+	return 0;
+}
+
+static void finish_file(struct df_tar_reader *r)
+{
+	if (-1 == r->fd)
+		return;
+
+	if (0 == geteuid() && -1 == fchown(r->fd, r->uid, r->gid))
+		report_error(r, r->name, errno);
+	else if (-1 == fchmod(r->fd, r->mode) ||
+			-1 == futimens(r->fd, r->times))
+		report_error(r, r->name, errno);
+	close(r->fd);
+	r->fd = -1;
+}
+
+static int open_file(struct df_tar_reader *r)
+{
+	int fd;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+
+	fd = openat(r->dirfd, r->name, flags, 0600);
+	/* don't write through an existing symbolic link, replace it */
+	if (-1 == fd && ELOOP == errno &&
+			0 == unlinkat(r->dirfd, r->name, 0))
+		fd = openat(r->dirfd, r->name, flags, 0600);
+
+	return fd;
+}
+
+/* creates the entry described by the header, apart for it's data */
+static int create_entry(struct df_tar_reader *r, char type, char *target)
+{
+	int ret;
+	struct stat st;
+	const struct tar_header *h = (const struct tar_header *)r->header;
+
+	switch (type) {
+	case '0':
+	case '\0':
+	case '7':
+		r->fd = open_file(r);
+		return -1 == r->fd ? -errno : 0;
+
+	case '5':
+		ret = mkdirat(r->dirfd, r->name, 0700);
+		if (-1 == ret && (EEXIST != errno || -1 == fstatat(r->dirfd,
+				r->name, &st, AT_SYMLINK_NOFOLLOW) ||
+				!S_ISDIR(st.st_mode)))
+			return EEXIST == errno ? -ENOTDIR : -errno;
+		return defer(r, NULL);
+
+	case '2':
+		return defer(r, target);
+
+	case '1':
+		if (0 != sanitize(target))
+			return -EPERM;
+		unlinkat(r->dirfd, r->name, 0);
+		ret = linkat(r->dirfd, target, r->dirfd, r->name, 0);
+		return -1 == ret ? -errno : 0;
+
+	case '3':
+	case '4':
+	case '6':
+		unlinkat(r->dirfd, r->name, 0);
+		ret = mknodat(r->dirfd, r->name, r->mode | ('3' == type ?
+				S_IFCHR : '4' == type ? S_IFBLK : S_IFIFO),
+				makedev(get_number(h->devmajor,
+						sizeof(h->devmajor)),
+					get_number(h->devminor,
+						sizeof(h->devminor))));
+		if (-1 == ret || -1 == utimensat(r->dirfd, r->name, r->times,
+					AT_SYMLINK_NOFOLLOW))
+			return -errno;
+		return 0;
+
+	default:
+		return -ENOTSUP;
+	}
+}
+
+static void free_string(char **string)
+{
+	free(*string);
+}
+
+static int is_zero_block(const char *block)
+{
+	size_t i;
+
+	for (i = 0; i < BLOCK_SIZE; i++)
+		if (block[i])
+			return 0;
+
+	return 1;
+}
+
+static int read_header(struct df_tar_reader *r)
+{
+	int ret;
+	char type;
+	uint64_t size;
+	char __attribute__((cleanup(free_string))) *target = NULL;
+	const struct tar_header *h = (const struct tar_header *)r->header;
+
+	/* end of archive */
+	if (is_zero_block(r->header))
+		return 0;
+	if (get_number(h->chksum, sizeof(h->chksum)) != header_checksum(h))
+		return -EINVAL;
+
+	type = h->typeflag;
+	size = get_number(h->size, sizeof(h->size));
+	r->remaining = size;
+	r->padding = padding_of(size);
+	r->state = 0 == size ? READ_HEADER : READ_DATA;
+
+	if ('L' == type || 'K' == type) {
+		if (size > LONG_NAME_MAX || 0 == size)
+			return -EINVAL;
+		r->long_type = type;
+		r->long_fill = 0;
+		r->long_buf = malloc(size + 1);
+		return NULL == r->long_buf ? -errno : 0;
+	}
+
+	free(r->name);
+	r->name = NULL != r->long_name ? r->long_name :
+			strndup(h->name, sizeof(h->name));
+	r->long_name = NULL;
+	target = NULL != r->long_link ? r->long_link :
+			strndup(h->linkname, sizeof(h->linkname));
+	r->long_link = NULL;
+	if (NULL == r->name || NULL == target)
+		return -ENOMEM;
+
+	r->mode = get_number(h->mode, sizeof(h->mode)) & 07777;
+	r->uid = get_number(h->uid, sizeof(h->uid));
+	r->gid = get_number(h->gid, sizeof(h->gid));
+	r->times[0].tv_sec = r->times[1].tv_sec =
+			get_number(h->mtime, sizeof(h->mtime));
+	r->times[0].tv_nsec = r->times[1].tv_nsec = 0;
+
+	if (0 != sanitize(r->name) || '\0' == r->name[0])
+		ret = '\0' == r->name[0] && '5' == type ? 0 : -EPERM;
+	else
+		ret = create_entry(r, type, target);
+	if (0 > ret)
+		report_error(r, r->name, -ret);
+	else if ('\0' != r->name[0])
+		r->entries++;
+	if (0 == size)
+		finish_file(r);
+
+	return 0;
+}
+
+static int write_data(struct df_tar_reader *r, const char *data, size_t size)
+{
+	ssize_t ret;
+
+	if (NULL != r->long_buf) {
+		memcpy(r->long_buf + r->long_fill, data, size);
+		r->long_fill += size;
+		return 0;
+	}
+
+	while (-1 != r->fd && size) {
+		ret = write(r->fd, data, size);
+		if (-1 == ret && EINTR == errno)
+			continue;
+		if (-1 == ret) {
+			report_error(r, r->name, errno);
+			r->entries--;
+			close(r->fd);
+			r->fd = -1;
+			break;
+		}
+		data += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/* called once all the data of an entry has been read */
+static void end_data(struct df_tar_reader *r)
+{
+	char **long_name;
+
+	if (NULL == r->long_buf) {
+		finish_file(r);
+		return;
+	}
+
+	r->long_buf[r->long_fill] = '\0';
+	long_name = 'L' == r->long_type ? &r->long_name : &r->long_link;
+	free(*long_name);
+	*long_name = r->long_buf;
+	r->long_buf = NULL;
+}
+
+int df_tar_reader_feed(struct df_tar_reader *r, const char *data, size_t size)
+{
+	int ret;
+	size_t n;
+
+	while (size) {
+		switch (r->state) {
+		case READ_HEADER:
+			n = MIN(size, BLOCK_SIZE - r->header_fill);
+			memcpy(r->header + r->header_fill, data, n);
+			r->header_fill += n;
+			if (BLOCK_SIZE == r->header_fill) {
+				r->header_fill = 0;
+				ret = read_header(r);
+				if (0 > ret)
+					return ret;
+			}
+			break;
+
+		case READ_DATA:
+			n = MIN((int64_t)size, r->remaining);
+			write_data(r, data, n);
+			r->remaining -= n;
+			if (0 == r->remaining) {
+				end_data(r);
+				r->state = r->padding ? READ_PADDING :
+						READ_HEADER;
+			}
+			break;
+
+		case READ_PADDING:
+		default:
+			n = MIN(size, r->padding);
+			r->padding -= n;
+			if (0 == r->padding)
+				r->state = READ_HEADER;
+			break;
+		}
+		data += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+int df_tar_reader_open(struct df_tar_reader **reader, const char *dir)
+{
+	struct df_tar_reader *r;
+
+	if (NULL == reader || NULL == dir)
+		return -EINVAL;
+
+	r = calloc(1, sizeof(*r));
+	if (NULL == r)
+		return -errno;
+	r->fd = -1;
+	r->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (-1 == r->dirfd) {
+		free(r);
+		return -errno;
+	}
+	*reader = r;
+
+	return 0;
+}
+
+void df_tar_reader_stats(struct df_tar_reader *r, int64_t *entries,
+		int64_t *errors)
+{
+	if (NULL != entries)
+		*entries = r->entries;
+	if (NULL != errors)
+		*errors = r->errors;
+}
+
+const char *df_tar_reader_messages(struct df_tar_reader *r)
+{
+	return NULL == r->messages ? "" : r->messages;
+}
+
+/* creates the symbolic links, then sets the attributes of the directories */
+void df_tar_reader_finish(struct df_tar_reader *r)
+{
+	int ret;
+	struct deferred *d;
+
+	for (d = r->deferred; NULL != d; d = d->next) {
+		if (NULL == d->target)
+			continue;
+		ret = symlinkat(d->target, r->dirfd, d->name);
+		if (-1 == ret && EEXIST == errno &&
+				0 == unlinkat(r->dirfd, d->name, 0))
+			ret = symlinkat(d->target, r->dirfd, d->name);
+		if (-1 == ret || -1 == utimensat(r->dirfd, d->name, d->times,
+					AT_SYMLINK_NOFOLLOW))
+			report_error(r, d->name, errno);
+	}
+
+	while (NULL != (d = r->deferred)) {
+		if (NULL == d->target && (-1 == fchmodat(r->dirfd, d->name,
+						d->mode, 0) ||
+				-1 == utimensat(r->dirfd, d->name, d->times,
+					0)))
+			report_error(r, d->name, errno);
+		r->deferred = d->next;
+		free(d->name);
+		free(d->target);
+		free(d);
+	}
+}
+
+void df_tar_reader_close(struct df_tar_reader **reader)
+{
+	struct df_tar_reader *r;
+
+	if (NULL == reader || NULL == *reader)
+		return;
+	r = *reader;
+
+	/* the archive may have been truncated */
+	if (-1 != r->fd)
+		close(r->fd);
+	df_tar_reader_finish(r);
+	close(r->dirfd);
+	free(r->name);
+	free(r->long_buf);
+	free(r->long_name);
+	free(r->long_link);
+	free(r->messages);
+	free(r);
+	*reader = NULL;
+}
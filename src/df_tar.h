@@ -0,0 +1,86 @@
+#ifndef DF_TAR_H
+#define DF_TAR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * archives exchanged with the device are GNU tar streams, with directories,
+ * regular files, symbolic links and special files, names longer than 100
+ * bytes being stored in GNU long name entries
+ */
+
+struct df_tar_writer;
+
+/**
+ * starts the archiving of a tree, entries being named relatively to it's root,
+ * or by it's base name if path isn't a directory
+ * @param writer On output, the writer, to be released with df_tar_writer_close
+ * @param path Absolute path of the tree to archive
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_tar_writer_open(struct df_tar_writer **writer, const char *path);
+
+/**
+ * fills buf with the next bytes of the archive, entries which can't be read
+ * are skipped and counted as errors
+ * @return number of bytes written to buf, less than size only at the end of
+ * the archive, or errno-compatible negative value on error
+ */
+ssize_t df_tar_writer_read(struct df_tar_writer *writer, char *buf,
+		size_t size);
+
+/* @return number of entries skipped so far because of errors */
+int64_t df_tar_writer_errors(struct df_tar_writer *writer);
+
+void df_tar_writer_close(struct df_tar_writer **writer);
+
+struct df_tar_reader;
+
+/* maximum size of the error messages kept, further errors are counted */
+#define DF_TAR_ERRORS_MAX 8192
+
+/**
+ * starts the extraction of an archive, in a directory
+ * @param reader On output, the reader, to be released with df_tar_reader_close
+ * @param dir Directory, which must exist, in which the entries are created
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_tar_reader_open(struct df_tar_reader **reader, const char *dir);
+
+/**
+ * extracts the archive's entries contained in the next size bytes of it,
+ * entries with an absolute name or containing a ".." component are skipped,
+ * symbolic links and the modes and times of directories are set at the end,
+ * for the extraction not to be redirected outside of dir or prevented by
+ * read-only directories
+ * @return 0 on success, errno-compatible negative value if the archive is
+ * corrupted, errors on entries are only counted
+ */
+int df_tar_reader_feed(struct df_tar_reader *reader, const char *data,
+		size_t size);
+
+/**
+ * creates the deferred symbolic links and sets the attributes of the
+ * directories, once all the archive has been fed, called by
+ * df_tar_reader_close if needed
+ */
+void df_tar_reader_finish(struct df_tar_reader *reader);
+
+/**
+ * @param entries If not NULL, on output, number of entries extracted
+ * @param errors If not NULL, on output, number of entries which couldn't be
+ */
+void df_tar_reader_stats(struct df_tar_reader *reader, int64_t *entries,
+		int64_t *errors);
+
+/*
+ * @return "name: error" lines for the first errors, in DF_TAR_ERRORS_MAX
+ * bytes at most, valid until the next call on reader
+ */
+const char *df_tar_reader_messages(struct df_tar_reader *reader);
+
+/* finishes the extraction and releases the reader */
+void df_tar_reader_close(struct df_tar_reader **reader);
+
+#endif /* DF_TAR_H */
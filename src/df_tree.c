@@ -0,0 +1,283 @@
+/**
+ * @file df_tree.c
+ *
+ * Recursive operations performed on the device in one request, so that
+ * removing or changing the permissions of large trees doesn't cost a few
+ * round trips per entry
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "df_tree.h"
+#include "df_path_cache.h"
+
+struct walk {
+	enum df_tree_op op;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct df_tree_report *report;
+	/* path of the directory being walked, for the error messages */
+	char path[PATH_MAX];
+	size_t len;
+	int (*cancelled)(void);
+	/* entries seen since cancelled was last called, and it's verdict */
+	unsigned unchecked;
+	int stopped;
+};
+
+/* entries processed between two calls to cancelled */
+#define CANCEL_CHECK_ENTRIES 256
+
+static int stopped(struct walk *w)
+{
+	if (w->stopped || NULL == w->cancelled ||
+			++w->unchecked < CANCEL_CHECK_ENTRIES)
+		return w->stopped;
+
+	w->unchecked = 0;
+	w->stopped = w->cancelled();
+
+	return w->stopped;
+}
+
+static void report_error(struct walk *w, const char *name, int err)
+{
+	int len;
+	char *errors;
+	char line[PATH_MAX + 128];
+	struct df_tree_report *r = w->report;
+
+	r->failed++;
+
+	len = snprintf(line, sizeof(line), "%.*s%s%s: %s\n", (int)w->len,
+			w->path, NULL == name ? "" : "/",
+			NULL == name ? "" : name, strerror(err));
+	if (0 > len)
+		return;
+	len = (size_t)len < sizeof(line) ? len : (int)sizeof(line) - 1;
+	if (r->errors_size + len > DF_TREE_ERRORS_MAX)
+		return;
+
+	errors = realloc(r->errors, r->errors_size + len + 1);
+	if (NULL == errors)
+		return;
+	memcpy(errors + r->errors_size, line, len + 1);
+	r->errors = errors;
+	r->errors_size += len;
+}
+
+/* applies the operation to one entry, type being a DT_* value */
+static void apply(struct walk *w, int dirfd, const char *name, int type)
+{
+	int ret = 0;
+
+	switch (w->op) {
+	case DF_TREE_REMOVE:
+		ret = unlinkat(dirfd, name, DT_DIR == type ? AT_REMOVEDIR : 0);
+		break;
+
+	case DF_TREE_CHMOD:
+		/* like chmod -R, symbolic links are left untouched */
+		if (DT_LNK == type)
+			return;
+		ret = fchmodat(dirfd, name, w->mode, 0);
+		break;
+
+	case DF_TREE_CHOWN:
+		ret = fchownat(dirfd, name, w->uid, w->gid,
+				AT_SYMLINK_NOFOLLOW);
+		break;
+
+	default:
+		ret = -1;
+		errno = EINVAL;
+	}
+
+	if (-1 == ret)
+		report_error(w, name, errno);
+	else
+		w->report->done++;
+}
+
+static void process(struct walk *w, int dirfd, const char *name, int type);
+
+/* processes all the entries of a directory, takes ownership of fd */
+static void walk_dir(struct walk *w, int fd)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	int type;
+
+	dir = fdopendir(fd);
+	if (NULL == dir) {
+		report_error(w, NULL, errno);
+		close(fd);
+		return;
+	}
+
+	while (!stopped(w)) {
+		errno = 0;
+		de = readdir(dir);
+		if (NULL == de) {
+			if (0 != errno)
+				report_error(w, NULL, errno);
+			break;
+		}
+		if (0 == strcmp(de->d_name, ".") ||
+				0 == strcmp(de->d_name, ".."))
+			continue;
+
+		type = de->d_type;
+		if (DT_UNKNOWN == type) {
+			if (-1 == fstatat(dirfd(dir), de->d_name, &st,
+						AT_SYMLINK_NOFOLLOW)) {
+				report_error(w, de->d_name, errno);
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR :
+				S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+		}
+		process(w, dirfd(dir), de->d_name, type);
+	}
+
+	closedir(dir);
+}
+
+/*
+ * processes an entry and, for directories, their content, which is processed
+ * before the directory for removals, but after for permission changes, for
+ * the walk to be able to enter directories made accessible
+ */
+static void process(struct walk *w, int dirfd, const char *name, int type)
+{
+	int fd;
+	size_t len = w->len;
+	size_t name_len = strlen(name);
+
+	if (DT_DIR != type) {
+		apply(w, dirfd, name, type);
+		return;
+	}
+
+	if (DF_TREE_REMOVE != w->op)
+		apply(w, dirfd, name, type);
+
+	if (len + 1 + name_len >= sizeof(w->path)) {
+		report_error(w, name, ENAMETOOLONG);
+		return;
+	}
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			O_CLOEXEC);
+	if (-1 == fd) {
+		report_error(w, name, errno);
+	} else {
+		w->path[len] = '/';
+		memcpy(w->path + len + 1, name, name_len + 1);
+		w->len = len + 1 + name_len;
+		walk_dir(w, fd);
+		w->len = len;
+		w->path[len] = '\0';
+	}
+
+	/* a directory partially emptied can't be removed anyway */
+	if (DF_TREE_REMOVE == w->op && !w->stopped)
+		apply(w, dirfd, name, type);
+}
+
+/* creates path and it's missing ancestors, like mkdir -p */
+static void make_dirs(struct walk *w, const char *path)
+{
+	char *p;
+	int last;
+	struct stat st;
+	/* ancestors must stay writable and searchable, for their children */
+	mode_t parent_mode = w->mode | S_IWUSR | S_IXUSR;
+
+	snprintf(w->path, sizeof(w->path), "%s", path);
+	for (p = w->path + 1; ; p++) {
+		last = '\0' == *p;
+		/* skip the components but the last, and repeated slashes */
+		if (!last && ('/' != *p || '/' == p[-1]))
+			continue;
+
+		*p = '\0';
+		if (0 == mkdir(w->path, last ? w->mode : parent_mode))
+			w->report->done++;
+		else if (EEXIST != errno || -1 == stat(w->path, &st))
+			break;
+		else if (!S_ISDIR(st.st_mode)) {
+			errno = ENOTDIR;
+			break;
+		}
+		if (last)
+			return;
+		*p = '/';
+	}
+
+	w->len = strlen(w->path);
+	report_error(w, NULL, errno);
+}
+
+int df_tree_run(enum df_tree_op op, const char *path, mode_t mode, uid_t uid,
+		gid_t gid, int (*cancelled)(void),
+		struct df_tree_report *report)
+{
+	int ret;
+	size_t len;
+	struct stat st;
+	struct df_path at;
+	char root[PATH_MAX];
+	struct walk w = {
+		.op = op,
+		.mode = mode & 07777,
+		.uid = uid,
+		.gid = gid,
+		.report = report,
+		.cancelled = cancelled,
+	};
+
+	memset(report, 0, sizeof(*report));
+	len = strlen(path);
+	if ('/' != path[0] || len >= sizeof(root))
+		return -EINVAL;
+	/* trailing slashes would resolve the entry as "." */
+	while (len > 1 && '/' == path[len - 1])
+		len--;
+	memcpy(root, path, len);
+	root[len] = '\0';
+
+	if (DF_TREE_MKDIR == op) {
+		if (1 < len)
+			make_dirs(&w, root);
+		return 0;
+	}
+	/* same as rm's --preserve-root */
+	if (DF_TREE_REMOVE == op && 1 == len)
+		return -EPERM;
+
+	ret = DF_PATH_AT(&at, root, fstatat(at.dirfd, at.name, &st,
+				AT_SYMLINK_NOFOLLOW));
+	if (-1 == ret)
+		return -errno;
+
+	/* error messages are built as the parent's path, plus the entry's */
+	w.len = 1 == len ? 0 : (size_t)(at.name - root - 1);
+	memcpy(w.path, root, w.len);
+	w.path[w.len] = '\0';
+	process(&w, at.dirfd, at.name, S_ISDIR(st.st_mode) ? DT_DIR :
+			S_ISLNK(st.st_mode) ? DT_LNK : DT_REG);
+
+	if (DF_TREE_REMOVE == op)
+		df_path_invalidate(root);
+
+	return w.stopped ? -ECANCELED : 0;
+}
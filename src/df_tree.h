@@ -0,0 +1,51 @@
+#ifndef DF_TREE_H
+#define DF_TREE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* maximum size of the error messages reported, further errors are counted */
+#define DF_TREE_ERRORS_MAX 8192
+
+/* operations applied to a whole tree, values are part of the protocol */
+enum df_tree_op {
+	DF_TREE_REMOVE, /**< rm -rf */
+	DF_TREE_CHMOD,  /**< chmod -R */
+	DF_TREE_CHOWN,  /**< chown -hR */
+	DF_TREE_MKDIR,  /**< mkdir -p */
+};
+
+/**
+ * @struct df_tree_report
+ * @brief summary of a tree operation
+ */
+struct df_tree_report {
+	/** number of entries successfully processed */
+	int64_t done;
+	/** number of entries on which the operation failed */
+	int64_t failed;
+	/** "path: error\n" lines for the first errors, NULL if there is none */
+	char *errors;
+	size_t errors_size;
+};
+
+/**
+ * applies an operation to path and, apart for DF_TREE_MKDIR, to all the
+ * entries under it, without following symbolic links, nor stopping on errors,
+ * which are accounted for in the report
+ * @param op Operation to apply
+ * @param path Absolute path of the root of the tree
+ * @param mode Mode for DF_TREE_CHMOD and DF_TREE_MKDIR
+ * @param uid User for DF_TREE_CHOWN, -1 not to change it
+ * @param gid Group for DF_TREE_CHOWN, -1 not to change it
+ * @param cancelled Called from time to time, the walk stops if it returns
+ * non-zero, can be NULL
+ * @param report Filled with the results, errors must be freed by the caller
+ * @return 0 if the operation could be started, -ECANCELED if it was stopped,
+ * errno-compatible negative value otherwise, e.g. if path doesn't exist
+ */
+int df_tree_run(enum df_tree_op op, const char *path, mode_t mode, uid_t uid,
+		gid_t gid, int (*cancelled)(void),
+		struct df_tree_report *report);
+
+#endif /* DF_TREE_H */
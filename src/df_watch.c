@@ -0,0 +1,285 @@
+/**
+ * @file df_watch.c
+ *
+ * Watches of the directories accessed by the host, their events being pushed
+ * to it as DF_OP_NOTIFY messages
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+
+#include "df_protocol.h"
+#include "df_watch.h"
+
+#define DF_WATCH_EVENTS (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | \
+		IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+		IN_ONLYDIR | IN_EXCL_UNLINK)
+
+/*
+ * maximum number of directories watched, for the memory the kernel uses for
+ * them to be bounded, the least recently used watch being removed to make room
+ * for a new one when it, or the limit of the user, is reached
+ */
+#define DF_WATCH_MAX 65536
+
+static int watch_fd = -1;
+
+/* directory watched */
+struct watch {
+	/* NULL if the watch descriptor isn't used */
+	char *path;
+	/* value of ticks when the directory was last watched */
+	uint64_t used;
+	/*
+	 * non-zero if the watch was removed to make room, it's path being
+	 * reported as DF_NOTIFY_OVERFLOW when the kernel acknowledges it
+	 */
+	int dropped;
+};
+
+/* directories watched, indexed by watch descriptor */
+static struct watch *watches;
+static int watches_size;
+/* number of watches not dropped */
+static int count;
+static uint64_t ticks;
+
+/*
+ * last directory added, lookups come in rows in the same directory, for which
+ * the watch is added once
+ */
+static char last[PATH_MAX];
+static int last_wd;
+
+int df_watch_init(void)
+{
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	return -1 == watch_fd ? -errno : watch_fd;
+}
+
+int df_watch_fd(void)
+{
+	return watch_fd;
+}
+
+static int set_path(int wd, const char *path)
+{
+	int size;
+	struct watch *tmp;
+	struct watch *w;
+
+	if (wd >= watches_size) {
+		size = wd + 1 > 2 * watches_size ? wd + 1 : 2 * watches_size;
+		tmp = realloc(watches, size * sizeof(*watches));
+		if (NULL == tmp)
+			return -errno;
+		memset(tmp + watches_size, 0,
+				(size - watches_size) * sizeof(*watches));
+		watches = tmp;
+		watches_size = size;
+	}
+	w = watches + wd;
+	w->used = ++ticks;
+	/* the directory may have been watched under another name */
+	if (NULL != w->path && 0 == strcmp(w->path, path))
+		return 0;
+	if (NULL == w->path || w->dropped)
+		count++;
+	w->dropped = 0;
+	free(w->path);
+	w->path = strdup(path);
+
+	return NULL == w->path ? -ENOMEM : 0;
+}
+
+/*
+ * removes a watch, the host being told it's events are lost once the kernel
+ * acknowledged the removal, see df_watch_read
+ */
+static void drop(int wd)
+{
+	if (wd == last_wd)
+		last[0] = '\0';
+	watches[wd].dropped = 1;
+	count--;
+	inotify_rm_watch(watch_fd, wd);
+}
+
+/*
+ * removes the least recently used watch
+ * @return 0 on success, -ENOSPC if there is no watch to remove
+ */
+static int drop_oldest(void)
+{
+	int wd;
+	int oldest = -1;
+
+	for (wd = 0; wd < watches_size; wd++)
+		if (NULL != watches[wd].path && !watches[wd].dropped &&
+				(-1 == oldest ||
+				 watches[wd].used < watches[oldest].used))
+			oldest = wd;
+	if (-1 == oldest)
+		return -ENOSPC;
+	drop(oldest);
+
+	return 0;
+}
+
+int df_watch_dir(const char *path)
+{
+	int wd;
+	int ret;
+
+	if (-1 == watch_fd)
+		return -ENOSYS;
+	if (strlen(path) >= PATH_MAX)
+		return -ENAMETOOLONG;
+	if ('\0' != last[0] && 0 == strcmp(last, path)) {
+		watches[last_wd].used = ++ticks;
+		return 0;
+	}
+
+	wd = inotify_add_watch(watch_fd, path, DF_WATCH_EVENTS);
+	/* the limit of the user may be lower, or shared with others */
+	if (-1 == wd && ENOSPC == errno && 0 == drop_oldest())
+		wd = inotify_add_watch(watch_fd, path, DF_WATCH_EVENTS);
+	if (-1 == wd)
+		return -errno;
+	ret = set_path(wd, path);
+	if (0 > ret) {
+		inotify_rm_watch(watch_fd, wd);
+		return ret;
+	}
+	/* the new watch being the most recently used, it's kept */
+	if (count > DF_WATCH_MAX)
+		drop_oldest();
+	strcpy(last, path);
+	last_wd = wd;
+
+	return 0;
+}
+
+int df_watch_parent(const char *path)
+{
+	char dir[PATH_MAX];
+	const char *slash = strrchr(path, '/');
+
+	if (NULL == slash || (size_t)(slash - path) >= sizeof(dir))
+		return -EINVAL;
+
+	/* the parent of the root is itself */
+	snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 :
+			(int)(slash - path), path);
+
+	return df_watch_dir(dir);
+}
+
+static uint32_t flags_of(uint32_t mask)
+{
+	uint32_t flags = 0;
+
+	if (mask & (IN_ATTRIB | IN_MODIFY))
+		flags |= DF_NOTIFY_CHANGE;
+	if (mask & (IN_CREATE | IN_MOVED_TO))
+		flags |= DF_NOTIFY_CREATE;
+	if (mask & (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF))
+		flags |= DF_NOTIFY_REMOVE;
+
+	return flags;
+}
+
+/* a directory removed, or whose watch was, is forgotten */
+static void forget(int wd)
+{
+	struct watch *w = watches + wd;
+
+	if (wd == last_wd)
+		last[0] = '\0';
+	if (NULL != w->path && !w->dropped)
+		count--;
+	free(w->path);
+	w->path = NULL;
+	w->dropped = 0;
+}
+
+int df_watch_read(df_watch_cb cb, void *ctx)
+{
+	ssize_t ret;
+	char *p;
+	uint32_t flags;
+	uint32_t prev_flags = 0;
+	const char *dir;
+	const struct inotify_event *ev;
+	char path[PATH_MAX];
+	char prev[PATH_MAX] = "";
+	char buf[64 * 1024]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		ret = read(watch_fd, buf, sizeof(buf));
+		if (-1 == ret)
+			return EAGAIN == errno || EINTR == errno ? 0 : -errno;
+
+		for (p = buf; p < buf + ret; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				cb("/", DF_NOTIFY_OVERFLOW, ctx);
+				continue;
+			}
+			if (0 > ev->wd || ev->wd >= watches_size ||
+					NULL == watches[ev->wd].path)
+				continue;
+			dir = watches[ev->wd].path;
+			if (ev->mask & IN_IGNORED) {
+				/* it's changes aren't reported anymore */
+				if (watches[ev->wd].dropped)
+					cb(dir, DF_NOTIFY_OVERFLOW, ctx);
+				forget(ev->wd);
+				continue;
+			}
+
+			if (0 == ev->len)
+				snprintf(path, sizeof(path), "%s", dir);
+			else
+				snprintf(path, sizeof(path), "%s/%s",
+						0 == strcmp(dir, "/") ? "" : dir,
+						ev->name);
+			flags = flags_of(ev->mask);
+			if (flags != prev_flags || 0 != strcmp(path, prev))
+				cb(path, flags, ctx);
+			strcpy(prev, path);
+			prev_flags = flags;
+
+			/*
+			 * it's path is stale, it's removed, for those relying
+			 * on it to know it's events aren't reported anymore
+			 */
+			if ((ev->mask & IN_MOVE_SELF) &&
+					!watches[ev->wd].dropped)
+				drop(ev->wd);
+		}
+	}
+}
+
+void df_watch_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < watches_size; i++)
+		free(watches[i].path);
+	free(watches);
+	watches = NULL;
+	watches_size = 0;
+	count = 0;
+	last[0] = '\0';
+	if (-1 != watch_fd)
+		close(watch_fd);
+	watch_fd = -1;
+}
@@ -0,0 +1,49 @@
+#ifndef DF_WATCH_H
+#define DF_WATCH_H
+
+#include <stdint.h>
+
+/*
+ * watches, with inotify, the directories the host accessed, for it to be
+ * notified of the changes made by others, e.g. the applications
+ */
+
+/**
+ * receiver of the changes, flags being a combination of enum df_notify_flags
+ */
+typedef void (*df_watch_cb)(const char *path, uint32_t flags, void *ctx);
+
+/**
+ * @return inotify file descriptor, to poll for events, or errno-compatible
+ * negative value on error, in which case nothing is watched
+ */
+int df_watch_init(void);
+
+/* @return inotify file descriptor, -1 if df_watch_init failed */
+int df_watch_fd(void);
+
+/**
+ * starts watching a directory, if it isn't already, the least recently used
+ * one being removed if there are too many, in which case it's reported as a
+ * DF_NOTIFY_OVERFLOW
+ * @return 0 on success, errno-compatible negative value on error, in which
+ * case the host mustn't cache what it learns about the directory
+ */
+int df_watch_dir(const char *path);
+
+/**
+ * watches the directory containing path
+ * @return see df_watch_dir
+ */
+int df_watch_parent(const char *path);
+
+/**
+ * reads the pending events without blocking, calling cb once per change,
+ * consecutive duplicates being merged
+ * @return 0 on success, errno-compatible negative value on error
+ */
+int df_watch_read(df_watch_cb cb, void *ctx);
+
+void df_watch_cleanup(void);
+
+#endif /* DF_WATCH_H */